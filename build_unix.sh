@@ -6,7 +6,7 @@ cd code_generator
 ./generate_makefile.py
 make -j $cpu_count
 cd ../generated_files
-../code_generator/code_generator cpu.generated.h cpu.generated.cpp
+../code_generator/code_generator cpu.generated.h cpu.generated.cpp --threaded-dispatch --jit
 cd ../pdboy
 
 LIBS=$(pkg-config --libs sdl2)
@@ -3,10 +3,14 @@
 #include <iomanip>
 #include <type_traits>
 #include <algorithm>
+#include <regex>
 
 #define TEMPTYPE "main_integer_t"
 #define TEMPDECL "\t" TEMPTYPE " "
 #define CONSTTEMPDECL "\tconst " TEMPTYPE " "
+//Placeholder for leaving the opcode early. It becomes a return in the opcode
+//functions and a goto in the threaded dispatch function.
+#define EARLY_EXIT "@early_exit@"
 
 //#define GENERATE_CHECKS
 
@@ -16,6 +20,33 @@ static std::string get_temp_name(unsigned i){
 	return stream.str();
 }
 
+static std::string replace_early_exit(std::string contents, const std::string &replacement){
+	std::string placeholder = EARLY_EXIT;
+	for (size_t i = contents.find(placeholder); i != contents.npos; i = contents.find(placeholder, i + replacement.size()))
+		contents.replace(i, placeholder.size(), replacement);
+	return contents;
+}
+
+//Marks the temporaries an opcode body declares but never reads as used, so
+//that the threaded dispatch function doesn't repeat their warnings.
+static std::string mark_unused_temporaries(const std::string &contents){
+	static const std::regex declaration("\t(?:const )?" TEMPTYPE " (temp[0-9]+) = .*");
+	std::stringstream ret;
+	std::istringstream stream(contents);
+	std::string line;
+	while (std::getline(stream, line)){
+		ret << line << "\n";
+		std::smatch match;
+		if (!std::regex_match(line, match, declaration))
+			continue;
+		std::regex use("\\b" + match[1].str() + "\\b");
+		auto uses = std::distance(std::sregex_iterator(contents.begin(), contents.end(), use), std::sregex_iterator());
+		if (uses == 1)
+			ret << "\t(void)" << match[1] << ";\n";
+	}
+	return ret.str();
+}
+
 template <typename T>
 static T *copy(const T &x){
 	return new T(x);
@@ -131,18 +162,41 @@ InterpreterCodeGenerator::~InterpreterCodeGenerator(){
 #define SECOND_OPCODE_TABLE "opcode_table_cb"
 #define MAIN_JUMPS_TABLE "opcode_is_jump_table"
 #define SECOND_JUMPS_TABLE "opcode_is_jump_table_cb"
+#define MAIN_LENGTHS_TABLE "opcode_length_table"
+#define SECOND_LENGTHS_TABLE "opcode_length_table_cb"
+#define MAIN_CYCLES_TABLE "opcode_cycles_table"
+#define SECOND_CYCLES_TABLE "opcode_cycles_table_cb"
+#define THREADED_DISPATCH_FUNCTION "run_threaded"
+#define THREADED_DISPATCH_MACRO "GENERATED_THREADED_DISPATCH"
+#define CONFIGURATION_MACRO "GENERATED_CONFIGURATION"
+#define LAZY_FLAGS_MACRO "GENERATED_LAZY_FLAGS"
 
 void InterpreterCodeGenerator::dump_declarations(std::ostream &stream){
+	//RegisterStore.h needs to know how the flags are stored before GameboyCpu
+	//is declared, so it includes the file a first time with
+	//GENERATED_CONFIGURATION defined, to get only these.
+	stream << "#ifdef " CONFIGURATION_MACRO "\n";
+	if (this->lazy_flags)
+		stream << "#define " LAZY_FLAGS_MACRO "\n";
 	stream
+		<< "#else\n"
 		<< "typedef void (" << this->class_name << "::*opcode_function_pointer)();\n"
 		<< "opcode_function_pointer " MAIN_OPCODE_TABLE "[256];\n"
 		<< "opcode_function_pointer " SECOND_OPCODE_TABLE "[256];\n"
 		<< "static const bool " MAIN_JUMPS_TABLE "[256];\n"
 		<< "static const bool " SECOND_JUMPS_TABLE "[256];\n"
+		<< "static const byte_t " MAIN_LENGTHS_TABLE "[256];\n"
+		<< "static const byte_t " SECOND_LENGTHS_TABLE "[256];\n"
+		<< "static const byte_t " MAIN_CYCLES_TABLE "[256];\n"
+		<< "static const byte_t " SECOND_CYCLES_TABLE "[256];\n"
 		<< "void " OPCODE_TABLE_INIT_FUNCTION "();\n";
 	for (auto &kv : this->functions)
 		stream << "void " << kv.first << "();\n";
-	stream << "\n";
+	if (this->threaded_dispatch)
+		stream
+			<< "#define " THREADED_DISPATCH_MACRO "\n"
+			<< "void " THREADED_DISPATCH_FUNCTION "(const CachedInstruction *, std::uint32_t generation);\n";
+	stream << "#endif\n\n";
 }
 
 void InterpreterCodeGenerator::dump_definitions(std::ostream &stream){
@@ -168,10 +222,13 @@ void InterpreterCodeGenerator::dump_definitions(std::ostream &stream){
 			continue;
 		stream
 			<< "void " << this->class_name << "::" << kv.first << "(){\n"
-			<< kv.second.contents.str()
+			<< replace_early_exit(kv.second.contents.str(), "return;")
 			<< "}\n\n";
 	}
 
+	if (this->threaded_dispatch)
+		this->dump_threaded_dispatch(stream);
+
 	// Tables.
 
 	stream << "const bool " << this->class_name << "::" MAIN_JUMPS_TABLE "[256] = { ";
@@ -189,6 +246,74 @@ void InterpreterCodeGenerator::dump_definitions(std::ostream &stream){
 		stream << (kv.second.opcode_is_jump ? "true, " : "false, ");
 	}
 	stream << "};\n\n";
+
+	//Instruction lengths include the opcode (and the prefix, for CB opcodes).
+
+	stream << "const byte_t " << this->class_name << "::" MAIN_LENGTHS_TABLE "[256] = { ";
+	for (auto &kv : this->functions){
+		if (kv.second.double_opcode)
+			continue;
+		stream << 1 + kv.second.operand_bytes << ", ";
+	}
+	stream << "};\n\n";
+
+	stream << "const byte_t " << this->class_name << "::" SECOND_LENGTHS_TABLE "[256] = { ";
+	for (auto &kv : this->functions){
+		if (!kv.second.double_opcode)
+			continue;
+		stream << 2 + kv.second.operand_bytes << ", ";
+	}
+	stream << "};\n\n";
+
+	stream << "const byte_t " << this->class_name << "::" MAIN_CYCLES_TABLE "[256] = { ";
+	for (auto &kv : this->functions){
+		if (kv.second.double_opcode)
+			continue;
+		stream << kv.second.max_cycles << ", ";
+	}
+	stream << "};\n\n";
+
+	stream << "const byte_t " << this->class_name << "::" SECOND_CYCLES_TABLE "[256] = { ";
+	for (auto &kv : this->functions){
+		if (!kv.second.double_opcode)
+			continue;
+		stream << kv.second.max_cycles << ", ";
+	}
+	stream << "};\n\n";
+}
+
+void InterpreterCodeGenerator::dump_threaded_dispatch(std::ostream &stream){
+	//Label i runs opcode i, and label 256 + i runs opcode CB i.
+	std::vector<std::string> labels(512);
+	for (auto &kv : this->functions)
+		labels[kv.second.opcode + (kv.second.double_opcode ? 256 : 0)] = "label_" + kv.first;
+
+	stream
+		<< "void " << this->class_name << "::" THREADED_DISPATCH_FUNCTION "(const CachedInstruction *instruction, std::uint32_t generation){\n"
+		<< "\tstatic const void * const labels[512] = {\n";
+	for (auto &label : labels)
+		stream << "\t\t&&" << label << ",\n";
+	stream
+		<< "\t};\n"
+		<< "\tgoto *labels[this->begin_threaded_instruction(*instruction)];\n\n";
+
+	//Every opcode does its own dispatch, so that each indirect jump gets its
+	//own branch prediction history.
+	for (auto &kv : this->functions){
+		auto label = "label_" + kv.first;
+		stream
+			<< label << ":\n"
+			<< "{\n"
+			<< mark_unused_temporaries(replace_early_exit(kv.second.contents.str(), "goto " + label + "_end;"))
+			<< "}\n";
+		if (kv.second.exits_early)
+			stream << label << "_end:\n";
+		stream
+			<< "\tif (!this->continue_threaded(instruction, generation))\n"
+			<< "\t\treturn;\n"
+			<< "\tgoto *labels[this->begin_threaded_instruction(*instruction)];\n\n";
+	}
+	stream << "}\n\n";
 }
 
 void InterpreterCodeGenerator::begin_opcode_definition(unsigned first){
@@ -199,6 +324,9 @@ void InterpreterCodeGenerator::begin_opcode_definition(unsigned first){
 	value.opcode = first;
 	value.double_opcode = false;
 	value.opcode_is_jump = false;
+	value.operand_bytes = 0;
+	value.max_cycles = 0;
+	value.exits_early = false;
 	auto contents = &value.contents;
 	this->definition_stack.push_back({ contents, &value, 0 });
 }
@@ -218,6 +346,9 @@ void InterpreterCodeGenerator::begin_double_opcode_definition(unsigned first, un
 	value.opcode = second;
 	value.double_opcode = true;
 	value.opcode_is_jump = false;
+	value.operand_bytes = 0;
+	value.max_cycles = 0;
+	value.exits_early = false;
 	auto contents = &value.contents;
 	this->definition_stack.push_back({ contents, &value, 0 });
 }
@@ -247,7 +378,8 @@ uintptr_t InterpreterCodeGenerator::load_program_counter8(){
 	auto &s = *back.function_contents;
 	auto &n = back.temporary_index;
 	auto result_name = get_temp_name(n++);
-	s << TEMPDECL << result_name << " = this->load_pc_and_increment();\n";
+	s << TEMPDECL << result_name << " = this->load_operand8();\n";
+	back.function->operand_bytes += 1;
 	auto ret = copy(result_name);
 	this->temporary_values.push_back(ret);
 	return (uintptr_t)ret;
@@ -257,12 +389,9 @@ uintptr_t InterpreterCodeGenerator::load_program_counter16(){
 	auto &back = this->definition_stack.back();
 	auto &s = *back.function_contents;
 	auto &n = back.temporary_index;
-	auto temp_name = get_temp_name(n++);
 	auto result_name = get_temp_name(n++);
-	s
-		<< TEMPDECL << temp_name << " = " << to_string_r(Register16::PC) << ";\n"
-		<< "\t" << to_string_w(Register16::PC) << " = (std::uint16_t)(" << temp_name << " + 2);\n"
-		<< TEMPDECL << result_name << " = this->memory_controller.load16(" << temp_name << ");\n";
+	s << TEMPDECL << result_name << " = this->load_operand16();\n";
+	back.function->operand_bytes += 2;
 	auto ret = copy(result_name);
 	this->temporary_values.push_back(ret);
 	return (uintptr_t)ret;
@@ -387,6 +516,7 @@ void InterpreterCodeGenerator::take_time(unsigned cycles){
 	auto &back = this->definition_stack.back();
 	auto &s = *back.function_contents;
 	s << "\tthis->take_time(" << cycles << ");\n";
+	back.function->max_cycles = std::max(back.function->max_cycles, cycles);
 }
 
 void InterpreterCodeGenerator::zero_flags(){
@@ -622,6 +752,10 @@ static std::pair<std::string, std::string> to_string(const FlagSetting &setting)
 }
 
 void InterpreterCodeGenerator::set_flags(const FlagSettings &fs){
+	if (this->lazy_flags){
+		this->set_lazy_flags(fs);
+		return;
+	}
 	auto &back = this->definition_stack.back();
 	auto &s = *back.function_contents;
 	std::pair<FlagSetting, const char *> settings[] = {
@@ -677,6 +811,59 @@ void InterpreterCodeGenerator::set_flags(const FlagSettings &fs){
 	s << "\tthis->registers.set_flags(" << A << ", " << B << ");\n";
 }
 
+static std::string to_lazy_flag_value(const FlagSetting &setting){
+	switch (setting.op){
+		case FlagSetting::Operation::Reset:
+			return "0";
+		case FlagSetting::Operation::Set:
+			return "1";
+		case FlagSetting::Operation::IfNonZero:
+			return temp_to_string(setting.src_value);
+		case FlagSetting::Operation::IfZero:
+			return "!" + temp_to_string(setting.src_value);
+		default:
+			abort();
+	}
+	return std::string();
+}
+
+void InterpreterCodeGenerator::set_lazy_flags(const FlagSettings &fs){
+	auto &back = this->definition_stack.back();
+	auto &s = *back.function_contents;
+	std::pair<const FlagSetting *, const char *> settings[] = {
+		{&fs.zero, "Flags::Zero"},
+		{&fs.subtract, "Flags::Subtract"},
+		{&fs.half_carry, "Flags::HalfCarry"},
+		{&fs.carry, "Flags::Carry"},
+	};
+	bool depends_on_previous = false;
+	for (auto &setting : settings)
+		if (setting.first->op == FlagSetting::Operation::Keep || setting.first->op == FlagSetting::Operation::Flip)
+			depends_on_previous = true;
+
+	if (!depends_on_previous){
+		s << "\tthis->registers.set_lazy_flags(";
+		for (auto &setting : settings)
+			s << (&setting != settings ? ", " : "") << to_lazy_flag_value(*setting.first);
+		s << ");\n";
+		return;
+	}
+
+	s << "\tthis->registers.unpack_flags();\n";
+	for (auto &setting : settings){
+		switch (setting.first->op){
+			case FlagSetting::Operation::Keep:
+				break;
+			case FlagSetting::Operation::Flip:
+				s << "\tthis->registers.flip_lazy_flag(" << setting.second << ");\n";
+				break;
+			default:
+				s << "\tthis->registers.set_lazy_flag(" << setting.second << ", " << to_lazy_flag_value(*setting.first) << ");\n";
+				break;
+		}
+	}
+}
+
 uintptr_t InterpreterCodeGenerator::plus_1(uintptr_t val){
 	auto &back = this->definition_stack.back();
 	auto &s = *back.function_contents;
@@ -916,8 +1103,10 @@ void InterpreterCodeGenerator::do_nothing_if(uintptr_t val, unsigned take_time,
 	s
 		<< temp_to_string(val) << "){\n"
 		<< "\t\tthis->take_time(" << take_time << ");\n"
-		<< "\t\treturn;\n"
+		<< "\t\t" EARLY_EXIT "\n"
 		<< "\t}\n";
+	back.function->exits_early = true;
+	back.function->max_cycles = std::max(back.function->max_cycles, take_time);
 }
 
 uintptr_t InterpreterCodeGenerator::condition_to_value(ConditionalJumpType type){
@@ -11,6 +11,12 @@ class InterpreterCodeGenerator : public CodeGenerator{
 		int opcode;
 		bool double_opcode;
 		bool opcode_is_jump;
+		//Number of immediate bytes following the opcode.
+		unsigned operand_bytes;
+		//Cycles taken by the slowest path through the opcode.
+		unsigned max_cycles;
+		//Whether contents contains EARLY_EXIT.
+		bool exits_early;
 		std::stringstream contents;
 	};
 	std::map<std::string, Function> functions;
@@ -22,8 +28,11 @@ class InterpreterCodeGenerator : public CodeGenerator{
 	std::vector<DefinitionContext> definition_stack;
 	std::vector<std::string *> temporary_values;
 	std::string class_name;
+	bool threaded_dispatch;
+	bool lazy_flags;
 
 	std::array<uintptr_t, 3> add(uintptr_t, uintptr_t, unsigned operand_size, unsigned modulo = 8);
+	void set_lazy_flags(const FlagSettings &);
 protected:
 	void begin_opcode_definition(unsigned first) override;
 	void end_opcode_definition(unsigned first) override;
@@ -31,10 +40,20 @@ protected:
 	void end_double_opcode_definition(unsigned first, unsigned second) override;
 	void opcode_cb_branching() override;
 public:
-	InterpreterCodeGenerator(std::shared_ptr<CpuDefinition> definition, const char *class_name): CodeGenerator(definition), class_name(class_name){}
+	//If threaded_dispatch is set, a function that runs a sequence of cached
+	//instructions is also generated, with every opcode inlined into it and
+	//dispatched with computed gotos. This requires GCC or Clang.
+	//If lazy_flags is set, instructions store the values the flags are derived
+	//from (see RegisterStore::set_lazy_flags()) instead of computing F.
+	InterpreterCodeGenerator(std::shared_ptr<CpuDefinition> definition, const char *class_name, bool threaded_dispatch = false, bool lazy_flags = false):
+		CodeGenerator(definition),
+		class_name(class_name),
+		threaded_dispatch(threaded_dispatch),
+		lazy_flags(lazy_flags){}
 	~InterpreterCodeGenerator();
 	void dump_definitions(std::ostream &stream);
 	void dump_declarations(std::ostream &stream);
+	void dump_threaded_dispatch(std::ostream &stream);
 
 
 	// Overrides:
@@ -0,0 +1,557 @@
+#include "JitCodeGenerator.h"
+#include "FlagSetting.h"
+#include <iomanip>
+#include <algorithm>
+
+#define EMITTER_TABLE_TYPE "jit_emitter_pointer"
+#define MAIN_EMITTER_TABLE "jit_emitter_table"
+#define SECOND_EMITTER_TABLE "jit_emitter_table_cb"
+#define EMITTER_PARAMETERS "(JitEmitter &e, const std::uint8_t *operands)"
+#define CONFIGURATION_MACRO "GENERATED_CONFIGURATION"
+#define JIT_MACRO "GENERATED_JIT"
+#define USE_JIT_MACRO "USE_JIT"
+
+static const char *to_string(Register8 reg){
+	switch (reg){
+		case Register8::B:
+			return "Register8::B";
+		case Register8::C:
+			return "Register8::C";
+		case Register8::D:
+			return "Register8::D";
+		case Register8::E:
+			return "Register8::E";
+		case Register8::H:
+			return "Register8::H";
+		case Register8::L:
+			return "Register8::L";
+		case Register8::A:
+			return "Register8::A";
+		default:
+			return nullptr;
+	}
+}
+
+static const char *to_string(Register16 reg){
+	switch (reg){
+		case Register16::AF:
+			return "Register16::AF";
+		case Register16::BC:
+			return "Register16::BC";
+		case Register16::DE:
+			return "Register16::DE";
+		case Register16::HL:
+			return "Register16::HL";
+		case Register16::SP:
+			return "Register16::SP";
+		case Register16::PC:
+			return "Register16::PC";
+		default:
+			return nullptr;
+	}
+}
+
+void JitCodeGenerator::dump_declarations(std::ostream &stream){
+	//GameboyCpu.h only defines USE_JIT if GENERATED_JIT is defined and the
+	//host can run the generated code.
+	stream
+		<< "#ifdef " CONFIGURATION_MACRO "\n"
+		<< "#define " JIT_MACRO "\n"
+		<< "#elif defined " USE_JIT_MACRO "\n"
+		<< "typedef void (*" EMITTER_TABLE_TYPE ")(JitEmitter &, const std::uint8_t *);\n";
+	for (auto &kv : this->functions)
+		if (kv.second.supported)
+			stream << "static void " << kv.first << "(JitEmitter &, const std::uint8_t *);\n";
+	stream
+		<< "static const " EMITTER_TABLE_TYPE " " MAIN_EMITTER_TABLE "[256];\n"
+		<< "static const " EMITTER_TABLE_TYPE " " SECOND_EMITTER_TABLE "[256];\n"
+		<< "#endif\n\n";
+}
+
+void JitCodeGenerator::dump_function(std::ostream &stream, const Function &function){
+	//Leave out pure statements whose results are never used, such as the carry
+	//bits of instructions that don't set flags.
+	std::vector<const Statement *> statements;
+	std::vector<bool> used(function.slot_count, false);
+	for (auto i = function.statements.size(); i--;){
+		auto &statement = function.statements[i];
+		if (statement.pure && !used[statement.slots[0]])
+			continue;
+		for (auto slot : statement.slots)
+			used[slot] = true;
+		statements.push_back(&statement);
+	}
+	std::reverse(statements.begin(), statements.end());
+
+	std::vector<size_t> last_use(function.slot_count, 0);
+	for (size_t i = 0; i < statements.size(); i++)
+		for (auto slot : statements[i]->slots)
+			last_use[slot] = i;
+	for (size_t i = 0; i < statements.size(); i++){
+		stream << statements[i]->contents.str();
+		//Everything is released at the end of the instruction anyway.
+		if (i + 1 == statements.size())
+			break;
+		for (auto slot : statements[i]->slots){
+			if (last_use[slot] != i)
+				continue;
+			stream << "\te.release(" << slot << ");\n";
+			//Don't release twice if the statement names the slot twice.
+			last_use[slot] = statements.size();
+		}
+	}
+}
+
+void JitCodeGenerator::dump_definitions(std::ostream &stream){
+	stream << "#ifdef " USE_JIT_MACRO "\n\n";
+
+	for (auto &kv : this->functions){
+		if (!kv.second.supported)
+			continue;
+		stream << "void " << this->class_name << "::" << kv.first << EMITTER_PARAMETERS "{\n";
+		dump_function(stream, kv.second);
+		stream << "}\n\n";
+	}
+
+	//Unsupported opcodes are left null, and are executed by the interpreter.
+
+	stream << "const " << this->class_name << "::" EMITTER_TABLE_TYPE " " << this->class_name << "::" MAIN_EMITTER_TABLE "[256] = {\n";
+	for (auto &kv : this->functions){
+		if (kv.second.double_opcode)
+			continue;
+		if (kv.second.supported)
+			stream << "\t&" << this->class_name << "::" << kv.first << ",\n";
+		else
+			stream << "\tnullptr,\n";
+	}
+	stream << "};\n\n";
+
+	stream << "const " << this->class_name << "::" EMITTER_TABLE_TYPE " " << this->class_name << "::" SECOND_EMITTER_TABLE "[256] = {\n";
+	for (auto &kv : this->functions){
+		if (!kv.second.double_opcode)
+			continue;
+		if (kv.second.supported)
+			stream << "\t&" << this->class_name << "::" << kv.first << ",\n";
+		else
+			stream << "\tnullptr,\n";
+	}
+	stream << "};\n\n";
+
+	stream << "#endif\n";
+}
+
+void JitCodeGenerator::begin_opcode_definition(unsigned first){
+	std::stringstream stream;
+	stream << "jit_opcode_" << std::hex << std::setw(2) << std::setfill('0') << first;
+	auto &value = this->functions[stream.str()];
+	value.opcode = first;
+	value.double_opcode = false;
+	value.supported = true;
+	value.operand_bytes = 0;
+	value.slot_count = 0;
+	this->definition_stack.push_back(&value);
+}
+
+void JitCodeGenerator::end_opcode_definition(unsigned first){
+	this->definition_stack.pop_back();
+}
+
+void JitCodeGenerator::begin_double_opcode_definition(unsigned first, unsigned second){
+	std::stringstream stream;
+	stream
+		<< "jit_opcode_"
+		<< std::hex << std::setw(2) << std::setfill('0') << first
+		<< std::hex << std::setw(2) << std::setfill('0') << second;
+	auto &value = this->functions[stream.str()];
+	value.opcode = second;
+	value.double_opcode = true;
+	value.supported = true;
+	value.operand_bytes = 0;
+	value.slot_count = 0;
+	this->definition_stack.push_back(&value);
+}
+
+void JitCodeGenerator::end_double_opcode_definition(unsigned first, unsigned second){
+	this->definition_stack.pop_back();
+}
+
+void JitCodeGenerator::opcode_cb_branching(){
+	//CB-prefixed instructions are decoded directly to their second-level
+	//opcode, so the prefix itself never reaches the JIT.
+	this->unsupported();
+}
+
+uintptr_t JitCodeGenerator::new_slot(){
+	auto &f = this->current();
+	if (f.slot_count >= max_slots)
+		f.supported = false;
+	//Slot numbers are offset by one, since CpuDefinition treats 0 as "no value".
+	return ++f.slot_count;
+}
+
+std::stringstream &JitCodeGenerator::statement(std::initializer_list<uintptr_t> values, bool pure){
+	auto &statements = this->current().statements;
+	statements.emplace_back();
+	auto &statement = statements.back();
+	for (auto value : values)
+		statement.slots.push_back(slot(value));
+	statement.pure = pure;
+	return statement.contents;
+}
+
+uintptr_t JitCodeGenerator::unary(const char *op, uintptr_t a, bool pure){
+	auto ret = this->new_slot();
+	this->statement({ ret, a }, pure) << "\te." << op << "(" << slot(ret) << ", " << slot(a) << ");\n";
+	return ret;
+}
+
+uintptr_t JitCodeGenerator::binary(const char *op, uintptr_t a, uintptr_t b){
+	auto ret = this->new_slot();
+	this->statement({ ret, a, b }, true) << "\te." << op << "(" << slot(ret) << ", " << slot(a) << ", " << slot(b) << ");\n";
+	return ret;
+}
+
+uintptr_t JitCodeGenerator::binary_imm(const char *op, uintptr_t a, unsigned imm){
+	auto ret = this->new_slot();
+	this->statement({ ret, a }, true) << "\te." << op << "(" << slot(ret) << ", " << slot(a) << ", " << imm << ");\n";
+	return ret;
+}
+
+uintptr_t JitCodeGenerator::get_flag(unsigned bit){
+	auto f = this->new_slot();
+	this->statement({ f }, true) << "\te.load_flags(" << slot(f) << ");\n";
+	auto shifted = this->binary_imm("shr", f, bit);
+	return this->binary_imm("and_imm", shifted, 1);
+}
+
+void JitCodeGenerator::halt(){
+	this->unsupported();
+}
+
+uintptr_t JitCodeGenerator::load_program_counter8(){
+	auto &f = this->current();
+	auto ret = this->new_slot();
+	this->statement({ ret }, true) << "\te.immediate(" << slot(ret) << ", operands[" << f.operand_bytes << "]);\n";
+	f.operand_bytes++;
+	return ret;
+}
+
+uintptr_t JitCodeGenerator::load_program_counter16(){
+	auto &f = this->current();
+	auto ret = this->new_slot();
+	this->statement({ ret }, true) << "\te.immediate(" << slot(ret) << ", operands[" << f.operand_bytes << "] | (operands[" << f.operand_bytes + 1 << "] << 8));\n";
+	f.operand_bytes += 2;
+	return ret;
+}
+
+uintptr_t JitCodeGenerator::get_register_value8(Register8 reg){
+	auto ret = this->new_slot();
+	this->statement({ ret }, true) << "\te.load_register8(" << slot(ret) << ", " << to_string(reg) << ");\n";
+	return ret;
+}
+
+uintptr_t JitCodeGenerator::get_register_value16(Register16 reg){
+	auto ret = this->new_slot();
+	this->statement({ ret }, true) << "\te.load_register16(" << slot(ret) << ", " << to_string(reg) << ");\n";
+	return ret;
+}
+
+uintptr_t JitCodeGenerator::load_hl8(){
+	return this->load_mem8(this->get_register_value16(Register16::HL));
+}
+
+uintptr_t JitCodeGenerator::load_mem8(uintptr_t address){
+	return this->unary("load8", address, false);
+}
+
+uintptr_t JitCodeGenerator::load_io_register(uintptr_t address){
+	return this->unary("load8_io", address, false);
+}
+
+uintptr_t JitCodeGenerator::load_mem16(uintptr_t address){
+	return this->unary("load16", address, false);
+}
+
+uintptr_t JitCodeGenerator::load_sp_offset16(uintptr_t offset){
+	auto sp = this->get_register_value16(Register16::SP);
+	return this->load_mem16(this->binary("add", sp, offset));
+}
+
+void JitCodeGenerator::write_register8(Register8 reg, uintptr_t val){
+	this->statement({ val }) << "\te.store_register8(" << to_string(reg) << ", " << slot(val) << ");\n";
+}
+
+void JitCodeGenerator::write_register16(Register16 reg, uintptr_t val){
+	this->statement({ val }) << "\te.store_register16(" << to_string(reg) << ", " << slot(val) << ");\n";
+}
+
+void JitCodeGenerator::store_hl8(uintptr_t val){
+	this->store_mem8(this->get_register_value16(Register16::HL), val);
+}
+
+void JitCodeGenerator::store_mem8(uintptr_t mem, uintptr_t val){
+	this->statement({ mem, val }) << "\te.store8(" << slot(mem) << ", " << slot(val) << ");\n";
+}
+
+void JitCodeGenerator::store_io_register(uintptr_t mem, uintptr_t val){
+	this->statement({ mem, val }) << "\te.store8_io(" << slot(mem) << ", " << slot(val) << ");\n";
+}
+
+void JitCodeGenerator::store_mem16(uintptr_t mem, uintptr_t val){
+	this->statement({ mem, val }) << "\te.store16(" << slot(mem) << ", " << slot(val) << ");\n";
+}
+
+void JitCodeGenerator::take_time(unsigned cycles){
+	this->statement({}) << "\te.take_time(" << cycles << ");\n";
+}
+
+void JitCodeGenerator::zero_flags(){
+	auto zero = this->get_imm_value(0);
+	this->statement({ zero }) << "\te.store_flags(" << slot(zero) << ");\n";
+}
+
+std::array<uintptr_t, 3> JitCodeGenerator::add(uintptr_t valA, uintptr_t valB, unsigned operand_size, unsigned modulo){
+	unsigned half_carry_mask, full_carry_mask;
+	if (modulo == 8){
+		half_carry_mask = 0x10;
+		full_carry_mask = 0x100;
+	}else if (modulo == 16){
+		half_carry_mask = 0x1000;
+		full_carry_mask = 0x10000;
+	}else
+		::abort();
+	auto result = this->binary("add", valA, valB);
+	auto carry_bits = this->binary("xor_", valA, valB);
+	carry_bits = this->binary("xor_", carry_bits, result);
+	auto half_carry = this->binary_imm("and_imm", carry_bits, half_carry_mask);
+	auto full_carry = this->binary_imm("and_imm", carry_bits, full_carry_mask);
+
+	if (operand_size == 8)
+		result = this->binary_imm("and_imm", result, 0xFF);
+	else if (operand_size == 16)
+		result = this->binary_imm("and_imm", result, 0xFFFF);
+	else
+		::abort();
+
+	return { result, half_carry, full_carry };
+}
+
+uintptr_t JitCodeGenerator::sub16_no_carry(uintptr_t a, uintptr_t b){
+	return this->binary("sub", a, b);
+}
+
+std::array<uintptr_t, 3> JitCodeGenerator::add8_carry(uintptr_t valA, uintptr_t valB){
+	auto carry = this->get_flag(4);
+	auto result = this->binary("add", valA, valB);
+	result = this->binary("add", result, carry);
+	auto low_a = this->binary_imm("and_imm", valA, 0x0F);
+	auto low_b = this->binary_imm("and_imm", valB, 0x0F);
+	auto low_sum = this->binary("add", low_a, low_b);
+	low_sum = this->binary("add", low_sum, carry);
+	auto half_carry = this->binary_imm("is_at_least", low_sum, 0x0F);
+	auto full_carry = this->binary_imm("and_imm", result, 0x100);
+	result = this->binary_imm("and_imm", result, 0xFF);
+	return { result, half_carry, full_carry };
+}
+
+std::array<uintptr_t, 3> JitCodeGenerator::sub8(uintptr_t valA, uintptr_t valB){
+	auto result = this->binary("sub", valA, valB);
+	auto low_a = this->binary_imm("and_imm", valA, 0x0F);
+	auto low_b = this->binary_imm("and_imm", valB, 0x0F);
+	auto low_difference = this->binary("sub", low_a, low_b);
+	auto half_carry = this->unary("is_negative", low_difference);
+	auto full_carry = this->unary("is_negative", result);
+	result = this->binary_imm("and_imm", result, 0xFF);
+	return { result, half_carry, full_carry };
+}
+
+std::array<uintptr_t, 3> JitCodeGenerator::sub8_carry(uintptr_t valA, uintptr_t valB){
+	auto carry = this->get_flag(4);
+	auto result = this->binary("sub", valA, valB);
+	result = this->binary("sub", result, carry);
+	auto low_a = this->binary_imm("and_imm", valA, 0x0F);
+	auto low_b = this->binary_imm("and_imm", valB, 0x0F);
+	auto low_difference = this->binary("sub", low_a, low_b);
+	low_difference = this->binary("sub", low_difference, carry);
+	auto half_carry = this->unary("is_negative", low_difference);
+	auto full_carry = this->unary("is_negative", result);
+	result = this->binary_imm("and_imm", result, 0xFF);
+	return { result, half_carry, full_carry };
+}
+
+uintptr_t JitCodeGenerator::and8(uintptr_t valA, uintptr_t valB){
+	return this->binary("and_", valA, valB);
+}
+
+uintptr_t JitCodeGenerator::xor8(uintptr_t valA, uintptr_t valB){
+	return this->binary("xor_", valA, valB);
+}
+
+uintptr_t JitCodeGenerator::or8(uintptr_t valA, uintptr_t valB){
+	return this->binary("or_", valA, valB);
+}
+
+std::array<uintptr_t, 3> JitCodeGenerator::cmp8(uintptr_t valA, uintptr_t valB){
+	return this->sub8(valA, valB);
+}
+
+void JitCodeGenerator::set_flags(const FlagSettings &fs){
+	std::pair<FlagSetting, unsigned> settings[] = {
+		{fs.zero, 7},
+		{fs.subtract, 6},
+		{fs.half_carry, 5},
+		{fs.carry, 4},
+	};
+	//Same encoding as RegisterStore::set_flags(): bits in the mode mask are
+	//kept (or flipped, if also set in the value), the rest are replaced.
+	unsigned mode_mask = 0;
+	unsigned constant_value = 0;
+	std::vector<std::pair<uintptr_t, unsigned>> computed;
+	for (auto &setting : settings){
+		auto bit = 1U << setting.second;
+		switch (setting.first.op){
+			case FlagSetting::Operation::Reset:
+				break;
+			case FlagSetting::Operation::Set:
+				constant_value |= bit;
+				break;
+			case FlagSetting::Operation::Keep:
+				mode_mask |= bit;
+				break;
+			case FlagSetting::Operation::Flip:
+				mode_mask |= bit;
+				constant_value |= bit;
+				break;
+			case FlagSetting::Operation::IfZero:
+				computed.push_back({ this->unary("is_zero", setting.first.src_value), setting.second });
+				break;
+			case FlagSetting::Operation::IfNonZero:
+				computed.push_back({ this->unary("is_not_zero", setting.first.src_value), setting.second });
+				break;
+		}
+	}
+	auto value = this->get_imm_value(constant_value);
+	for (auto &p : computed)
+		value = this->binary("or_", value, this->binary_imm("shl", p.first, p.second));
+	this->statement({ value }) << "\te.update_flags(" << mode_mask << ", " << slot(value) << ");\n";
+}
+
+uintptr_t JitCodeGenerator::plus_1(uintptr_t val){
+	return this->binary_imm("add_imm", val, 1);
+}
+
+uintptr_t JitCodeGenerator::minus_1(uintptr_t val){
+	return this->binary_imm("sub_imm", val, 1);
+}
+
+uintptr_t JitCodeGenerator::bitwise_not(uintptr_t val){
+	return this->unary("not_", val);
+}
+
+void JitCodeGenerator::disable_interrupts(){
+	this->statement({}) << "\te.disable_interrupts();\n";
+}
+
+void JitCodeGenerator::enable_interrupts(){
+	this->statement({}) << "\te.enable_interrupts();\n";
+}
+
+void JitCodeGenerator::schedule_interrupt_enable(){
+	this->unsupported();
+}
+
+uintptr_t JitCodeGenerator::rotate8(uintptr_t val, bool left, bool using_carry){
+	uintptr_t result;
+	if (left){
+		if (using_carry){
+			auto carry = this->get_flag(4);
+			result = this->binary("or_", this->binary_imm("shl", val, 1), carry);
+		}else{
+			auto bits = this->binary_imm("and_imm", val, 0xFF);
+			result = this->binary("or_", this->binary_imm("shl", bits, 1), this->binary_imm("shr", bits, 7));
+		}
+	}else{
+		if (using_carry){
+			auto carry = this->binary_imm("shl", this->get_flag(4), 7);
+			result = this->binary("or_", this->binary_imm("shr", val, 1), carry);
+		}else{
+			auto bits = this->binary_imm("and_imm", val, 0xFF);
+			result = this->binary("or_", this->binary_imm("shr", bits, 1), this->binary_imm("shl", bits, 7));
+		}
+	}
+	return this->binary_imm("and_imm", result, 0xFF);
+}
+
+void JitCodeGenerator::stop(){
+	this->unsupported();
+}
+
+uintptr_t JitCodeGenerator::shift8_left(uintptr_t val){
+	return this->binary_imm("and_imm", this->binary_imm("shl", val, 1), 0xFF);
+}
+
+uintptr_t JitCodeGenerator::arithmetic_shift_right(uintptr_t val){
+	auto bits = this->binary_imm("and_imm", val, 0xFF);
+	return this->binary("or_", this->binary_imm("and_imm", bits, 0x80), this->binary_imm("shr", bits, 1));
+}
+
+uintptr_t JitCodeGenerator::bitwise_shift_right(uintptr_t val){
+	return this->binary_imm("shr", this->binary_imm("and_imm", val, 0xFF), 1);
+}
+
+uintptr_t JitCodeGenerator::get_bit_value(uintptr_t val, unsigned bit){
+	return this->binary_imm("and_imm", val, 1 << bit);
+}
+
+uintptr_t JitCodeGenerator::set_bit_value(uintptr_t val, unsigned bit, bool on){
+	if (on)
+		return this->binary_imm("or_imm", val, 1 << bit);
+	return this->binary_imm("and_imm", val, ~(1U << bit));
+}
+
+std::pair<uintptr_t, uintptr_t> JitCodeGenerator::perform_decimal_adjustment(uintptr_t val){
+	auto result = this->unary("decimal_adjust", val);
+	auto carry = this->binary_imm("and_imm", result, 0x100);
+	return { result, carry };
+}
+
+uintptr_t JitCodeGenerator::swap_nibbles(uintptr_t val){
+	auto bits = this->binary_imm("and_imm", val, 0xFF);
+	return this->binary("or_", this->binary_imm("shl", bits, 4), this->binary_imm("shr", bits, 4));
+}
+
+uintptr_t JitCodeGenerator::get_imm_value(unsigned val){
+	auto ret = this->new_slot();
+	this->statement({ ret }, true) << "\te.immediate(" << slot(ret) << ", " << val << ");\n";
+	return ret;
+}
+
+void JitCodeGenerator::require_equals(uintptr_t a, uintptr_t b){
+	this->unsupported();
+}
+
+void JitCodeGenerator::do_nothing_if(uintptr_t val, unsigned take_time, bool invert){
+	this->statement({ val }) << "\te.skip_if(" << slot(val) << ", " << (invert ? "true" : "false") << ", " << take_time << ");\n";
+}
+
+uintptr_t JitCodeGenerator::condition_to_value(ConditionalJumpType type){
+	switch (type){
+		case ConditionalJumpType::NotZero:
+			return this->binary_imm("xor_imm", this->get_flag(7), 1);
+		case ConditionalJumpType::Zero:
+			return this->get_flag(7);
+		case ConditionalJumpType::NotCarry:
+			return this->binary_imm("xor_imm", this->get_flag(4), 1);
+		case ConditionalJumpType::Carry:
+			return this->get_flag(4);
+	}
+	::abort();
+}
+
+void JitCodeGenerator::abort(){
+	this->unsupported();
+}
+
+uintptr_t JitCodeGenerator::sign_extend8(uintptr_t val){
+	return this->unary("sign_extend8", val);
+}
@@ -1,20 +1,42 @@
 #include "CodeGenerator.h"
 #include "CpuDefinition.h"
 #include "InterpreterCodeGenerator.h"
+#include "JitCodeGenerator.h"
 #include <fstream>
+#include <cstring>
 
 int main(int argc, char **argv){
 	if (argc < 3)
 		return -1;
+	bool threaded_dispatch = false;
+	bool lazy_flags = false;
+	bool jit = false;
+	for (int i = 3; i < argc; i++){
+		if (!strcmp(argv[i], "--threaded-dispatch"))
+			threaded_dispatch = true;
+		else if (!strcmp(argv[i], "--lazy-flags"))
+			lazy_flags = true;
+		else if (!strcmp(argv[i], "--jit"))
+			jit = true;
+		else
+			return -1;
+	}
 	auto definition = std::make_shared<CpuDefinition>();
-	InterpreterCodeGenerator icg(definition, "GameboyCpu");
+	InterpreterCodeGenerator icg(definition, "GameboyCpu", threaded_dispatch, lazy_flags);
 	icg.generate();
+	JitCodeGenerator jcg(definition, "GameboyCpu");
+	if (jit)
+		jcg.generate();
 	{
 		std::ofstream file(argv[1]);
 		icg.dump_declarations(file);
+		if (jit)
+			jcg.dump_declarations(file);
 	}
 	{
 		std::ofstream file(argv[2]);
 		icg.dump_definitions(file);
+		if (jit)
+			jcg.dump_definitions(file);
 	}
 }
@@ -0,0 +1,174 @@
+#include "BandLimitedBuffer.h"
+#include "exceptions.h"
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <cassert>
+
+#if defined _M_X64 || defined _M_IX86 || defined __x86_64__ || defined __i386__
+#define USE_SSE41_BLEP
+#include <smmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE41
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#endif
+#endif
+
+static const unsigned kernel_shift = 12;
+//Index of the left side of the middle tap.
+static const unsigned middle_tap = (BandLimitedBuffer::kernel_width / 2 - 1) * 2;
+
+namespace{
+
+//One band-limited impulse per phase, Blackman-windowed sinc, with a cutoff a
+//little below the Nyquist frequency. Each phase adds up to exactly
+//1 << kernel_shift, so steps don't change the DC level. Every tap is stored
+//twice, once for each side.
+struct Kernel{
+	alignas(16) std::int32_t taps[BandLimitedBuffer::phase_count][BandLimitedBuffer::kernel_width * 2];
+
+	Kernel(){
+		const double cutoff = 0.9;
+		const double half = BandLimitedBuffer::kernel_width / 2;
+		for (unsigned phase = 0; phase < BandLimitedBuffer::phase_count; phase++){
+			double values[BandLimitedBuffer::kernel_width];
+			double sum = 0;
+			for (unsigned i = 0; i < BandLimitedBuffer::kernel_width; i++){
+				double x = i - (half - 1) - (double)phase / BandLimitedBuffer::phase_count;
+				double sinc = x ? sin(M_PI * x * cutoff) / (M_PI * x * cutoff) : 1;
+				double window = 0.42 + 0.5 * cos(M_PI * x / half) + 0.08 * cos(2 * M_PI * x / half);
+				values[i] = sinc * window;
+				sum += values[i];
+			}
+			std::int32_t taps[BandLimitedBuffer::kernel_width];
+			std::int32_t total = 0;
+			for (unsigned i = 0; i < BandLimitedBuffer::kernel_width; i++){
+				taps[i] = (std::int32_t)floor(values[i] / sum * (1 << kernel_shift) + 0.5);
+				total += taps[i];
+			}
+			taps[(unsigned)half - 1] += (1 << kernel_shift) - total;
+			for (unsigned i = 0; i < BandLimitedBuffer::kernel_width; i++)
+				this->taps[phase][i * 2] = this->taps[phase][i * 2 + 1] = taps[i];
+		}
+	}
+};
+
+}
+
+static const Kernel kernel;
+
+typedef void (*add_delta_function)(std::int32_t *, const std::int32_t *, std::int32_t, std::int32_t);
+
+//The rounding errors go into the middle tap, so that the whole delta is
+//always added.
+static void add_delta_scalar(std::int32_t *dst, const std::int32_t *taps, std::int32_t left, std::int32_t right){
+	std::int32_t added_left = 0,
+		added_right = 0;
+	for (unsigned i = 0; i < BandLimitedBuffer::kernel_width * 2; i += 2){
+		auto value_left = (left * taps[i]) >> kernel_shift;
+		auto value_right = (right * taps[i + 1]) >> kernel_shift;
+		dst[i] += value_left;
+		dst[i + 1] += value_right;
+		added_left += value_left;
+		added_right += value_right;
+	}
+	dst[middle_tap] += left - added_left;
+	dst[middle_tap + 1] += right - added_right;
+}
+
+#ifdef USE_SSE41_BLEP
+
+static_assert(BandLimitedBuffer::kernel_width % 2 == 0, "add_delta_sse41() works on two taps at a time.");
+
+//Same as add_delta_scalar(), two taps of both sides at a time.
+TARGET_SSE41
+static void add_delta_sse41(std::int32_t *dst, const std::int32_t *taps, std::int32_t left, std::int32_t right){
+	auto deltas = _mm_set_epi32(right, left, right, left);
+	auto added = _mm_setzero_si128();
+	for (unsigned i = 0; i < BandLimitedBuffer::kernel_width * 2; i += 4){
+		auto values = _mm_srai_epi32(_mm_mullo_epi32(deltas, _mm_load_si128((const __m128i *)(taps + i))), kernel_shift);
+		auto p = (__m128i *)(dst + i);
+		_mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), values));
+		added = _mm_add_epi32(added, values);
+	}
+	added = _mm_add_epi32(added, _mm_shuffle_epi32(added, _MM_SHUFFLE(1, 0, 3, 2)));
+	dst[middle_tap] += left - _mm_cvtsi128_si32(added);
+	dst[middle_tap + 1] += right - _mm_extract_epi32(added, 1);
+}
+
+static bool cpu_has_sse41(){
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return !!(info[2] & (1 << 19));
+#else
+	__builtin_cpu_init();
+	return !!__builtin_cpu_supports("sse4.1");
+#endif
+}
+
+#endif
+
+static add_delta_function select_add_delta(){
+#ifdef USE_SSE41_BLEP
+	if (cpu_has_sse41())
+		return add_delta_sse41;
+#endif
+	return add_delta_scalar;
+}
+
+BandLimitedBuffer::BandLimitedBuffer(unsigned clock_frequency_power, unsigned sample_rate):
+		factor(((std::uint64_t)sample_rate << 32) >> clock_frequency_power),
+		buffer(new std::int32_t[(capacity + kernel_width) * 2]){
+	this->clear();
+}
+
+void BandLimitedBuffer::add_delta(std::uint32_t time, std::int32_t left, std::int32_t right){
+	assert(left > -maximum_delta && left < maximum_delta);
+	assert(right > -maximum_delta && right < maximum_delta);
+	auto position = this->offset + time * this->factor;
+	auto index = position >> 32;
+	//Past capacity, there is only room for the rest of the kernel.
+	if (index > capacity)
+		throw GenericException("BandLimitedBuffer overflow.");
+	auto dst = this->buffer.get() + index * 2;
+	auto taps = kernel.taps[(position >> (32 - phase_bits)) & (phase_count - 1)];
+	static const add_delta_function function = select_add_delta();
+	function(dst, taps, left, right);
+}
+
+void BandLimitedBuffer::end_frame(std::uint32_t time){
+	this->offset += time * this->factor;
+	if (this->samples_available() > capacity)
+		throw GenericException("BandLimitedBuffer overflow.");
+}
+
+unsigned BandLimitedBuffer::read_samples(std::int32_t *dst, unsigned count){
+	count = std::min(count, this->samples_available());
+	auto src = this->buffer.get();
+	auto left = this->level[0];
+	auto right = this->level[1];
+	for (unsigned i = 0; i < count * 2; i += 2){
+		left += src[i];
+		right += src[i + 1];
+		dst[i] = left;
+		dst[i + 1] = right;
+	}
+	this->level[0] = left;
+	this->level[1] = right;
+	//Move the remaining samples and the tails of the last steps to the front.
+	auto remaining = (this->samples_available() - count + kernel_width) * 2;
+	memmove(src, src + count * 2, remaining * sizeof(*src));
+	std::fill(src + remaining, src + remaining + count * 2, 0);
+	this->offset -= (std::uint64_t)count << 32;
+	return count;
+}
+
+void BandLimitedBuffer::clear(){
+	this->offset &= 0xFFFFFFFF;
+	this->level[0] = this->level[1] = 0;
+	std::fill(this->buffer.get(), this->buffer.get() + (capacity + kernel_width) * 2, 0);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "CommonTypes.h"
+#include <memory>
+
+//Delta buffer for band-limited synthesis. Instead of being sampled, a signal
+//is described by its changes in amplitude, each at an exact time in clock
+//cycles. Every change is added as a band-limited step, so square waves don't
+//alias, and samples are produced in bulk by integrating the buffer.
+//
+//The buffer is stereo, with the samples of both sides interleaved, so that a
+//change that goes to both sides only has to find its kernel once.
+//
+//Times are relative to the start of the current frame. end_frame() closes the
+//frame and makes the samples in it available to read_samples(). A frame must
+//not be longer than capacity samples.
+class BandLimitedBuffer{
+public:
+	static const unsigned capacity = 4096;
+	static const unsigned kernel_width = 16;
+	static const unsigned phase_bits = 5;
+	static const unsigned phase_count = 1 << phase_bits;
+	//Deltas must be smaller than this in magnitude, so that every product
+	//with the kernel fits in 32 bits.
+	static const std::int32_t maximum_delta = 1 << 19;
+private:
+	//Samples per clock cycle, as a 32.32 fixed point number. This is exact,
+	//since the clock frequency is a power of two.
+	std::uint64_t factor;
+	//Position of the start of the frame, in samples, as a 32.32 fixed point
+	//number.
+	std::uint64_t offset = 0;
+	std::unique_ptr<std::int32_t[]> buffer;
+	std::int32_t level[2];
+public:
+	BandLimitedBuffer(unsigned clock_frequency_power, unsigned sample_rate);
+	void add_delta(std::uint32_t time, std::int32_t left, std::int32_t right);
+	void end_frame(std::uint32_t time);
+	unsigned samples_available() const{
+		return (unsigned)(this->offset >> 32);
+	}
+	//Reads up to count stereo samples into dst, left first. Returns the
+	//number of samples read.
+	unsigned read_samples(std::int32_t *dst, unsigned count);
+	void clear();
+};
@@ -0,0 +1,91 @@
+#include "BlockCache.h"
+#include <algorithm>
+
+BlockCache::BlockCache():
+		fixed_blocks(new std::unique_ptr<CachedBlock>[0x10000]),
+		ram_references(new std::uint16_t[0x10000 - ram_start]){
+	std::fill(this->ram_references.get(), this->ram_references.get() + (0x10000 - ram_start), 0);
+}
+
+main_integer_t BlockCache::get_region_end(main_integer_t pc) const{
+	//The bootstrap ROM can be cached like any other ROM, since the whole cache
+	//is dropped when it's mapped in or out.
+	if (pc < 0x4000)
+		return pc < 0x100 && this->bootstrap_mapped ? 0x100 : 0x4000;
+	if (pc < 0x8000)
+		return 0x8000;
+	if (pc >= 0xC000 && pc < 0xE000)
+		return 0xE000;
+	//0xFFFF is IE.
+	if (pc >= 0xFF80 && pc < 0xFFFF)
+		return 0xFFFF;
+	//VRAM, cartridge RAM, echo RAM, OAM and I/O registers are never cached.
+	return 0;
+}
+
+std::unique_ptr<CachedBlock> &BlockCache::get_slot(main_integer_t pc, int rom_bank){
+	if (pc >= 0x4000 && pc < 0x8000){
+		if (rom_bank < 0)
+			rom_bank = 0;
+		if ((size_t)rom_bank >= this->banked_blocks.size())
+			this->banked_blocks.resize(rom_bank + 1);
+		auto &bank = this->banked_blocks[rom_bank];
+		if (!bank)
+			bank.reset(new std::unique_ptr<CachedBlock>[0x4000]);
+		return bank[pc - 0x4000];
+	}
+	return this->fixed_blocks[pc];
+}
+
+CachedBlock *BlockCache::insert(main_integer_t pc, int rom_bank, std::unique_ptr<CachedBlock> &&block){
+	if (block->start >= ram_start){
+		auto references = this->ram_references.get() + (block->start - ram_start);
+		for (unsigned i = 0; i < block->size; i++)
+			references[i]++;
+	}
+	auto &slot = this->get_slot(pc, rom_bank);
+	slot = std::move(block);
+	return slot.get();
+}
+
+void BlockCache::retire(std::unique_ptr<CachedBlock> &block){
+	if (block->start >= ram_start){
+		auto references = this->ram_references.get() + (block->start - ram_start);
+		for (unsigned i = 0; i < block->size; i++)
+			references[i]--;
+	}
+	//The CPU may be in the middle of executing this block, so it's only freed
+	//on the next lookup.
+	this->retired_blocks.emplace_back(std::move(block));
+	this->generation++;
+}
+
+void BlockCache::invalidate_ram(main_integer_t address){
+	main_integer_t first = address >= ram_start + max_block_size ? address - (max_block_size - 1) : ram_start;
+	for (auto pc = first; pc <= address; pc++){
+		auto &block = this->fixed_blocks[pc];
+		if (block && pc + block->size > address)
+			this->retire(block);
+	}
+}
+
+void BlockCache::set_bootstrap_mapped(bool mapped){
+	if (this->bootstrap_mapped == mapped)
+		return;
+	this->bootstrap_mapped = mapped;
+	this->clear();
+}
+
+void BlockCache::clear(){
+	for (main_integer_t pc = 0; pc < 0x10000; pc++)
+		if (this->fixed_blocks[pc])
+			this->retire(this->fixed_blocks[pc]);
+	for (auto &bank : this->banked_blocks){
+		if (!bank)
+			continue;
+		for (main_integer_t pc = 0; pc < 0x4000; pc++)
+			if (bank[pc])
+				this->retire(bank[pc]);
+	}
+	this->generation++;
+}
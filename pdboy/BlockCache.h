@@ -0,0 +1,79 @@
+#pragma once
+
+#include "GameboyCpu.h"
+#include <vector>
+#include <memory>
+
+//A straight-line run of decoded instructions. The last instruction is either
+//a jump or the last one that fit; it's followed by a sentinel whose pc never
+//matches, so falling off the end sends the CPU back to the cache.
+struct CachedBlock{
+	std::uint16_t start;
+	std::uint16_t size;
+	//Sum of the worst-case cycle counts of every instruction in the block.
+	std::uint32_t cycles;
+	//Set if the block is a loop that can't leave until some I/O register it
+	//polls changes, or until an interrupt is taken. See detect_idle_loop().
+	bool idle_loop;
+	//The register polled by an idle loop, or 0 if it doesn't read anything.
+	std::uint16_t idle_poll_address;
+	std::vector<GameboyCpu::CachedInstruction> instructions;
+};
+
+//Maps full_pc to decoded blocks. Blocks in ROM are keyed on the bank mapped
+//at the time they were decoded, so bank switches don't invalidate anything.
+//Blocks in WRAM and HRAM are dropped when any byte they cover is written.
+class BlockCache{
+public:
+	static const unsigned max_block_instructions = 32;
+private:
+	static const unsigned max_block_size = max_block_instructions * 3;
+	static const main_integer_t ram_start = 0xC000;
+
+	std::unique_ptr<std::unique_ptr<CachedBlock>[]> fixed_blocks;
+	std::vector<std::unique_ptr<std::unique_ptr<CachedBlock>[]>> banked_blocks;
+	std::vector<std::unique_ptr<CachedBlock>> retired_blocks;
+	//How many cached blocks cover each byte in [0xC000; 0x10000).
+	std::unique_ptr<std::uint16_t[]> ram_references;
+	bool bootstrap_mapped = false;
+	std::uint32_t generation = 0;
+
+	std::unique_ptr<CachedBlock> &get_slot(main_integer_t pc, int rom_bank);
+	void retire(std::unique_ptr<CachedBlock> &);
+	void invalidate_ram(main_integer_t address);
+public:
+	BlockCache();
+	CachedBlock *find(main_integer_t pc, int rom_bank){
+		if (this->retired_blocks.size())
+			this->retired_blocks.clear();
+		if (pc >= 0x4000 && pc < 0x8000){
+			if (rom_bank < 0)
+				rom_bank = 0;
+			if ((size_t)rom_bank >= this->banked_blocks.size() || !this->banked_blocks[rom_bank])
+				return nullptr;
+			return this->banked_blocks[rom_bank][pc - 0x4000].get();
+		}
+		return this->fixed_blocks[pc].get();
+	}
+	CachedBlock *insert(main_integer_t pc, int rom_bank, std::unique_ptr<CachedBlock> &&);
+	//Returns the end of the region in which a block starting at pc must fit,
+	//or 0 if code at pc can't be cached.
+	main_integer_t get_region_end(main_integer_t pc) const;
+	//Changes whenever cached blocks are dropped or the ROM mapping may have
+	//changed. Decoded instructions held across a change must be discarded.
+	std::uint32_t get_generation() const{
+		return this->generation;
+	}
+	const std::uint32_t *get_generation_pointer() const{
+		return &this->generation;
+	}
+	void notify_ram_write(main_integer_t address){
+		if (this->ram_references[address - ram_start])
+			this->invalidate_ram(address);
+	}
+	void notify_mapping_change(){
+		this->generation++;
+	}
+	void set_bootstrap_mapped(bool);
+	void clear();
+};
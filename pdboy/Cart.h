@@ -88,6 +88,14 @@ public:
 	virtual int get_current_rom_bank(){
 		return -1;
 	}
+	//Memory currently mapped to [0x0000; 0x4000) and [0x4000; 0x8000), or
+	//nullptr if reads from that range must go through read8().
+	virtual const byte_t *get_fixed_rom(){
+		return nullptr;
+	}
+	virtual const byte_t *get_switchable_rom(){
+		return nullptr;
+	}
 };
 
 #define DECLARE_UNSUPPORTED_CARTRIDGE_CLASS(x, base) \
@@ -162,6 +170,11 @@ public:
 	int get_current_rom_bank() override{
 		return this->current_rom_bank;
 	}
+	const byte_t *get_rom_bank(unsigned bank) const{
+		if (((size_t)bank + 1) << 14 > this->size)
+			return nullptr;
+		return this->data + ((size_t)bank << 14);
+	}
 };
 
 DECLARE_UNSUPPORTED_STANDARD_CARTRIDGE_CLASS(Mbc4Cartridge);
@@ -27,4 +27,10 @@ public:
 	Mbc1Cartridge(HostSystem &host, std::unique_ptr<std::vector<byte_t>> &&, const CartridgeCapabilities &);
 	virtual ~Mbc1Cartridge(){}
 	void post_initialization() override;
+	const byte_t *get_fixed_rom() override{
+		return this->get_rom_bank(0);
+	}
+	const byte_t *get_switchable_rom() override{
+		return this->get_rom_bank(this->current_rom_bank);
+	}
 };
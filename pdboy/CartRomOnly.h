@@ -8,4 +8,10 @@ public:
 	RomOnlyCartridge(HostSystem &host, std::unique_ptr<std::vector<byte_t>> &&, const CartridgeCapabilities &);
 	void write8(main_integer_t, byte_t) override{}
 	byte_t read8(main_integer_t) override;
+	const byte_t *get_fixed_rom() override{
+		return this->get_rom_bank(0);
+	}
+	const byte_t *get_switchable_rom() override{
+		return this->get_rom_bank(1);
+	}
 };
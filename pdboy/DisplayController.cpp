@@ -1,4 +1,7 @@
 #include "DisplayController.h"
+#include "ScanlineCompositor.h"
+#include "ScanlineRenderer.h"
+#include "RenderThread.h"
 #include "Gameboy.h"
 #include "MemoryController.h"
 #include "HostSystem.h"
@@ -13,38 +16,16 @@
 
 unsigned frames_drawn = 0;
 
-struct SpriteDescription{
-	byte_t y, x, tile_no, attributes;
-	int get_y() const{
-		return (int)this->y - 16U;
-	}
-	int get_x() const{
-		return (int)this->x - 8U;
-	}
-	int palette_number() const{
-		return !!(this->attributes & bit(4));
-	}
-	bool has_priority() const{
-		return !(this->attributes & bit(7));
-	}
-	bool flipped_x() const{
-		return !!(this->attributes & bit(5));
-	}
-	bool flipped_y() const{
-		return !!(this->attributes & bit(6));
-	}
-};
-
 DisplayController::DisplayController(Gameboy &system):
 		system(&system),
 		vram(0x2000),
 		oam(0xA0),
+		renderer(new ScanlineRenderer(&vram.access(0x8000), &oam.access(0xFE00))),
 		display_enabled(false){
-	this->set_background_palette(0);
-	this->set_obj0_palette(0);
-	this->set_obj1_palette(0);
 }
 
+DisplayController::~DisplayController(){}
+
 RenderedFrame *DisplayController::get_current_frame(){
 	return this->publishing_frames.get_public_resource();
 }
@@ -56,14 +37,23 @@ void DisplayController::return_used_frame(RenderedFrame *frame){
 		this->publishing_frames.return_resource_as_private(frame);
 }
 
-int DisplayController::get_row_status(){
+unsigned DisplayController::get_row_cycle(){
 	assert(this->display_enabled);
-	auto clock = this->get_display_clock();
-	auto cycle = (unsigned)(clock % lcd_refresh_period);
-	auto row = cycle / 456;
-	auto sub_row = cycle % 456;
-	row *= 4;
-	if (cycle >= lcd_height * 456)
+	auto elapsed = this->get_system_clock() - this->current_row_start;
+	if (elapsed < row_period)
+		return (unsigned)elapsed;
+	//update() runs at every row state change, so normally this only has to
+	//move one row forward.
+	auto rows = elapsed / row_period;
+	this->current_row_start += rows * row_period;
+	this->current_row = (unsigned)((this->current_row + rows) % rows_per_frame);
+	return (unsigned)(elapsed - rows * row_period);
+}
+
+int DisplayController::get_row_status(){
+	auto sub_row = this->get_row_cycle();
+	auto row = this->current_row * 4;
+	if (this->current_row >= lcd_height)
 		return row + 3;
 	if (sub_row < 80)
 		return row + 0;
@@ -75,43 +65,20 @@ int DisplayController::get_row_status(){
 int DisplayController::get_LY(){
 	if (!this->display_enabled)
 		return -1;
-	auto clock = this->get_display_clock();
-	auto cycle = (unsigned)(clock % lcd_refresh_period);
-	return cycle / 456;
+	this->get_row_cycle();
+	return this->current_row;
 }
 
 int DisplayController::get_lcd_transfer_status(){
-	assert(this->display_enabled);
-	auto clock = this->get_display_clock();
-	auto cycle = (unsigned)(clock % lcd_refresh_period);
-	auto sub_row = (unsigned)(clock % 456);
-	if (cycle >= lcd_height * 456)
-		return 3;
-	if (sub_row < 80)
-		return 0;
-	if (sub_row < 252)
-		return 1;
-	return 2;
+	return this->get_row_status() & 3;
 }
 
 byte_t DisplayController::get_background_palette(){
 	return this->bg_palette_value;
 }
 
-template <bool BG>
-static void set_palette_array(RGB dst[4], byte_t palette){
-	for (unsigned i = 4; i--;){
-		auto index = (palette >> (i * 2)) & 3;
-		byte_t c = ~(byte_t)(index * 0xFF / 3);
-		dst[i] = { c, c, c, 0xFF };
-	}
-	if (!BG)
-		dst[0] = { 0, 0, 0, 0 };
-}
-
 void DisplayController::set_background_palette(byte_t palette){
-	set_palette_array<true>(this->bg_palette, palette);
-	this->bg_palette_value = palette;
+	this->set_render_register(this->bg_palette_value, palette);
 }
 
 byte_t DisplayController::get_y_coordinate(){
@@ -149,7 +116,7 @@ byte_t DisplayController::get_window_x_position(){
 }
 
 void DisplayController::set_window_x_position(byte_t b){
-	this->window_x = b;
+	this->set_render_register(this->window_x, b);
 }
 
 byte_t DisplayController::get_window_y_position(){
@@ -157,7 +124,7 @@ byte_t DisplayController::get_window_y_position(){
 }
 
 void DisplayController::set_window_y_position(byte_t b){
-	this->window_y = b;
+	this->set_render_register(this->window_y, b);
 }
 
 byte_t DisplayController::get_scroll_x(){
@@ -165,7 +132,7 @@ byte_t DisplayController::get_scroll_x(){
 }
 
 void DisplayController::set_scroll_x(byte_t b){
-	this->scroll_x = b;
+	this->set_render_register(this->scroll_x, b);
 }
 
 byte_t DisplayController::get_scroll_y(){
@@ -173,7 +140,7 @@ byte_t DisplayController::get_scroll_y(){
 }
 
 void DisplayController::set_scroll_y(byte_t b){
-	this->scroll_y = b;
+	this->set_render_register(this->scroll_y, b);
 }
 
 byte_t DisplayController::get_lcd_control(){
@@ -183,7 +150,7 @@ byte_t DisplayController::get_lcd_control(){
 #define CHECK_FLAG(x) std::cout << (check_flag(this->lcd_control, x) ? " " : "~") << #x "\n"
 
 void DisplayController::set_lcd_control(byte_t b){
-	this->lcd_control = b;
+	this->set_render_register(this->lcd_control, b);
 	this->toggle_lcd();
 
 	return;
@@ -210,13 +177,20 @@ void DisplayController::toggle_lcd(){
 	if (enable){
 		this->display_clock_start = this->get_system_clock() + 244;
 		this->swallow_frames = 1;
+		this->skip_rendering = false;
 	}else{
 		this->display_enabled = false;
-		this->publishing_frames.clear_public_resource();
+		this->deferred_count = 0;
+		this->frame_batches = 0;
+		if (this->render_thread)
+			this->render_thread->clear();
+		else
+			this->publishing_frames.clear_public_resource();
 		this->last_row_state = -1;
 		this->display_clock_start = this->invalid_clock;
 		this->enable_memories();
 	}
+	this->schedule_next_update();
 }
 
 byte_t DisplayController::get_obj0_palette(){
@@ -224,8 +198,7 @@ byte_t DisplayController::get_obj0_palette(){
 }
 
 void DisplayController::set_obj0_palette(byte_t palette){
-	set_palette_array<false>(this->obj0_palette, palette);
-	this->obj0_palette_value = palette;
+	this->set_render_register(this->obj0_palette_value, palette);
 }
 
 byte_t DisplayController::get_obj1_palette(){
@@ -233,8 +206,24 @@ byte_t DisplayController::get_obj1_palette(){
 }
 
 void DisplayController::set_obj1_palette(byte_t palette){
-	set_palette_array<false>(this->obj1_palette, palette);
-	this->obj1_palette_value = palette;
+	this->set_render_register(this->obj1_palette_value, palette);
+}
+
+std::uint64_t DisplayController::get_next_status_change(){
+	//Turning the LCD on is either a register write or a scheduled update().
+	if (!this->display_enabled)
+		return this->invalid_clock;
+	auto now = this->get_system_clock();
+	auto sub_row = this->get_row_cycle();
+	//LY changes on every row, even during VBlank.
+	unsigned remaining = row_period - sub_row;
+	if (this->current_row < lcd_height){
+		if (sub_row < 80)
+			remaining = 80 - sub_row;
+		else if (sub_row < 252)
+			remaining = 252 - sub_row;
+	}
+	return now + remaining;
 }
 
 std::uint64_t DisplayController::get_display_clock() const{
@@ -254,15 +243,21 @@ std::int64_t DisplayController::get_signed_display_clock() const{
 
 bool DisplayController::update(){
 	if (!this->display_enabled){
-		if (this->display_clock_start > this->get_system_clock())
+		if (this->display_clock_start > this->get_system_clock()){
+			this->schedule_next_update();
 			return false;
+		}
 		this->display_enabled = true;
+		this->current_row = 0;
+		this->current_row_start = this->display_clock_start;
 	}
 	auto row_status = (unsigned)this->get_row_status();
-	auto state = row_status & 3;
+	int state = row_status & 3;
 	auto row = row_status >> 2;
-	if (this->last_row_state == state)
+	if (this->last_row_state == state){
+		this->schedule_next_update();
 		return false;
+	}
 	typedef void (DisplayController::*fp_t)(unsigned);
 	static const fp_t functions[] = {
 		&DisplayController::switch_to_row_state_0,
@@ -273,9 +268,34 @@ bool DisplayController::update(){
 	(this->*functions[state])(row);
 	bool ret = this->last_row_state == 3;
 	this->last_row_state = state;
+	this->schedule_next_update();
 	return ret;
 }
 
+void DisplayController::schedule_next_update(){
+	auto &scheduler = this->system->get_scheduler();
+	if (!this->display_enabled){
+		//Note: display_clock_start == invalid_clock == EventScheduler::never
+		//while the LCD is off.
+		scheduler.schedule(EventSource::Display, this->display_clock_start);
+		return;
+	}
+	auto now = this->get_system_clock();
+	auto sub_row = this->get_row_cycle();
+	unsigned remaining;
+	if (this->current_row >= lcd_height)
+		remaining = (rows_per_frame - this->current_row) * row_period - sub_row;
+	else{
+		if (sub_row < 80)
+			remaining = 80 - sub_row;
+		else if (sub_row < 252)
+			remaining = 252 - sub_row;
+		else
+			remaining = row_period - sub_row;
+	}
+	scheduler.schedule(EventSource::Display, now + remaining);
+}
+
 void DisplayController::switch_to_row_state_0(unsigned row){
 	this->memory_controller->toggle_oam_access(false);
 	if (check_flag(this->lcd_status, stat_oam_interrupt_mask))
@@ -289,8 +309,12 @@ void DisplayController::switch_to_row_state_1(unsigned row){
 }
 
 void DisplayController::switch_to_row_state_2(unsigned row){
-	if (!this->swallow_frames)
-		this->render_current_scanline(row);
+	//Decided as late as possible, to give the host time to take the last
+	//frame.
+	if (!row)
+		this->skip_rendering = this->skip_next_frame();
+	if (!this->swallow_frames && !this->skip_rendering)
+		this->defer_scanline(row);
 	this->enable_memories();
 	if (check_flag(this->lcd_status, stat_hblank_interrupt_mask))
 		this->system->get_cpu().lcd_stat_irq();
@@ -304,7 +328,14 @@ void DisplayController::enable_memories(){
 }
 
 void DisplayController::switch_to_row_state_3(unsigned row){
-	if (!this->swallow_frames){
+	if (this->skip_rendering)
+		this->frames_skipped++;
+	else if (!this->swallow_frames){
+		this->flush_deferred_lines();
+		if (this->frame_batches == 1)
+			this->frames_batched++;
+		this->frames_rendered++;
+		this->frame_batches = 0;
 #ifdef DUMP_FRAMES
 		{
 			std::stringstream path;
@@ -312,7 +343,10 @@ void DisplayController::switch_to_row_state_3(unsigned row){
 			this->system->get_host()->write_frame_to_disk(path.str(), *this->frame_being_drawn);
 		}
 #endif
-		this->publishing_frames.publish();
+		if (this->render_thread)
+			this->render_thread->publish();
+		else
+			this->publishing_frames.publish();
 		frames_drawn++;
 	}else
 		this->swallow_frames--;
@@ -321,165 +355,129 @@ void DisplayController::switch_to_row_state_3(unsigned row){
 	this->system->get_cpu().vblank_irq();
 }
 
-struct FullSprite{
-	int sprite_number;
-	SpriteDescription sprite_description;
-	GameboyMode operation_mode;
-	//Returns true if *this has less priority than other.
-	bool operator<(const FullSprite &other) const{
-		if (operation_mode == GameboyMode::CGB)
-			return this->sprite_number > other.sprite_number;
-
-		if (this->sprite_description.x > other.sprite_description.x)
-			return true;
-		if (this->sprite_description.x < other.sprite_description.x)
-			return false;
-		return this->sprite_number > other.sprite_number;
+bool DisplayController::skip_next_frame(){
+	if (this->swallow_frames)
+		return false;
+	if (this->frameskip == auto_frameskip)
+		return !this->publishing_frames.last_published_taken();
+	if (this->frameskip_counter < (unsigned)this->frameskip){
+		this->frameskip_counter++;
+		return true;
 	}
-};
+	this->frameskip_counter = 0;
+	return false;
+}
+
+void DisplayController::write_vram(main_integer_t address, byte_t value){
+	auto &dst = this->vram.access(address);
+	if (dst != value)
+		this->flush_deferred_lines();
+	dst = value;
+	if (this->render_thread)
+		this->render_thread->write_vram(address, value);
+	else
+		this->renderer->notify_vram_write(address);
+}
+
+void DisplayController::write_oam(main_integer_t address, byte_t value){
+	auto &dst = this->oam.access(address);
+	if (dst == value)
+		return;
+	this->flush_deferred_lines();
+	dst = value;
+	if (this->render_thread)
+		this->render_thread->write_oam(address, value);
+	else
+		this->renderer->notify_oam_write();
+}
+
+ScanlineState DisplayController::get_scanline_state() const{
+	ScanlineState ret;
+	ret.bg_enabled = check_flag(this->lcd_control, lcdc_bg_enable_mask);
+	ret.window_enabled = check_flag(this->lcd_control, lcdc_window_enable_mask);
+	ret.sprites_enabled = check_flag(this->lcd_control, lcdc_sprite_enable_mask);
+	ret.tall_sprites = check_flag(this->lcd_control, lcdc_tall_sprite_enable_mask);
+	ret.signed_tiles = !check_flag(this->lcd_control, lcdc_tile_map_select_mask);
+	ret.cgb_sprite_order = this->system->get_mode() == GameboyMode::CGB;
+	ret.bg_map = this->get_bg_vram_address();
+	ret.window_map = 0x9800 + this->get_window_vram_offset();
+	ret.scroll_x = (byte_t)this->scroll_x;
+	ret.scroll_y = (byte_t)this->scroll_y;
+	ret.window_x = (byte_t)this->window_x;
+	ret.window_y = (byte_t)this->window_y;
+	ret.bg_palette = this->bg_palette_value;
+	ret.obj0_palette = this->obj0_palette_value;
+	ret.obj1_palette = this->obj1_palette_value;
+	return ret;
+}
+
+void DisplayController::render_lines(unsigned first, unsigned count){
+	auto state = this->get_scanline_state();
+	if (this->render_thread)
+		this->render_thread->render(first, count, state);
+	else
+		this->renderer->render(*this->publishing_frames.get_private_resource(), first, count, state);
+}
 
 void DisplayController::render_current_scanline(unsigned y){
-	auto *pixels = this->publishing_frames.get_private_resource()->pixels;
-	const unsigned pitch = lcd_width;
-
-	auto wy = (int)this->window_y;
-	auto bg_tile_vram = this->get_bg_tile_vram();
-	auto tile_no_offset = this->get_tile_no_offset();
-	auto bg_vram = this->get_bg_vram();
-	auto window_vram = this->get_window_vram();
-	auto oam = this->get_oam();
-	auto sprite_tile_vram = this->get_sprite_tile_vram();
-	bool bg_enabled = check_flag(this->lcd_control, lcdc_bg_enable_mask);
-	bool sprites_enabled = check_flag(this->lcd_control, lcdc_sprite_enable_mask);
-	const int sprite_width = 8;
-	bool tall_sprites = check_flag(this->lcd_control, lcdc_tall_sprite_enable_mask);
-	int sprite_height = tall_sprites ? 16 : 8;
-
-	auto row = pixels + pitch * y;
-	auto src_y = (y + this->scroll_y) & 0xFF;
-	auto src_y_prime = src_y / 8 * 32;
-
-	auto wy_prime = (int)y - wy;
-	bool window_enabled = check_flag(this->lcd_control, lcdc_window_enable_mask) && wy_prime >= 0 && wy_prime < lcd_height;
-	auto y_prime = wy_prime / 8 * 32;
-
-	RGB *obj_palettes[] = {
-		this->obj0_palette,
-		this->obj1_palette,
-	};
+	this->render_lines(y, 1);
+}
 
-	FullSprite sprites_for_scanline[40];
-	unsigned sprites_for_scanline_size = 0;
-	auto operation_mode = this->system->get_mode();
-	if (sprites_enabled){
-		for (unsigned i = 40; i--;){
-			auto &sprite = *(SpriteDescription *)(oam + i * 4);
-			auto spry = sprite.get_y();
-			if ((int)y >= spry && (int)y < spry + sprite_height){
-				sprites_for_scanline[sprites_for_scanline_size].sprite_number = i;
-				sprites_for_scanline[sprites_for_scanline_size].sprite_description = sprite;
-				sprites_for_scanline[sprites_for_scanline_size].operation_mode = operation_mode;
-				sprites_for_scanline_size++;
-			}
-		}
-	}
+void DisplayController::defer_scanline(unsigned y){
+	if (this->deferred_count && this->deferred_first + this->deferred_count != y)
+		this->render_deferred_lines();
+	if (!this->deferred_count)
+		this->deferred_first = y;
+	this->deferred_count++;
+}
 
-	FullSprite *sprites = sprites_for_scanline;
+void DisplayController::render_deferred_lines(){
+	//Nothing has changed since the first of these lines, so they're all drawn
+	//with the current state.
+	this->render_lines(this->deferred_first, this->deferred_count);
+	this->deferred_count = 0;
+	this->frame_batches++;
+}
 
-	if (sprites_for_scanline_size){
-		std::sort(sprites_for_scanline, sprites_for_scanline + sprites_for_scanline_size);
-		if (sprites_for_scanline_size > 10){
-			sprites += sprites_for_scanline_size - 10;
-			sprites_for_scanline_size = 10;
-		}
+void DisplayController::set_render_thread(bool enable){
+	if (enable == !!this->render_thread)
+		return;
+	if (enable){
+		this->render_thread.reset(new RenderThread(&this->vram.access(0x8000), &this->oam.access(0xFE00), this->publishing_frames));
+		return;
 	}
+	this->render_thread->flush();
+	this->render_thread.reset();
+	//The inline renderer hasn't seen the writes made in the meantime.
+	this->renderer.reset(new ScanlineRenderer(&this->vram.access(0x8000), &this->oam.access(0xFE00)));
+}
 
-	for (unsigned x = 0; x != lcd_width; x++){
-		unsigned color_index = 0;
-		RGB *palette = nullptr;
-		int source = -1;
-
-		if (window_enabled){
-			auto wx = (int)this->window_x - 7;
-			auto src_x = (int)x - wx;
-			if ((src_x >= 0) & (src_x < (int)lcd_width)){
-				auto src_window_tile = src_x / 8 + y_prime;
-				byte_t tile_no = window_vram[src_window_tile] + tile_no_offset;
-				auto tile = bg_tile_vram + tile_no * 16;
-				auto tile_offset_x = src_x & 7;
-				auto tile_offset_y = wy_prime & 7;
-				auto src_pixelA = tile[tile_offset_y * 2 + 0];
-				auto src_pixelB = tile[tile_offset_y * 2 + 1];
-				color_index = (src_pixelA >> (7 - tile_offset_x) & 1) | (((src_pixelB >> (7 - tile_offset_x)) & 1) << 1);
-				palette = this->bg_palette;
-				source = 0;
-			}
-		}
+void DisplayController::flush_rendering(){
+	this->flush_deferred_lines();
+	if (this->render_thread)
+		this->render_thread->flush();
+}
 
-		if (bg_enabled & !palette){
-			auto src_x = (x + this->scroll_x) & 0xFF;
-			auto src_bg_tile = src_x / 8 + src_y_prime;
-			byte_t tile_no = bg_vram[src_bg_tile] + tile_no_offset;
-			auto tile = bg_tile_vram + tile_no * 16;
-			auto tile_offset_x = ~src_x & 7;
-			auto tile_offset_y = (src_y & 7) << 1;
-			auto src_pixelA = tile[tile_offset_y | 0];
-			auto src_pixelB = tile[tile_offset_y | 1];
-			auto first_part = (src_pixelA >> tile_offset_x) & 1;
-			auto second_part = ((src_pixelB >> tile_offset_x) & 1) << 1;
-			color_index = first_part | second_part;
-			palette = this->bg_palette;
-			source = 1;
-		}
+const LayerCache &DisplayController::get_layer_cache() const{
+	if (this->render_thread)
+		return this->render_thread->get_renderer().get_layer_cache();
+	return this->renderer->get_layer_cache();
+}
 
-		for (unsigned i = 0; i != sprites_for_scanline_size; i++){
-			auto sprite = sprites[i].sprite_description;
-			auto sprx = sprite.get_x();
-			auto sprite_is_here = ((int)x >= sprx) & ((int)x < sprx + sprite_width);
-			auto sprite_is_not_covered_here = sprite.has_priority() | !color_index;
-			if (!(sprite_is_here & sprite_is_not_covered_here))
-				continue;
-
-			byte_t tile_no = sprite.tile_no;
-			auto spry = sprite.get_y();
-			auto tile_offset_x = (int)x - sprx;
-			auto tile_offset_y = (int)y - spry;
-			tile_offset_x ^= 7 * !sprite.flipped_x();
-			tile_offset_y ^= 7 * sprite.flipped_y();
-
-			if (tall_sprites)
-				tile_no &= 0xFE;
-			tile_offset_y <<= 1;
-			auto tile = sprite_tile_vram + tile_no * 16;
-			auto src_pixelA = tile[tile_offset_y | 0];
-			auto src_pixelB = tile[tile_offset_y | 1];
-			auto first_part = (src_pixelA >> tile_offset_x) & 1;
-			auto second_part = ((src_pixelB >> tile_offset_x) & 1) << 1;
-			auto index = first_part | second_part;
-			if (!index)
-				continue;
-
-			color_index = index;
-			palette = obj_palettes[sprite.palette_number()];
-			source = 2;
-
-			break;
-		}
-		if (palette){
-			auto &pixel = row[x];
-			pixel = palette[color_index];
-#ifdef DEBUG_FRAMES
-			if (source != 0)
-				pixel.r = 0;
-			if (source != 1)
-				pixel.g = 0;
-			if (source != 2)
-				pixel.b = 0;
-#endif
-		}else
-			row[x] = { 0xFF, 0xFF, 0xFF, 0xFF };
+std::uint64_t DisplayController::get_sprite_bin_rebuilds() const{
+	if (this->render_thread)
+		return this->render_thread->get_renderer().get_sprite_bin_rebuilds();
+	return this->renderer->get_sprite_bin_rebuilds();
+}
+
+#ifdef INDEXED_FRAMES
+void RenderedFrame::to_rgb(RGB *dst) const{
+	for (unsigned y = 0; y < lcd_height; y++){
+		auto line = this->pixels + y * lcd_width;
+		compose_scanline(dst + y * lcd_width, line, line, this->palettes[y]);
 	}
 }
+#endif
 
 std::ostream &operator<<(std::ostream &stream, const RGB &rgb){
 	stream << std::hex;
@@ -5,6 +5,7 @@
 #include <unordered_map>
 #include <atomic>
 #include <mutex>
+#include <memory>
 #include "point.h"
 #include "PublishingResource.h"
 #include "utility.h"
@@ -12,6 +13,10 @@
 class Gameboy;
 class GameboyCpu;
 class MemoryController;
+class LayerCache;
+class ScanlineRenderer;
+class RenderThread;
+struct ScanlineState;
 
 #define DECLARE_DISPLAY_RO_CONTROLLER_PROPERTY(x) byte_t get_##x()
 
@@ -28,6 +33,11 @@ class MemoryController;
 	}
 //#define DEBUG_FRAMES
 //#define DUMP_FRAMES
+//#define INDEXED_FRAMES
+
+#if defined DEBUG_FRAMES && defined INDEXED_FRAMES
+#error DEBUG_FRAMES requires RGB frames.
+#endif
 
 const unsigned lcd_refresh_period = 70224;
 //LCD refresh rate: ~59.7275 Hz (exactly gb_cpu_frequency/lcd_refresh_period Hz)
@@ -47,8 +57,19 @@ std::ostream &operator<<(std::ostream &, const RGB &);
 
 struct RenderedFrame{
 	static const size_t size = lcd_width * lcd_height;
+	//Size of the frame as RGB.
 	static const size_t bytes_size = lcd_width * lcd_height * sizeof(RGB);
+#ifndef INDEXED_FRAMES
 	RGB pixels[size];
+#else
+	//One palette slot per pixel (see ScanlineCompositor.h) and the palette
+	//each line was drawn with. The GraphicsOutputProvider converts the frame
+	//with to_rgb().
+	byte_t pixels[size];
+	RGB palettes[lcd_height][16];
+
+	void to_rgb(RGB *dst) const;
+#endif
 };
 
 struct PixelDetails{
@@ -78,12 +99,11 @@ class DisplayController{
 	MemoryController *memory_controller = nullptr;
 	MemorySection<0x8000> vram;
 	MemorySection<0xFE00> oam;
+	//Draws the lines while the render thread isn't running.
+	std::unique_ptr<ScanlineRenderer> renderer;
 	byte_t bg_palette_value = 0;
 	byte_t obj0_palette_value = 0;
 	byte_t obj1_palette_value = 0;
-	RGB bg_palette[4];
-	RGB obj0_palette[4];
-	RGB obj1_palette[4];
 	unsigned scroll_x = 0,
 		scroll_y = 0;
 	byte_t lcd_control = 0;
@@ -95,11 +115,33 @@ class DisplayController{
 	std::atomic<bool> display_enabled;
 	static const std::uint64_t invalid_clock = std::numeric_limits<std::uint64_t>::max();
 	std::uint64_t display_clock_start = invalid_clock;
+	static const unsigned row_period = 456;
+	static const unsigned rows_per_frame = lcd_refresh_period / row_period;
+	//While the LCD is on, the current row (LY, including VBlank rows) and the
+	//clock value at which it started. Updated by get_row_cycle().
+	unsigned current_row = 0;
+	std::uint64_t current_row_start = 0;
 	int last_row_state = -1;
 	unsigned swallow_frames = 0;
+	int frameskip = 0;
+	unsigned frameskip_counter = 0;
+	//Whether the frame being drawn is skipped. Its rows still go through
+	//every LCD state, but nothing is rendered or published.
+	bool skip_rendering = false;
+	std::uint64_t frames_skipped = 0;
+	//Lines aren't drawn at HBlank but put off until something that could
+	//change them is written, or until VBlank, and then drawn in one go. A
+	//frame without mid-frame changes is drawn in a single batch.
+	unsigned deferred_first = 0;
+	unsigned deferred_count = 0;
+	unsigned frame_batches = 0;
+	std::uint64_t frames_rendered = 0;
+	std::uint64_t frames_batched = 0;
 	bool clock_start_scheduled = false;
 
 	PublishingResource<RenderedFrame> publishing_frames;
+	//Must be destroyed before publishing_frames.
+	std::unique_ptr<RenderThread> render_thread;
 
 	static const byte_t stat_coincidence_interrupt_mask = bit(6);
 	static const byte_t stat_oam_interrupt_mask = bit(5);
@@ -120,6 +162,8 @@ class DisplayController{
 	static const byte_t lcdc_sprite_enable_mask = bit(1);
 	static const byte_t lcdc_bg_enable_mask = bit(0);
 
+	//Returns the number of cycles since the start of the current row.
+	unsigned get_row_cycle();
 	int get_row_status();
 	int get_LY();
 	int get_lcd_transfer_status();
@@ -139,16 +183,38 @@ class DisplayController{
 		return 0x400 * check_flag(this->lcd_control, lcdc_window_map_select_mask);
 	}
 	void toggle_lcd();
+	bool skip_next_frame();
+	ScanlineState get_scanline_state() const;
+	void defer_scanline(unsigned);
+	void render_deferred_lines();
+	void render_lines(unsigned first, unsigned count);
+	//Must be called before anything that changes how a line is drawn.
+	void flush_deferred_lines(){
+		if (this->deferred_count)
+			this->render_deferred_lines();
+	}
+	template <typename T>
+	void set_render_register(T &dst, byte_t value){
+		if (dst != value)
+			this->flush_deferred_lines();
+		dst = value;
+	}
+	//Schedules the next call to update() for the next row state boundary.
+	void schedule_next_update();
 
 	void switch_to_row_state_0(unsigned);
 	void switch_to_row_state_1(unsigned);
 	void switch_to_row_state_2(unsigned);
 	void switch_to_row_state_3(unsigned);
-	void render_current_scanline(unsigned);
 	void enable_memories();
 	std::uint64_t get_system_clock() const;
 public:
+	//Frameskip setting that skips frames while the host hasn't taken the
+	//last one published.
+	static const int auto_frameskip = -1;
+
 	DisplayController(Gameboy &system);
+	~DisplayController();
 	void set_memory_controller(MemoryController &mc){
 		this->memory_controller = &mc;
 	}
@@ -168,13 +234,20 @@ public:
 	DECLARE_DISPLAY_CONTROLLER_PROPERTY(obj0_palette);
 	DECLARE_DISPLAY_CONTROLLER_PROPERTY(obj1_palette);
 	DECLARE_DISPLAY_CONTROLLER_PROPERTY(lcd_control);
+	//Returns the earliest clock value at which LY or STAT can read differently,
+	//unless a register is written first.
+	std::uint64_t get_next_status_change();
 
+	//VRAM writes must go through write_vram(), so the renderer sees them.
 	byte_t &access_vram(main_integer_t address){
 		return this->vram.access(address);
 	}
+	void write_vram(main_integer_t address, byte_t value);
+	//Likewise for OAM and write_oam().
 	byte_t &access_oam(main_integer_t address){
 		return this->oam.access(address);
 	}
+	void write_oam(main_integer_t address, byte_t value);
 	const byte_t &access_vram(main_integer_t address) const{
 		return this->vram.access(address);
 	}
@@ -206,4 +279,41 @@ public:
 	bool get_display_enabled() const{
 		return this->display_enabled;
 	}
+	//0 draws every frame and N > 0 draws one frame out of N + 1. See also
+	//auto_frameskip.
+	void set_frameskip(int frameskip){
+		this->frameskip = frameskip;
+		this->frameskip_counter = 0;
+	}
+	std::uint64_t get_frames_skipped() const{
+		return this->frames_skipped;
+	}
+	//Frames published but replaced before the host took them.
+	std::uint64_t get_frames_dropped() const{
+		return this->publishing_frames.get_dropped();
+	}
+	//Frames the host took more than once, because no new one was ready.
+	std::uint64_t get_frames_duplicated() const{
+		return this->publishing_frames.get_duplicated();
+	}
+	//Fraction of the frames drawn that were drawn in a single batch.
+	double get_batched_frame_rate() const{
+		return this->frames_rendered ? (double)this->frames_batched / this->frames_rendered : 0;
+	}
+	//Moves line rendering to a thread of its own, which trails the emulation
+	//by as many lines as it has queued. Off by default.
+	void set_render_thread(bool);
+	bool get_render_thread() const{
+		return !!this->render_thread;
+	}
+	//Draws the lines deferred so far and waits for the render thread to finish
+	//them. Frames are published by the render thread, so the host may see a
+	//frame later than the VBlank it was drawn for.
+	void flush_rendering();
+	//These count the work of the render thread while it runs. Call
+	//flush_rendering() first.
+	const LayerCache &get_layer_cache() const;
+	std::uint64_t get_sprite_bin_rebuilds() const;
+	//Public so that pdboy_bench can time it.
+	void render_current_scanline(unsigned);
 };
@@ -0,0 +1,41 @@
+#include "EventScheduler.h"
+#include <algorithm>
+
+EventScheduler::EventScheduler(){
+	std::fill(this->deadlines, this->deadlines + source_count, never);
+}
+
+void EventScheduler::schedule(EventSource source, std::uint64_t clock){
+	auto &deadline = this->deadlines[(unsigned)source];
+	auto old = deadline;
+	deadline = clock;
+	auto next_deadline = this->get_next_deadline();
+	if (clock <= next_deadline)
+		this->set_next_deadline(clock);
+	else if (old == next_deadline)
+		this->recompute_next_deadline();
+}
+
+void EventScheduler::set_next_deadline(std::uint64_t clock){
+	this->next_deadline = clock;
+	//wake() sets woken before it clears the deadline, so either it is seen
+	//here, or the deadline is cleared after the store above.
+	if (this->woken)
+		this->next_deadline = 0;
+}
+
+void EventScheduler::recompute_next_deadline(){
+	this->set_next_deadline(*std::min_element(this->deadlines, this->deadlines + source_count));
+}
+
+void EventScheduler::wake(){
+	this->woken = true;
+	this->next_deadline = 0;
+}
+
+bool EventScheduler::consume_wake(){
+	if (!this->woken.exchange(false))
+		return false;
+	this->recompute_next_deadline();
+	return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "CommonTypes.h"
+#include <limits>
+#include <atomic>
+
+//Sources are listed in the order in which they are dispatched when more than
+//one is due at the same time.
+enum class EventSource{
+	Timer = 0,
+	Dma,
+	Input,
+	Sound,
+	Display,
+	Count,
+};
+
+//Keeps the next deadline (in cpu_clock cycles) for every subsystem that needs
+//to be serviced while the CPU runs, so that the interpreter can run batches of
+//instructions instead of polling every subsystem after every instruction.
+class EventScheduler{
+public:
+	static const std::uint64_t never = std::numeric_limits<std::uint64_t>::max();
+private:
+	static const unsigned source_count = (unsigned)EventSource::Count;
+	std::uint64_t deadlines[source_count];
+	std::atomic<std::uint64_t> next_deadline{never};
+	std::atomic<bool> woken{false};
+
+	void set_next_deadline(std::uint64_t);
+	void recompute_next_deadline();
+public:
+	EventScheduler();
+	//Can be called from any thread. Makes the next deadline due immediately,
+	//so that the CPU stops after the current instruction and
+	//Gameboy::dispatch_events() calls consume_wake().
+	void wake();
+	//Returns whether wake() was called since the last call, and restores the
+	//real next deadline.
+	bool consume_wake();
+	void schedule(EventSource, std::uint64_t clock);
+	void cancel(EventSource source){
+		this->schedule(source, never);
+	}
+	std::uint64_t get_deadline(EventSource source) const{
+		return this->deadlines[(unsigned)source];
+	}
+	std::uint64_t get_next_deadline() const{
+		return this->next_deadline.load(std::memory_order_relaxed);
+	}
+	const std::atomic<std::uint64_t> *get_next_deadline_pointer() const{
+		return &this->next_deadline;
+	}
+	bool is_due(EventSource source, std::uint64_t clock) const{
+		return this->deadlines[(unsigned)source] <= clock;
+	}
+};
@@ -3,10 +3,12 @@
 #include "UserInputController.h"
 #include "StorageController.h"
 #include "HostSystemServiceProviders.h"
+#include "LayerCache.h"
 #include "timer.h"
 #include "exceptions.h"
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 
 Gameboy::Gameboy(HostSystem &host):
 		host(&host),
@@ -18,15 +20,20 @@ Gameboy::Gameboy(HostSystem &host):
 		clock(*this),
 		continue_running(false),
 		paused(false){
+	std::fill(this->event_time, this->event_time + (unsigned)EventSource::Count, 0);
 	this->cpu.initialize();
 	this->realtime_counter_frequency = get_timer_resolution();
+	this->scheduler.schedule(EventSource::Sound, 0);
+	this->scheduler.schedule(EventSource::Display, 0);
 }
 
 Gameboy::~Gameboy(){
 	if (this->registered)
 		this->host->get_timing_provider()->unregister_periodic_notification();
 	this->stop();
-	this->report_time_statistics();
+	//Only meaningful if the interpreter thread ran.
+	if (this->registered)
+		this->report_time_statistics();
 	this->ram_to_save.try_save(*this->host, true);
 }
 
@@ -39,7 +46,14 @@ void Gameboy::report_time_statistics(){
 		<< "Time spent waiting: " << time_waiting / realtime_counter_frequency << " s.\n"
 		<< "CPU usage:          " << time_running / (time_running + time_waiting) * 100 << " %\n"
 		<< "Speed:              " << (time_running + time_waiting) / time_running << "x\n"
-		<< "Speed 2:            " << (this->clock.get_clock_value() / (double)gb_cpu_frequency) / ((time_running + time_waiting) / realtime_counter_frequency) << "x\n";
+		<< "Speed 2:            " << (this->clock.get_clock_value() / (double)gb_cpu_frequency) / ((time_running + time_waiting) / realtime_counter_frequency) << "x\n"
+		<< "Idle cycles skipped: " << this->cpu.get_idle_cycles_skipped() << " (" << (double)this->cpu.get_idle_cycles_skipped() / this->clock.get_clock_value() * 100 << " %)\n"
+		<< "Frames skipped:     " << this->display_controller.get_frames_skipped() << "\n"
+		<< "Frames dropped:     " << this->display_controller.get_frames_dropped() << "\n"
+		<< "Frames duplicated:  " << this->display_controller.get_frames_duplicated() << "\n"
+		<< "Batched frames:     " << this->display_controller.get_batched_frame_rate() * 100 << " %\n"
+		<< "Sprite bin rebuilds: " << this->display_controller.get_sprite_bin_rebuilds() << "\n"
+		<< "Layer cache hits:   " << this->display_controller.get_layer_cache().get_hit_rate() * 100 << " %\n";
 }
 
 RenderedFrame *Gameboy::get_current_frame(){
@@ -110,13 +124,57 @@ void Gameboy::interpreter_thread_function(){
 }
 
 void Gameboy::run_until_next_frame(bool force){
+	if (this->speed_changed){
+		this->sound_controller.update(this->speed_multiplier, true);
+		this->speed_changed = false;
+	}
 	do{
-		this->cpu.run_one_instruction();
+		do
+			this->cpu.run_one_instruction();
+		while (this->clock.get_clock_value() < this->scheduler.get_next_deadline());
+	}while (!this->dispatch_events() && (this->continue_running || force));
+}
+
+bool Gameboy::dispatch_events(){
+	auto now = this->clock.get_clock_value();
+	std::uint64_t start = this->profiling ? get_timer_count() : 0;
+	bool ret = false;
+	//The host wakes the scheduler when a button is pressed.
+	if (this->scheduler.consume_wake())
+		this->scheduler.schedule(EventSource::Input, now);
+	if (this->scheduler.is_due(EventSource::Timer, now)){
+		this->scheduler.cancel(EventSource::Timer);
+		this->cpu.check_timer();
+		this->account_event_time(EventSource::Timer, start);
+	}
+	if (this->scheduler.is_due(EventSource::Dma, now)){
+		this->scheduler.cancel(EventSource::Dma);
+		this->cpu.perform_dmg_dma();
+		this->account_event_time(EventSource::Dma, start);
+	}
+	if (this->scheduler.is_due(EventSource::Input, now)){
+		this->scheduler.cancel(EventSource::Input);
 		if (this->input_controller.get_button_down())
 			this->cpu.joystick_irq();
-		this->sound_controller.update(this->speed_multiplier, this->speed_changed);
-		this->speed_changed = false;
-	}while (!this->display_controller.update() && (this->continue_running || force));
+		this->account_event_time(EventSource::Input, start);
+	}
+	if (this->scheduler.is_due(EventSource::Sound, now)){
+		this->sound_controller.update(this->speed_multiplier, false);
+		this->account_event_time(EventSource::Sound, start);
+	}
+	if (this->scheduler.is_due(EventSource::Display, now)){
+		ret = this->display_controller.update();
+		this->account_event_time(EventSource::Display, start);
+	}
+	return ret;
+}
+
+void Gameboy::account_event_time(EventSource source, std::uint64_t &start){
+	if (!this->profiling)
+		return;
+	auto now = get_timer_count();
+	this->event_time[(unsigned)source] += now - start;
+	start = now;
 }
 
 void Gameboy::sync_with_real_time(){
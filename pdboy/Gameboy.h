@@ -3,6 +3,7 @@
 #include "DisplayController.h"
 #include "UserInputController.h"
 #include "SystemClock.h"
+#include "EventScheduler.h"
 #include "StorageController.h"
 #include "SoundController.h"
 #include "threads.h"
@@ -18,6 +19,7 @@ enum class GameboyMode{
 
 class Gameboy{
 	HostSystem *host;
+	EventScheduler scheduler;
 	GameboyCpu cpu;
 	DisplayController display_controller;
 	UserInputController input_controller;
@@ -44,11 +46,18 @@ class Gameboy{
 	//Stores a timestamp of the first time interpreter_thread_function() was called.
 	Maybe<posix_time_t> start_time;
 	ExternalRamBuffer ram_to_save;
+	//Time spent servicing each event source, in timer counts. Only measured
+	//while profiling is enabled.
+	bool profiling = false;
+	std::uint64_t event_time[(unsigned)EventSource::Count];
 
 	void interpreter_thread_function();
 	void sync_with_real_time();
 	double get_real_time();
 	void report_time_statistics();
+	//Services every event that is due. Returns true if the frame is complete.
+	bool dispatch_events();
+	void account_event_time(EventSource, std::uint64_t &start);
 	//Blocks until unpaused.
 	void execute_pause();
 public:
@@ -73,6 +82,9 @@ public:
 	SystemClock &get_system_clock(){
 		return this->clock;
 	}
+	EventScheduler &get_scheduler(){
+		return this->scheduler;
+	}
 	GameboyMode get_mode() const{
 		return this->mode;
 	}
@@ -103,4 +115,11 @@ public:
 		return *this->start_time;
 	}
 	void save_ram(const ExternalRamBuffer &);
+	void set_profiling(bool enable){
+		this->profiling = enable;
+	}
+	//In units of get_timer_resolution().
+	std::uint64_t get_event_time(EventSource source) const{
+		return this->event_time[(unsigned)source];
+	}
 };
@@ -1,5 +1,6 @@
 #include "GameboyCpu.h"
 #include "Gameboy.h"
+#include "BlockCache.h"
 #include "exceptions.h"
 #include <fstream>
 #include <vector>
@@ -8,11 +9,14 @@
 #include <iomanip>
 #include <algorithm>
 #include <cassert>
+#include <limits>
 
 GameboyCpu::GameboyCpu(Gameboy &system):
 		registers(*this),
 		memory_controller(*this->system, *this),
-		system(&system){
+		system(&system),
+		block_cache(new BlockCache){
+	this->uncached_instructions[1].pc = std::numeric_limits<std::uint32_t>::max();
 }
 
 GameboyCpu::~GameboyCpu(){
@@ -33,6 +37,48 @@ GameboyCpu::~GameboyCpu(){
 void GameboyCpu::initialize(){
 	this->memory_controller.initialize();
 	this->initialize_opcode_tables();
+#ifdef GENERATED_THREADED_DISPATCH
+	this->cpu_clock = this->system->get_system_clock().get_cpu_clock_pointer();
+	this->next_deadline = this->system->get_scheduler().get_next_deadline_pointer();
+	this->block_generation = this->block_cache->get_generation_pointer();
+#endif
+#ifdef USE_JIT
+	auto offset = [this](const void *p){
+		return (std::int32_t)((const char *)p - (const char *)this);
+	};
+	auto &layout = this->jit_layout;
+	auto &registers = this->registers;
+	layout.register8[(int)Register8::B] = offset(&registers.b());
+	layout.register8[(int)Register8::C] = offset(&registers.c());
+	layout.register8[(int)Register8::D] = offset(&registers.d());
+	layout.register8[(int)Register8::E] = offset(&registers.e());
+	layout.register8[(int)Register8::H] = offset(&registers.h());
+	layout.register8[(int)Register8::L] = offset(&registers.l());
+	layout.register8[(int)Register8::Flags] = offset(&registers.f());
+	layout.register8[(int)Register8::A] = offset(&registers.a());
+	layout.register16[(int)Register16::AF] = offset(&registers.af());
+	layout.register16[(int)Register16::BC] = offset(&registers.bc());
+	layout.register16[(int)Register16::DE] = offset(&registers.de());
+	layout.register16[(int)Register16::HL] = offset(&registers.hl());
+	layout.register16[(int)Register16::SP] = offset(&registers.sp());
+	layout.register16[(int)Register16::PC] = offset(&registers.pc());
+	layout.current_pc = offset(&this->current_pc);
+	layout.full_pc = offset(&this->full_pc);
+	layout.full_pc_bank = offset(&this->full_pc_bank);
+	layout.interrupts_enabled = offset(&this->interrupts_enabled);
+	layout.read_pages = offset(this->memory_controller.get_read_pages());
+	layout.exit_requested = offset(&this->jit_exit_requested);
+	layout.faulted = offset(&this->jit_faulted);
+	layout.realtime_clock = this->system->get_system_clock().get_realtime_clock_pointer();
+	layout.cpu_clock = this->system->get_system_clock().get_cpu_clock_pointer();
+	layout.next_deadline = this->system->get_scheduler().get_next_deadline_pointer();
+	layout.load8 = (const void *)&GameboyCpu::jit_load8;
+	layout.load8_io = (const void *)&GameboyCpu::jit_load8_io;
+	layout.store8 = (const void *)&GameboyCpu::jit_store8;
+	layout.store8_io = (const void *)&GameboyCpu::jit_store8_io;
+	layout.store16 = (const void *)&GameboyCpu::jit_store16;
+	layout.decimal_adjust = (const void *)&GameboyCpu::jit_decimal_adjust;
+#endif
 	this->memory_controller.toggle_boostrap_rom(true);
 }
 
@@ -40,6 +86,59 @@ void GameboyCpu::take_time(std::uint32_t cycles){
 	this->system->get_system_clock().advance_clock(cycles);
 }
 
+//Every interrupt source is serviced through the event scheduler, so a halted
+//CPU can't wake up before the next deadline. Advance the clock to the first
+//4-cycle step at or after it in one go.
+void GameboyCpu::skip_halted_time(){
+	auto now = this->system->get_system_clock().get_clock_value();
+	auto deadline = this->system->get_scheduler().get_next_deadline();
+	std::uint64_t cycles = 4;
+	if (deadline > now + cycles){
+		cycles = (deadline - now + 3) & ~(std::uint64_t)3;
+		cycles = std::min<std::uint64_t>(cycles, 1 << 30);
+	}
+	this->take_time((std::uint32_t)cycles);
+}
+
+//Called whenever an idle loop is entered through the cache. If the previous
+//entry was exactly one iteration ago and the polled register still reads the
+//same, the loop has reached a steady state, so the iterations that would run
+//before the register can change or the next event is dispatched are skipped.
+void GameboyCpu::skip_idle_loop(const CachedBlock &block){
+	auto now = this->get_clock();
+	auto pc = (std::uint32_t)block.start | this->full_pc_bank;
+	main_integer_t value = 0;
+	if (block.idle_poll_address)
+		value = this->memory_controller.load8(block.idle_poll_address);
+	if (this->idle_loop_pc == pc && now - this->idle_loop_clock == block.cycles && this->idle_loop_value == value){
+		auto limit = std::min(this->system->get_scheduler().get_next_deadline(), this->get_next_poll_change(block.idle_poll_address));
+		if (limit > now){
+			//Every skipped iteration must end before the limit.
+			auto iterations = std::min<std::uint64_t>((limit - now - 1) / block.cycles, (1 << 30) / block.cycles);
+			auto cycles = iterations * block.cycles;
+			this->take_time((std::uint32_t)cycles);
+			this->idle_cycles_skipped += cycles;
+			now += cycles;
+		}
+	}
+	this->idle_loop_pc = pc;
+	this->idle_loop_clock = now;
+	this->idle_loop_value = value;
+}
+
+std::uint64_t GameboyCpu::get_next_poll_change(main_integer_t address){
+	switch (address){
+		case 0xFF04:
+			return this->system->get_system_clock().get_next_DIV_change();
+		case 0xFF41:
+		case 0xFF44:
+			return this->system->get_display_controller().get_next_status_change();
+		default:
+			//IF only changes when events are dispatched.
+			return EventScheduler::never;
+	}
+}
+
 void GameboyCpu::interrupt_toggle(bool enable){
 	this->interrupts_enabled = enable;
 }
@@ -77,12 +176,167 @@ void GameboyCpu::abort(){
 	throw GenericException("Gameboy program executed an illegal operation.");
 }
 
-byte_t GameboyCpu::load_pc_and_increment(){
-	return (byte_t)this->memory_controller.load8(this->registers.pc()++);
+void GameboyCpu::decode_instruction(CachedInstruction &dst, main_integer_t pc, bool halt_bug){
+	//The halt bug makes the CPU fail to increment PC after fetching the
+	//opcode, so the opcode byte is read again as the first operand.
+	main_integer_t next = halt_bug ? pc : pc + 1;
+	byte_t opcode = (byte_t)this->memory_controller.load8(pc);
+	unsigned length, operand_count;
+	if (opcode == 0xCB){
+		byte_t opcode2 = (byte_t)this->memory_controller.load8(next++ & 0xFFFF);
+		dst.function = this->opcode_table_cb[opcode2];
+		dst.opcode = 0xCB00 | opcode2;
+		length = opcode_length_table_cb[opcode2];
+		operand_count = length - 2;
+	}else{
+		dst.function = this->opcode_table[opcode];
+		dst.opcode = opcode;
+		length = opcode_length_table[opcode];
+		operand_count = length - 1;
+	}
+	assert(length >= 1 && length <= 3);
+	operand_count = std::min<unsigned>(operand_count, sizeof(dst.operands));
+	dst.pc = pc;
+#ifdef USE_JIT
+	dst.native = nullptr;
+#endif
+	dst.length = (std::uint8_t)(length - halt_bug);
+	for (unsigned i = 0; i < operand_count; i++)
+		dst.operands[i] = (std::uint8_t)this->memory_controller.load8((next + i) & 0xFFFF);
+}
+
+//Registers whose value only changes with time (or when an event is
+//dispatched), rather than as a result of what the CPU does.
+static const main_integer_t idle_poll_registers[] = { 0xFF04, 0xFF0F, 0xFF41, 0xFF44 };
+
+//Recognizes loops like
+//	wait: ldh a, (0x44)
+//	      cp 0x90
+//	      jr nz, wait
+//The only state such a loop touches is A and F, which after one iteration
+//depend only on the value read, so as long as that value stays the same,
+//every iteration is identical to the previous one.
+static void detect_idle_loop(CachedBlock &block){
+	block.idle_loop = false;
+	block.idle_poll_address = 0;
+	auto &instructions = block.instructions;
+	auto &jump = instructions.back();
+	main_integer_t target;
+	switch (jump.opcode){
+		case 0x18:
+		case 0x20:
+		case 0x28:
+		case 0x30:
+		case 0x38:
+			target = (jump.pc + jump.length + (std::int8_t)jump.operands[0]) & 0xFFFF;
+			break;
+		case 0xC2:
+		case 0xC3:
+		case 0xCA:
+		case 0xD2:
+		case 0xDA:
+			target = jump.operands[0] | (jump.operands[1] << 8);
+			break;
+		default:
+			return;
+	}
+	if (target != block.start)
+		return;
+	main_integer_t address = 0;
+	for (size_t i = 0; i + 1 < instructions.size(); i++){
+		auto &instruction = instructions[i];
+		main_integer_t read;
+		switch (instruction.opcode){
+			case 0xF0:
+				read = 0xFF00 | instruction.operands[0];
+				break;
+			case 0xFA:
+				read = instruction.operands[0] | (instruction.operands[1] << 8);
+				break;
+			//NOP, AND A, OR A, AND n, CP n
+			case 0x00:
+			case 0xA7:
+			case 0xB7:
+			case 0xE6:
+			case 0xFE:
+				continue;
+			default:
+				//BIT b, A
+				if (instruction.opcode > 0xFF && (instruction.opcode & 0xC7) == 0x47)
+					continue;
+				return;
+		}
+		if (std::find(std::begin(idle_poll_registers), std::end(idle_poll_registers), read) == std::end(idle_poll_registers))
+			return;
+		if (address && address != read)
+			return;
+		address = read;
+	}
+	block.idle_loop = true;
+	block.idle_poll_address = (std::uint16_t)address;
 }
 
-byte_t GameboyCpu::load_pc(){
-	return (byte_t)this->memory_controller.load8(this->registers.pc());
+std::unique_ptr<CachedBlock> GameboyCpu::decode_block(main_integer_t pc, main_integer_t end){
+	std::unique_ptr<CachedBlock> ret(new CachedBlock);
+	ret->start = (std::uint16_t)pc;
+	ret->cycles = 0;
+	auto &instructions = ret->instructions;
+	instructions.reserve(BlockCache::max_block_instructions + 1);
+	while (instructions.size() < BlockCache::max_block_instructions){
+		CachedInstruction instruction;
+		this->decode_instruction(instruction, pc, false);
+		if (pc + instruction.length > end)
+			break;
+		instructions.push_back(instruction);
+		pc += instruction.length;
+		bool cb = instruction.opcode > 0xFF;
+		auto opcode = instruction.opcode & 0xFF;
+		ret->cycles += cb ? opcode_cycles_table_cb[opcode] : opcode_cycles_table[opcode];
+		if (cb ? opcode_is_jump_table_cb[opcode] : opcode_is_jump_table[opcode])
+			break;
+	}
+	if (!instructions.size())
+		return nullptr;
+	ret->size = (std::uint16_t)(pc - ret->start);
+	detect_idle_loop(*ret);
+	CachedInstruction sentinel;
+	sentinel.pc = std::numeric_limits<std::uint32_t>::max();
+	instructions.push_back(sentinel);
+	return ret;
+}
+
+const GameboyCpu::CachedInstruction *GameboyCpu::fetch_instruction(){
+	auto pc = this->current_pc;
+	auto rom_bank = this->system->get_storage_controller().get_current_rom_bank();
+	this->full_pc_bank = rom_bank < 0 ? 0 : (rom_bank << 16);
+
+	if (!this->dmg_halt_bug){
+		auto block = this->block_cache->find(pc, rom_bank);
+		if (!block){
+			auto end = this->block_cache->get_region_end(pc);
+			if (end){
+				auto decoded = this->decode_block(pc, end);
+				if (decoded){
+#ifdef USE_JIT
+					//Blocks in RAM are invalidated too often for compiling them
+					//to pay off.
+					if (pc < 0x8000)
+						this->compile_block(*decoded);
+#endif
+					block = this->block_cache->insert(pc, rom_bank, std::move(decoded));
+				}
+			}
+		}
+		if (block){
+			if (block->idle_loop)
+				this->skip_idle_loop(*block);
+			return &block->instructions[0];
+		}
+	}
+
+	this->decode_instruction(this->uncached_instructions[0], pc, this->dmg_halt_bug);
+	this->dmg_halt_bug = false;
+	return this->uncached_instructions;
 }
 
 #define BREAKPOINT(x) if (this->current_pc == x) __debugbreak()
@@ -97,36 +351,152 @@ void GameboyCpu::run_one_instruction(){
 	assert(!(enable_interrupts && this->halted));
 
 	if (this->halted){
-		this->take_time(4);
+		this->skip_halted_time();
 	}else{
 		this->current_pc = this->registers.pc();
-		auto rom_bank = this->system->get_storage_controller().get_current_rom_bank();
-		this->full_pc = (std::uint32_t)this->current_pc | (rom_bank < 0 ? 0 : (rom_bank << 16));
-
-		byte_t opcode;
-		if (!this->dmg_halt_bug)
-			opcode = this->load_pc_and_increment();
-		else{
-			opcode = this->load_pc();
-			this->dmg_halt_bug = false;
+		auto instruction = this->next_instruction;
+		if (!instruction || instruction->pc != this->current_pc || this->dmg_halt_bug)
+			instruction = this->fetch_instruction();
+		this->full_pc = (std::uint32_t)this->current_pc | this->full_pc_bank;
+
+		this->registers.pc() = (std::uint16_t)(this->current_pc + instruction->length);
+		this->operand_cursor = instruction->operands;
+		auto generation = this->block_cache->get_generation();
+#ifdef USE_JIT
+		//Compiled code doesn't implement the delay of EI either.
+		if (instruction->native && !enable_interrupts){
+			this->run_native_block(*instruction, generation);
+			return;
 		}
-
-		auto function_pointer = this->opcode_table[opcode];
+#endif
+#ifdef GENERATED_THREADED_DISPATCH
+		//run_threaded() runs until something needs attention, which the
+		//instruction after EI always does.
+		if (!enable_interrupts){
+			this->run_threaded(instruction, generation);
+			return;
+		}
+#endif
 #ifdef GATHER_INSTRUCTION_STATISTICS
-		this->instruction_histogram[opcode]++;
+		this->instruction_histogram[instruction->opcode]++;
 #endif
 
-		(this->*function_pointer)();
+		(this->*instruction->function)();
 		this->total_instructions++;
+
+		//If the instruction modified cached code or remapped memory, the rest
+		//of the block can't be trusted.
+		if (generation == this->block_cache->get_generation())
+			this->next_instruction = instruction + 1;
+		else
+			this->next_instruction = nullptr;
 	}
 
 	if (enable_interrupts)
 		this->interrupt_toggle(true);
+}
 
-	this->check_timer();
-	this->perform_dmg_dma();
+#ifdef USE_JIT
+//Compiles the block up to its first instruction the JIT doesn't support. If
+//that's the first one, or no executable memory is available, the block is
+//left to the interpreter.
+void GameboyCpu::compile_block(CachedBlock &block){
+	JitEmitter e(this->jit_layout);
+	e.begin_block();
+	bool empty = true;
+	for (auto &instruction : block.instructions){
+		if (instruction.pc == std::numeric_limits<std::uint32_t>::max())
+			break;
+		auto opcode = instruction.opcode & 0xFF;
+		auto emitter = instruction.opcode > 0xFF ? jit_emitter_table_cb[opcode] : jit_emitter_table[opcode];
+		if (!emitter)
+			break;
+		e.begin_instruction((std::uint16_t)instruction.pc, (std::uint16_t)(instruction.pc + instruction.length));
+		emitter(e, instruction.operands);
+		e.end_instruction();
+		empty = false;
+	}
+	if (empty)
+		return;
+	e.end_block();
+	block.instructions[0].native = this->jit_arena.store(e.get_code());
 }
 
+void GameboyCpu::run_native_block(const CachedInstruction &instruction, std::uint32_t generation){
+#ifdef GENERATED_LAZY_FLAGS
+	//Compiled code reads and writes F directly.
+	this->registers.pack_flags();
+#endif
+	this->jit_exit_requested = false;
+	this->jit_generation = generation;
+	auto executed = instruction.native(this);
+	this->total_instructions += executed;
+	if (this->jit_faulted){
+		this->jit_faulted = false;
+		this->next_instruction = nullptr;
+		auto e = this->jit_exception;
+		this->jit_exception = nullptr;
+		std::rethrow_exception(e);
+	}
+	if (generation == this->block_cache->get_generation())
+		this->next_instruction = &instruction + executed;
+	else
+		this->next_instruction = nullptr;
+}
+
+//Called after every helper that can change what the interpreter would check
+//between instructions (see continue_threaded()).
+void GameboyCpu::request_jit_exit_if_needed(){
+	if (this->jit_generation != this->block_cache->get_generation())
+		this->jit_exit_requested = true;
+	else if (this->interrupts_enabled && (this->interrupt_flag & this->interrupt_enable_flag & all_interrupts_mask))
+		this->jit_exit_requested = true;
+}
+
+//Exceptions can't unwind through compiled code, so they're stored and
+//rethrown by run_native_block().
+#define JIT_GUARDED(x)                                 \
+	try{                                               \
+		x;                                             \
+	}catch (...){                                      \
+		cpu->jit_exception = std::current_exception(); \
+		cpu->jit_faulted = true;                       \
+	}
+
+std::uint32_t GameboyCpu::jit_load8(GameboyCpu *cpu, std::uint32_t address){
+	std::uint32_t ret = 0;
+	JIT_GUARDED(ret = (std::uint32_t)cpu->memory_controller.load8(address));
+	cpu->request_jit_exit_if_needed();
+	return ret;
+}
+
+std::uint32_t GameboyCpu::jit_load8_io(GameboyCpu *cpu, std::uint32_t address){
+	std::uint32_t ret = 0;
+	JIT_GUARDED(ret = (std::uint32_t)cpu->memory_controller.load8_io(address));
+	cpu->request_jit_exit_if_needed();
+	return ret;
+}
+
+void GameboyCpu::jit_store8(GameboyCpu *cpu, std::uint32_t address, std::uint32_t value){
+	JIT_GUARDED(cpu->memory_controller.store8(address, value));
+	cpu->request_jit_exit_if_needed();
+}
+
+void GameboyCpu::jit_store8_io(GameboyCpu *cpu, std::uint32_t address, std::uint32_t value){
+	JIT_GUARDED(cpu->memory_controller.store8_io(address, value));
+	cpu->request_jit_exit_if_needed();
+}
+
+void GameboyCpu::jit_store16(GameboyCpu *cpu, std::uint32_t address, std::uint32_t value){
+	JIT_GUARDED(cpu->memory_controller.store16(address, value));
+	cpu->request_jit_exit_if_needed();
+}
+
+std::uint32_t GameboyCpu::jit_decimal_adjust(GameboyCpu *cpu, std::uint32_t value){
+	return (std::uint32_t)cpu->decimal_adjust(value);
+}
+#endif
+
 main_integer_t GameboyCpu::decimal_adjust(main_integer_t value){
 	value &= 0xFF;
 	if (!this->registers.get(Flags::Subtract)){
@@ -177,6 +547,7 @@ bool GameboyCpu::attempt_to_handle_interrupts(){
 		main_integer_t program_counter = this->registers.pc();
 		this->memory_controller.store16(new_stack_pointer, program_counter);
 		this->registers.pc() = (std::uint16_t)(0x0040 + i * 8);
+		this->next_instruction = nullptr;
 		this->interrupt_flag &= ~mask;
 		this->interrupt_toggle(false);
 		this->take_time(4 * 5);
@@ -203,6 +574,7 @@ void GameboyCpu::set_interrupt_enable_flag(byte_t b){
 
 void GameboyCpu::begin_dmg_dma_transfer(byte_t position){
 	this->dma_scheduled = position;
+	this->system->get_scheduler().schedule(EventSource::Dma, this->get_clock());
 }
 
 void GameboyCpu::perform_dmg_dma(){
@@ -223,7 +595,8 @@ std::uint64_t GameboyCpu::get_clock() const{
 }
 
 void GameboyCpu::opcode_cb(){
-	byte_t opcode = this->load_pc_and_increment();
+	//Normally unreachable, since CB-prefixed instructions are decoded directly.
+	byte_t opcode = this->load_operand8();
 	auto function_pointer = this->opcode_table_cb[opcode];
 #ifdef GATHER_INSTRUCTION_STATISTICS
 	this->instruction_histogram[0xCB00 | opcode]++;
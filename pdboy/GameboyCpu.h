@@ -4,18 +4,31 @@
 #include "MemoryController.h"
 #include "DisplayController.h"
 #include "CommonTypes.h"
+#include "JitEmitter.h"
 #include <cstdint>
 #include <type_traits>
 #include <map>
+#include <memory>
+#include <limits>
+#include <atomic>
+#include <exception>
 
 //#define GATHER_INSTRUCTION_STATISTICS
 
+//Generated code can only be run on x86-64, and executable memory is only
+//allocated on Linux.
+#if defined GENERATED_JIT && defined __x86_64__ && defined __linux__ && !defined GATHER_INSTRUCTION_STATISTICS
+#define USE_JIT
+#endif
+
 const unsigned gb_cpu_frequency_power = 22;
 const unsigned gb_cpu_frequency = 1 << gb_cpu_frequency_power; //4194304
 const double gb_cpu_clock_period_us = 1.0 / ((double)gb_cpu_frequency * 1e-6);
 const int dmg_dma_transfer_length_clocks = 640;
 
 class Gameboy;
+class BlockCache;
+struct CachedBlock;
 
 class GameboyCpu{
 	Gameboy *system;
@@ -32,6 +45,12 @@ class GameboyCpu{
 	bool halted = false;
 	bool dmg_halt_bug = false;
 	bool interrupt_enable_scheduled = false;
+	//The idle loop last entered, when it was entered, and what the register it
+	//polls read at that point. See skip_idle_loop().
+	std::uint32_t idle_loop_pc = std::numeric_limits<std::uint32_t>::max();
+	std::uint64_t idle_loop_clock = 0;
+	main_integer_t idle_loop_value = 0;
+	std::uint64_t idle_cycles_skipped = 0;
 
 	static const unsigned vblank_flag_bit = 0;
 	static const unsigned lcd_stat_flag_bit = 1;
@@ -53,23 +72,117 @@ class GameboyCpu{
 	static const unsigned joypad_interrupt_handler_address    = 0x0040 + 8 * joypad_flag_bit;
 
 	main_integer_t decimal_adjust(main_integer_t);
-	byte_t load_pc_and_increment();
-	byte_t load_pc();
 	bool attempt_to_handle_interrupts();
-	void perform_dmg_dma();
-	void check_timer();
 
 #ifdef GATHER_INSTRUCTION_STATISTICS
 	std::map<unsigned, unsigned> instruction_histogram;
 #endif
 
+public:
+	struct CachedInstruction;
+private:
 #include "../generated_files/cpu.generated.h"
 
+public:
+	//An instruction with its immediate operands already fetched.
+	struct CachedInstruction{
+		opcode_function_pointer function;
+		std::uint32_t pc;
+		std::uint16_t opcode;
+		//How far PC advances before the instruction runs.
+		std::uint8_t length;
+		std::uint8_t operands[2];
+#ifdef USE_JIT
+		//Compiled code for the block, if this is its first instruction and
+		//it could be compiled.
+		JitEmitter::native_function native;
+#endif
+	};
+private:
+	std::unique_ptr<BlockCache> block_cache;
+	const CachedInstruction *next_instruction = nullptr;
+	std::uint32_t full_pc_bank = 0;
+	const std::uint8_t *operand_cursor = nullptr;
+	//Used for instructions that can't be cached, followed by a sentinel.
+	CachedInstruction uncached_instructions[2];
+
+	const CachedInstruction *fetch_instruction();
+	void skip_idle_loop(const CachedBlock &);
+	std::uint64_t get_next_poll_change(main_integer_t address);
+	void decode_instruction(CachedInstruction &, main_integer_t pc, bool halt_bug);
+	std::unique_ptr<CachedBlock> decode_block(main_integer_t pc, main_integer_t end);
+	byte_t load_operand8(){
+		return *this->operand_cursor++;
+	}
+	main_integer_t load_operand16(){
+		main_integer_t ret = this->operand_cursor[0] | (this->operand_cursor[1] << 8);
+		this->operand_cursor += 2;
+		return ret;
+	}
+
+#ifdef USE_JIT
+	JitLayout jit_layout;
+	JitCodeArena jit_arena;
+	//Set by the helpers below when compiled code must return control to
+	//run_one_instruction() after the current instruction.
+	bool jit_exit_requested = false;
+	//Set if a helper threw. Compiled code returns right away, and
+	//run_native_block() rethrows jit_exception.
+	bool jit_faulted = false;
+	std::exception_ptr jit_exception;
+	std::uint32_t jit_generation = 0;
+
+	void compile_block(CachedBlock &);
+	void run_native_block(const CachedInstruction &, std::uint32_t generation);
+	void request_jit_exit_if_needed();
+	static std::uint32_t jit_load8(GameboyCpu *, std::uint32_t address);
+	static std::uint32_t jit_load8_io(GameboyCpu *, std::uint32_t address);
+	static void jit_store8(GameboyCpu *, std::uint32_t address, std::uint32_t value);
+	static void jit_store8_io(GameboyCpu *, std::uint32_t address, std::uint32_t value);
+	static void jit_store16(GameboyCpu *, std::uint32_t address, std::uint32_t value);
+	static std::uint32_t jit_decimal_adjust(GameboyCpu *, std::uint32_t value);
+#endif
+
+#ifdef GENERATED_THREADED_DISPATCH
+	//Set by initialize(), so that run_threaded() doesn't have to go through
+	//Gameboy and BlockCache for every instruction.
+	const std::uint64_t *cpu_clock = nullptr;
+	const std::atomic<std::uint64_t> *next_deadline = nullptr;
+	const std::uint32_t *block_generation = nullptr;
+
+	unsigned begin_threaded_instruction(const CachedInstruction &instruction){
+		this->current_pc = instruction.pc;
+		this->full_pc = instruction.pc | this->full_pc_bank;
+		this->registers.pc() = (std::uint16_t)(instruction.pc + instruction.length);
+		this->operand_cursor = instruction.operands;
+#ifdef GATHER_INSTRUCTION_STATISTICS
+		this->instruction_histogram[instruction.opcode]++;
+#endif
+		return (instruction.opcode & 0xFF) | (instruction.opcode > 0xFF ? 0x100 : 0);
+	}
+	//Advances to the next instruction of the block and returns true if it can
+	//run without going through run_one_instruction().
+	bool continue_threaded(const CachedInstruction *&instruction, std::uint32_t generation){
+		this->total_instructions++;
+		if (generation != *this->block_generation){
+			this->next_instruction = nullptr;
+			return false;
+		}
+		this->next_instruction = ++instruction;
+		if (instruction->pc != this->registers.pc() || *this->cpu_clock >= this->next_deadline->load(std::memory_order_relaxed))
+			return false;
+		if (this->halted || this->dmg_halt_bug || this->interrupt_enable_scheduled)
+			return false;
+		return !(this->interrupts_enabled && (this->interrupt_flag & this->interrupt_enable_flag & all_interrupts_mask));
+	}
+#endif
+
 public:
 	GameboyCpu(Gameboy &);
 	~GameboyCpu();
 	void initialize();
 	void take_time(std::uint32_t cycles);
+	void skip_halted_time();
 	void interrupt_toggle(bool);
 	void schedule_interrupt_enable();
 	void stop();
@@ -84,9 +197,17 @@ public:
 	byte_t get_interrupt_enable_flag() const;
 	void set_interrupt_enable_flag(byte_t b);
 	void begin_dmg_dma_transfer(byte_t position);
+	void perform_dmg_dma();
+	void check_timer();
 	bool get_halted() const{
 		return this->halted;
 	}
+	std::uint64_t get_total_instructions() const{
+		return this->total_instructions;
+	}
+	std::uint64_t get_idle_cycles_skipped() const{
+		return this->idle_cycles_skipped;
+	}
 	main_integer_t get_current_pc() const{
 		return this->current_pc;
 	}
@@ -96,6 +217,9 @@ public:
 	std::uint32_t get_full_pc() const{
 		return this->full_pc;
 	}
+	BlockCache &get_block_cache(){
+		return *this->block_cache;
+	}
 	std::uint64_t get_clock() const;
 };
 
@@ -4,7 +4,9 @@
 #include "StorageController.h"
 #include <iostream>
 #include <iomanip>
-#include <SDL.h>
+#ifdef BENCHMARKING
+#include "timer.h"
+#endif
 
 HostSystem::HostSystem(
 			StorageProvider *storage_provider,
@@ -47,11 +49,11 @@ void HostSystem::run(){
 	this->gameboy->run();
 	try{
 #ifdef BENCHMARKING
-		auto start = SDL_GetTicks();
+		auto start = get_timer_count();
 #endif
 		while (this->handle_events()){
 #ifdef BENCHMARKING
-			if (SDL_GetTicks() - start >= 20000)
+			if (get_timer_count() - start >= 20 * get_timer_resolution())
 				break;
 #endif
 			this->check_exceptions();
@@ -155,6 +157,7 @@ void HostSystem::toggle_fastforward(bool on) NOEXCEPT{
 		return;
 	double speed = on ? 5.0 : 1.0;
 	this->gameboy->set_speed_multiplier(speed);
+	this->gameboy->get_display_controller().set_frameskip(on ? this->fastforward_frameskip : 0);
 	this->gameboy->toggle_pause(false);
 }
 
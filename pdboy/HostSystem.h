@@ -26,6 +26,7 @@ protected:
 	DateTimeProvider *datetime_provider;
 	std::shared_ptr<std::exception> thrown_exception;
 	std::mutex thrown_exception_mutex;
+	int fastforward_frameskip = DisplayController::auto_frameskip;
 
 	void check_exceptions();
 	void render();
@@ -66,6 +67,10 @@ public:
 	std::unique_ptr<std::vector<byte_t>> load_ram(Cartridge &, size_t expected_size);
 	posix_time_t load_rtc(Cartridge &);
 	void toggle_fastforward(bool) NOEXCEPT;
+	//Frameskip used while fast-forwarding (see DisplayController::set_frameskip()).
+	void set_fastforward_frameskip(int frameskip){
+		this->fastforward_frameskip = frameskip;
+	}
 	void toggle_slowdown(bool) NOEXCEPT;
 	void toggle_pause(int);
 	void write_frame_to_disk(std::string &path, const RenderedFrame &);
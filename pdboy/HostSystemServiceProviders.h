@@ -109,6 +109,18 @@ public:
 	virtual void stop_audio() = 0;
 };
 
+//Provides no input, output or timing notifications, for running headless.
+class NullProvider : public EventProvider, public TimingProvider, public GraphicsOutputProvider, public AudioOutputProvider{
+public:
+	bool handle_events(HandleEventsResult &) override{
+		return true;
+	}
+	void register_periodic_notification(Event &) override{}
+	void unregister_periodic_notification() override{}
+	void render(const RenderedFrame *) override{}
+	void stop_audio() override{}
+};
+
 enum class DisconnectionCause{
 	ConnectionAborted,
 	LocalUserInitiated,
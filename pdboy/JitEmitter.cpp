@@ -0,0 +1,673 @@
+#include "JitEmitter.h"
+#include <cstring>
+#if defined __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+//Host registers slots are allocated from, callee-saved ones first, since
+//those don't have to be saved around helper calls. rax and rcx are scratch,
+//rbx holds the GameboyCpu, r13 and r14 the CPU clock at the last write back
+//and now, and r15 points to the next deadline.
+static const unsigned slot_registers[] = { 12, 5, 6, 7, 2, 8, 9, 10, 11 };
+
+//Passed to call() instead of a slot, for an argument already in ecx.
+static const int argument_in_rcx = -2;
+
+void JitEmitter::word(std::uint32_t x){
+	this->byte(x & 0xFF);
+	this->byte((x >> 8) & 0xFF);
+}
+
+void JitEmitter::dword(std::uint32_t x){
+	for (int i = 0; i < 4; i++, x >>= 8)
+		this->byte(x & 0xFF);
+}
+
+void JitEmitter::qword(std::uint64_t x){
+	for (int i = 0; i < 8; i++, x >>= 8)
+		this->byte(x & 0xFF);
+}
+
+void JitEmitter::instruction(std::initializer_list<unsigned> opcode, bool w, unsigned reg, const Operand &rm, bool prefix16, bool byte_registers){
+	if (prefix16)
+		this->byte(0x66);
+	unsigned prefix = 0x40 | ((unsigned)w << 3) | ((reg >> 3) << 2) | (rm.reg >> 3);
+	if (rm.memory && rm.index >= 0)
+		prefix |= ((unsigned)rm.index >> 3) << 1;
+	bool force = byte_registers && ((reg >= rsp && reg <= rdi) || (!rm.memory && rm.reg >= rsp && rm.reg <= rdi));
+	if (prefix != 0x40 || force)
+		this->byte(prefix);
+	for (auto b : opcode)
+		this->byte(b);
+	if (!rm.memory){
+		this->byte(0xC0 | ((reg & 7) << 3) | (rm.reg & 7));
+		return;
+	}
+	//Memory operands are always [base + disp8] or [base + disp32], with a SIB
+	//byte if there's an index or the base is rsp or r12.
+	bool short_disp = rm.disp >= -128 && rm.disp < 128;
+	unsigned mod = short_disp ? 0x40 : 0x80;
+	if (rm.index >= 0 || (rm.reg & 7) == rsp){
+		this->byte(mod | 0x04 | ((reg & 7) << 3));
+		this->byte((rm.scale << 6) | (((rm.index >= 0 ? (unsigned)rm.index : (unsigned)rsp) & 7) << 3) | (rm.reg & 7));
+	}else
+		this->byte(mod | ((reg & 7) << 3) | (rm.reg & 7));
+	if (short_disp)
+		this->byte((std::uint32_t)rm.disp & 0xFF);
+	else
+		this->dword((std::uint32_t)rm.disp);
+}
+
+void JitEmitter::arithmetic_imm(unsigned digit, const Operand &rm, std::uint32_t imm, bool w){
+	if ((std::int32_t)imm >= -128 && (std::int32_t)imm < 128){
+		this->instruction({ 0x83 }, w, digit, rm);
+		this->byte(imm & 0xFF);
+	}else{
+		this->instruction({ 0x81 }, w, digit, rm);
+		this->dword(imm);
+	}
+}
+
+void JitEmitter::mov_imm(unsigned r, std::uint32_t value){
+	if (r >= r8)
+		this->byte(0x41);
+	this->byte(0xB8 | (r & 7));
+	this->dword(value);
+}
+
+void JitEmitter::mov_imm64(unsigned r, std::uint64_t value){
+	this->byte(0x48 | (r >> 3));
+	this->byte(0xB8 | (r & 7));
+	this->qword(value);
+}
+
+void JitEmitter::push(unsigned r){
+	if (r >= r8)
+		this->byte(0x41);
+	this->byte(0x50 | (r & 7));
+}
+
+void JitEmitter::pop(unsigned r){
+	if (r >= r8)
+		this->byte(0x41);
+	this->byte(0x58 | (r & 7));
+}
+
+size_t JitEmitter::jump(Condition condition){
+	this->byte(0x0F);
+	this->byte(0x80 | condition);
+	auto ret = this->code.size();
+	this->dword(0);
+	return ret;
+}
+
+size_t JitEmitter::jump(){
+	this->byte(0xE9);
+	auto ret = this->code.size();
+	this->dword(0);
+	return ret;
+}
+
+void JitEmitter::patch(size_t at, size_t target){
+	auto relative = (std::uint32_t)(std::int32_t)(target - (at + 4));
+	for (int i = 0; i < 4; i++, relative >>= 8)
+		this->code[at + i] = relative & 0xFF;
+}
+
+JitEmitter::Operand JitEmitter::operand(unsigned slot) const{
+	auto &s = this->slots[slot];
+	if (s.kind == SlotKind::Register)
+		return reg(s.value);
+	return this->home(slot);
+}
+
+void JitEmitter::load(unsigned r, unsigned slot){
+	auto &s = this->slots[slot];
+	switch (s.kind){
+		case SlotKind::Constant:
+			this->mov_imm(r, s.value);
+			break;
+		case SlotKind::Register:
+			if (s.value != r)
+				this->instruction({ 0x8B }, false, r, reg(s.value));
+			break;
+		default:
+			this->instruction({ 0x8B }, false, r, this->home(slot));
+			break;
+	}
+}
+
+void JitEmitter::set_constant(unsigned slot, std::uint32_t value){
+	this->slots[slot] = { SlotKind::Constant, value };
+}
+
+unsigned JitEmitter::define(unsigned slot){
+	for (auto r : slot_registers){
+		if (!(this->free_registers & (1 << r)))
+			continue;
+		this->free_registers &= ~(1 << r);
+		this->slots[slot] = { SlotKind::Register, r };
+		return r;
+	}
+	this->slots[slot] = { SlotKind::Stack, 0 };
+	return rax;
+}
+
+void JitEmitter::commit(unsigned slot, unsigned r){
+	if (this->slots[slot].kind == SlotKind::Stack)
+		this->instruction({ 0x89 }, false, r, this->home(slot));
+}
+
+void JitEmitter::release(unsigned slot){
+	auto &s = this->slots[slot];
+	if (s.kind == SlotKind::Register)
+		this->free_registers |= 1 << s.value;
+	s.kind = SlotKind::Unused;
+}
+
+static std::uint32_t evaluate(unsigned digit, std::uint32_t a, std::uint32_t b){
+	switch (digit){
+		case 0:
+			return a + b;
+		case 1:
+			return a | b;
+		case 4:
+			return a & b;
+		case 5:
+			return a - b;
+		default:
+			return a ^ b;
+	}
+}
+
+void JitEmitter::alu(unsigned opcode, unsigned digit, unsigned dst, unsigned a, unsigned b){
+	if (this->is_constant(a) && this->is_constant(b)){
+		this->set_constant(dst, evaluate(digit, this->constant(a), this->constant(b)));
+		return;
+	}
+	auto t = this->define(dst);
+	this->load(t, a);
+	if (this->is_constant(b)){
+		this->arithmetic_imm(digit, reg(t), this->constant(b));
+	}else
+		this->instruction({ opcode }, false, t, this->operand(b));
+	this->commit(dst, t);
+}
+
+void JitEmitter::alu_imm(unsigned digit, unsigned dst, unsigned a, std::uint32_t imm){
+	if (this->is_constant(a)){
+		this->set_constant(dst, evaluate(digit, this->constant(a), imm));
+		return;
+	}
+	auto t = this->define(dst);
+	this->load(t, a);
+	this->arithmetic_imm(digit, reg(t), imm);
+	this->commit(dst, t);
+}
+
+void JitEmitter::shift(unsigned digit, unsigned dst, unsigned a, unsigned imm){
+	if (this->is_constant(a)){
+		auto value = this->constant(a);
+		this->set_constant(dst, digit == 4 ? value << imm : value >> imm);
+		return;
+	}
+	auto t = this->define(dst);
+	this->load(t, a);
+	this->instruction({ 0xC1 }, false, digit, reg(t));
+	this->byte(imm);
+	this->commit(dst, t);
+}
+
+void JitEmitter::compare(Condition condition, unsigned dst, unsigned a, std::uint32_t imm){
+	if (this->is_constant(a)){
+		auto value = this->constant(a);
+		bool result;
+		switch (condition){
+			case equal:
+				result = value == imm;
+				break;
+			case not_equal:
+				result = value != imm;
+				break;
+			case less:
+				result = (std::int32_t)value < (std::int32_t)imm;
+				break;
+			default:
+				result = value >= imm;
+				break;
+		}
+		this->set_constant(dst, result);
+		return;
+	}
+	auto t = this->define(dst);
+	//xor t, t; cmp a, imm; setcc t8
+	this->instruction({ 0x31 }, false, t, reg(t));
+	this->arithmetic_imm(7, this->operand(a), imm);
+	this->instruction({ 0x0F, 0x90 | (unsigned)condition }, false, 0, reg(t), false, true);
+	this->commit(dst, t);
+}
+
+void JitEmitter::write_pc_state(std::uint16_t pc, std::uint16_t next_pc){
+	//registers.pc() = next_pc
+	this->instruction({ 0xC7 }, false, 0, mem(rbx, this->layout->register16[(int)Register16::PC]), true);
+	this->word(next_pc);
+	//current_pc = pc
+	this->instruction({ 0xC7 }, true, 0, mem(rbx, this->layout->current_pc));
+	this->dword(pc);
+	//full_pc = full_pc_bank | pc
+	this->instruction({ 0x8B }, false, rax, mem(rbx, this->layout->full_pc_bank));
+	this->arithmetic_imm(1, reg(rax), pc);
+	this->instruction({ 0x89 }, false, rax, mem(rbx, this->layout->full_pc));
+}
+
+void JitEmitter::sync_pc(bool mark){
+	if (this->pc_synced)
+		return;
+	this->write_pc_state(this->pc, this->next_pc);
+	if (mark)
+		this->pc_synced = true;
+}
+
+void JitEmitter::flush_clock(){
+	//realtime_clock += r14 - r13; cpu_clock = r13 = r14
+	this->instruction({ 0x8B }, true, rax, reg(r14));
+	this->instruction({ 0x2B }, true, rax, reg(r13));
+	this->mov_imm64(rcx, (std::uint64_t)this->layout->realtime_clock);
+	this->instruction({ 0x01 }, true, rax, mem(rcx, 0));
+	this->mov_imm64(rcx, (std::uint64_t)this->layout->cpu_clock);
+	this->instruction({ 0x89 }, true, r14, mem(rcx, 0));
+	this->instruction({ 0x8B }, true, r13, reg(r14));
+}
+
+void JitEmitter::reload_clock(){
+	//rcx, since rax may hold the result of a call.
+	this->mov_imm64(rcx, (std::uint64_t)this->layout->cpu_clock);
+	this->instruction({ 0x8B }, true, r14, mem(rcx, 0));
+	this->instruction({ 0x8B }, true, r13, reg(r14));
+}
+
+void JitEmitter::call(const void *function, int a, int b, bool checked, unsigned keep, bool conditional){
+	std::vector<unsigned> saved;
+	for (unsigned i = 0; i < max_slots; i++){
+		auto &s = this->slots[i];
+		if (s.kind != SlotKind::Register || !caller_saved(s.value) || s.value == keep)
+			continue;
+		this->instruction({ 0x89 }, false, s.value, this->home(i));
+		saved.push_back(i);
+	}
+	//Every argument is now in a callee-saved register, in memory, or constant.
+	unsigned argument_registers[] = { rsi, rdx };
+	int arguments[] = { a, b };
+	for (int i = 0; i < 2; i++){
+		auto r = argument_registers[i];
+		auto slot = arguments[i];
+		if (slot == argument_in_rcx)
+			this->instruction({ 0x8B }, false, r, reg(rcx));
+		else if (slot >= 0){
+			auto &s = this->slots[slot];
+			if (s.kind == SlotKind::Register && caller_saved(s.value))
+				this->instruction({ 0x8B }, false, r, this->home(slot));
+			else
+				this->load(r, slot);
+		}
+	}
+	if (checked){
+		//Helpers may look at the PC and the clock, and may throw. A call that
+		//only happens on some paths can't mark the PC state as written.
+		this->sync_pc(!conditional);
+		this->flush_clock();
+	}
+	this->instruction({ 0x8B }, true, rdi, reg(rbx));
+	this->mov_imm64(rax, (std::uint64_t)function);
+	this->instruction({ 0xFF }, false, 2, reg(rax));
+	for (auto i : saved)
+		this->instruction({ 0x8B }, false, this->slots[i].value, this->home(i));
+	if (keep != rax)
+		this->instruction({ 0x8B }, false, keep, reg(rax));
+	if (!checked)
+		return;
+	this->instruction_calls = true;
+	//The clock may have been advanced by the helper.
+	this->reload_clock();
+	//if (faulted) return;
+	this->instruction({ 0x80 }, false, 7, mem(rbx, this->layout->faulted));
+	this->byte(0);
+	if (this->fault_exit < 0){
+		this->fault_exit = (int)this->exits.size();
+		this->add_exit(this->executed, false);
+	}
+	this->exits[this->fault_exit].jumps.push_back(this->jump(not_equal));
+}
+
+void JitEmitter::inline_load8(unsigned r){
+	//rax = read_pages[ecx >> 8]
+	this->instruction({ 0x8B }, false, rax, reg(rcx));
+	this->instruction({ 0xC1 }, false, 5, reg(rax));
+	this->byte(8);
+	this->instruction({ 0x8B }, true, rax, mem(rbx, this->layout->read_pages, rax, 3));
+	this->instruction({ 0x85 }, true, rax, reg(rax));
+	auto slow = this->jump(equal);
+	//movzx ecx, cl; movzx r, byte [rax + rcx]
+	this->instruction({ 0x0F, 0xB6 }, false, rcx, reg(rcx));
+	this->instruction({ 0x0F, 0xB6 }, false, r, mem(rax, 0, rcx));
+	auto done = this->jump();
+	this->patch_here(slow);
+	this->call(this->layout->load8, argument_in_rcx, -1, true, r, true);
+	this->patch_here(done);
+}
+
+JitEmitter::Exit &JitEmitter::add_exit(unsigned executed, bool write_pc){
+	this->exits.emplace_back();
+	auto &ret = this->exits.back();
+	ret.pc = this->pc;
+	ret.next_pc = this->next_pc;
+	ret.write_pc = write_pc;
+	ret.executed = executed;
+	return ret;
+}
+
+void JitEmitter::emit_exit(const Exit &exit){
+	for (auto at : exit.jumps)
+		this->patch_here(at);
+	if (exit.write_pc)
+		this->write_pc_state(exit.pc, exit.next_pc);
+	this->mov_imm(rdx, exit.executed);
+}
+
+void JitEmitter::emit_epilogue(){
+	this->flush_clock();
+	this->instruction({ 0x8B }, false, rax, reg(rdx));
+	//add rsp, frame_size
+	this->arithmetic_imm(0, reg(rsp), frame_size, true);
+	for (auto r : { r15, r14, r13, r12, rbp, rbx })
+		this->pop(r);
+	this->byte(0xC3);
+}
+
+void JitEmitter::begin_block(){
+	for (auto r : { rbx, rbp, r12, r13, r14, r15 })
+		this->push(r);
+	//sub rsp, frame_size
+	this->arithmetic_imm(5, reg(rsp), frame_size, true);
+	this->instruction({ 0x8B }, true, rbx, reg(rdi));
+	this->mov_imm64(r15, (std::uint64_t)this->layout->next_deadline);
+	this->reload_clock();
+}
+
+void JitEmitter::begin_instruction(std::uint16_t pc, std::uint16_t next_pc){
+	this->pc = pc;
+	this->next_pc = next_pc;
+	this->pc_synced = false;
+	this->pc_written = false;
+	this->instruction_calls = false;
+	this->force_exit = false;
+	this->skip_jumps.clear();
+	this->fault_exit = -1;
+	for (auto &slot : this->slots)
+		slot.kind = SlotKind::Unused;
+	this->free_registers = 0;
+	for (auto r : slot_registers)
+		this->free_registers |= 1 << r;
+}
+
+void JitEmitter::end_instruction(){
+	for (auto at : this->skip_jumps)
+		this->patch_here(at);
+	this->skip_jumps.clear();
+	this->executed++;
+
+	auto index = this->exits.size();
+	this->add_exit(this->executed, !this->pc_synced);
+	if (this->force_exit){
+		this->exits[index].jumps.push_back(this->jump());
+		return;
+	}
+	//if (r14 >= *r15) return;
+	this->instruction({ 0x3B }, true, r14, mem(r15, 0));
+	this->exits[index].jumps.push_back(this->jump(above_equal));
+	if (this->instruction_calls){
+		//if (exit_requested) return;
+		this->instruction({ 0x80 }, false, 7, mem(rbx, this->layout->exit_requested));
+		this->byte(0);
+		this->exits[index].jumps.push_back(this->jump(not_equal));
+	}
+}
+
+void JitEmitter::end_block(){
+	//The last instruction falls through to its own exit, and that to the
+	//epilogue, which the other exits jump back to.
+	if (!this->exits.size())
+		return;
+	this->emit_exit(this->exits.back());
+	this->exits.pop_back();
+	auto epilogue = this->code.size();
+	this->emit_epilogue();
+	for (auto &exit : this->exits){
+		this->emit_exit(exit);
+		this->patch(this->jump(), epilogue);
+	}
+	this->exits.clear();
+}
+
+void JitEmitter::load_register8(unsigned dst, Register8 r){
+	auto t = this->define(dst);
+	this->instruction({ 0x0F, 0xB6 }, false, t, mem(rbx, this->layout->register8[(int)r]));
+	this->commit(dst, t);
+}
+
+void JitEmitter::load_register16(unsigned dst, Register16 r){
+	//Until the instruction jumps, PC is the address of the next one.
+	if (r == Register16::PC && !this->pc_written){
+		this->set_constant(dst, this->next_pc);
+		return;
+	}
+	auto t = this->define(dst);
+	this->instruction({ 0x0F, 0xB7 }, false, t, mem(rbx, this->layout->register16[(int)r]));
+	this->commit(dst, t);
+}
+
+void JitEmitter::store_register8(Register8 r, unsigned src){
+	auto destination = mem(rbx, this->layout->register8[(int)r]);
+	if (this->is_constant(src)){
+		this->instruction({ 0xC6 }, false, 0, destination);
+		this->byte(this->constant(src) & 0xFF);
+		return;
+	}
+	unsigned value = rax;
+	if (this->slots[src].kind == SlotKind::Register)
+		value = this->slots[src].value;
+	else
+		this->load(rax, src);
+	this->instruction({ 0x88 }, false, value, destination, false, true);
+}
+
+void JitEmitter::store_register16(Register16 r, unsigned src){
+	if (r == Register16::PC){
+		this->sync_pc();
+		this->pc_written = true;
+	}
+	auto destination = mem(rbx, this->layout->register16[(int)r]);
+	if (this->is_constant(src)){
+		this->instruction({ 0xC7 }, false, 0, destination, true);
+		this->word(this->constant(src) & 0xFFFF);
+		return;
+	}
+	unsigned value = rax;
+	if (this->slots[src].kind == SlotKind::Register)
+		value = this->slots[src].value;
+	else
+		this->load(rax, src);
+	this->instruction({ 0x89 }, false, value, destination, true);
+}
+
+void JitEmitter::update_flags(unsigned mode_mask, unsigned value){
+	if (!mode_mask){
+		this->store_flags(value);
+		return;
+	}
+	auto flags = mem(rbx, this->layout->register8[(int)Register8::Flags]);
+	//movzx ecx, byte [F]
+	this->instruction({ 0x0F, 0xB6 }, false, rcx, flags);
+	this->load(rax, value);
+	//xor ecx, eax; and ecx, mode_mask; and eax, ~mode_mask; or eax, ecx
+	this->instruction({ 0x31 }, false, rax, reg(rcx));
+	this->arithmetic_imm(4, reg(rcx), mode_mask);
+	this->arithmetic_imm(4, reg(rax), ~mode_mask);
+	this->instruction({ 0x09 }, false, rcx, reg(rax));
+	this->instruction({ 0x88 }, false, rax, flags);
+}
+
+void JitEmitter::not_(unsigned dst, unsigned a){
+	if (this->is_constant(a)){
+		this->set_constant(dst, ~this->constant(a));
+		return;
+	}
+	auto t = this->define(dst);
+	this->load(t, a);
+	this->instruction({ 0xF7 }, false, 2, reg(t));
+	this->commit(dst, t);
+}
+
+void JitEmitter::sign_extend8(unsigned dst, unsigned a){
+	if (this->is_constant(a)){
+		this->set_constant(dst, (std::uint32_t)(std::int32_t)(std::int8_t)this->constant(a));
+		return;
+	}
+	auto t = this->define(dst);
+	//movsx t, byte a
+	this->instruction({ 0x0F, 0xBE }, false, t, this->operand(a), false, true);
+	this->commit(dst, t);
+}
+
+void JitEmitter::load8(unsigned dst, unsigned address){
+	auto t = this->define(dst);
+	//movzx ecx, address16
+	this->load(rcx, address);
+	this->instruction({ 0x0F, 0xB7 }, false, rcx, reg(rcx));
+	this->inline_load8(t);
+	this->commit(dst, t);
+}
+
+void JitEmitter::load8_io(unsigned dst, unsigned address){
+	auto t = this->define(dst);
+	this->call(this->layout->load8_io, address, -1, true, t);
+	this->commit(dst, t);
+}
+
+void JitEmitter::load16(unsigned dst, unsigned address){
+	//Like MemoryController::load16(), the high byte is read first.
+	auto t = this->define(dst);
+	this->load(rcx, address);
+	this->arithmetic_imm(0, reg(rcx), 1);
+	this->instruction({ 0x0F, 0xB7 }, false, rcx, reg(rcx));
+	this->inline_load8(t);
+	this->commit(dst, t);
+	this->load(rcx, address);
+	this->instruction({ 0x0F, 0xB7 }, false, rcx, reg(rcx));
+	this->inline_load8(rax);
+	//t = (t << 8) | eax
+	if (t == rax){
+		this->instruction({ 0x8B }, false, rcx, this->home(dst));
+		t = rcx;
+	}
+	this->instruction({ 0xC1 }, false, 4, reg(t));
+	this->byte(8);
+	this->instruction({ 0x09 }, false, rax, reg(t));
+	if (t == rcx)
+		this->instruction({ 0x89 }, false, rcx, this->home(dst));
+}
+
+void JitEmitter::store8(unsigned address, unsigned value){
+	this->call(this->layout->store8, address, value, true);
+}
+
+void JitEmitter::store8_io(unsigned address, unsigned value){
+	this->call(this->layout->store8_io, address, value, true);
+}
+
+void JitEmitter::store16(unsigned address, unsigned value){
+	this->call(this->layout->store16, address, value, true);
+}
+
+void JitEmitter::decimal_adjust(unsigned dst, unsigned a){
+	auto t = this->define(dst);
+	this->call(this->layout->decimal_adjust, a, -1, false, t);
+	this->commit(dst, t);
+}
+
+void JitEmitter::disable_interrupts(){
+	this->instruction({ 0xC6 }, false, 0, mem(rbx, this->layout->interrupts_enabled));
+	this->byte(0);
+}
+
+void JitEmitter::enable_interrupts(){
+	this->instruction({ 0xC6 }, false, 0, mem(rbx, this->layout->interrupts_enabled));
+	this->byte(1);
+	this->force_exit = true;
+}
+
+void JitEmitter::take_time(unsigned cycles){
+	//add r14, cycles
+	this->arithmetic_imm(0, reg(r14), cycles, true);
+}
+
+void JitEmitter::skip_if(unsigned condition, bool invert, unsigned cycles){
+	//Both paths must agree on whether the PC state has been written.
+	this->sync_pc();
+	if (this->is_constant(condition)){
+		if (!!this->constant(condition) != invert){
+			this->take_time(cycles);
+			this->skip_jumps.push_back(this->jump());
+		}
+		return;
+	}
+	this->arithmetic_imm(7, this->operand(condition), 0);
+	auto over = this->jump(invert ? not_equal : equal);
+	this->take_time(cycles);
+	this->skip_jumps.push_back(this->jump());
+	this->patch_here(over);
+}
+
+struct JitCodeArena::Chunk{
+	std::uint8_t *memory;
+	Chunk(std::uint8_t *memory): memory(memory){}
+	~Chunk(){
+#if defined __linux__
+		munmap(this->memory, chunk_size);
+#endif
+	}
+};
+
+JitCodeArena::JitCodeArena(){}
+
+JitCodeArena::~JitCodeArena(){}
+
+JitEmitter::native_function JitCodeArena::store(const std::vector<std::uint8_t> &code){
+#if defined __linux__ && defined __x86_64__
+	//Each store gets pages of its own, so code stored earlier is never made
+	//writable again.
+	static const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	auto length = (code.size() + page_size - 1) & ~(page_size - 1);
+	if (length > chunk_size)
+		return nullptr;
+	if (!this->chunks.size() || this->used + length > chunk_size){
+		auto memory = mmap(nullptr, chunk_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+			return nullptr;
+		this->chunks.emplace_back(new Chunk((std::uint8_t *)memory));
+		this->used = 0;
+	}
+	auto ret = this->chunks.back()->memory + this->used;
+	if (mprotect(ret, length, PROT_READ | PROT_WRITE))
+		return nullptr;
+	memcpy(ret, &code[0], code.size());
+	//If this fails the pages are left writable, but they're never run.
+	if (mprotect(ret, length, PROT_READ | PROT_EXEC))
+		return nullptr;
+	this->used += length;
+	return (JitEmitter::native_function)ret;
+#else
+	return nullptr;
+#endif
+}
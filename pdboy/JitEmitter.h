@@ -0,0 +1,308 @@
+#pragma once
+
+#include "CommonTypes.h"
+#include "RegisterStore.h"
+#include <vector>
+#include <memory>
+#include <initializer_list>
+#include <cstddef>
+
+class GameboyCpu;
+
+//Where generated code finds the state it accesses. Offsets are relative to
+//the GameboyCpu, which is kept in rbx; the rest are absolute addresses.
+struct JitLayout{
+	std::int32_t register8[8];
+	std::int32_t register16[6];
+	std::int32_t current_pc;
+	std::int32_t full_pc;
+	std::int32_t full_pc_bank;
+	std::int32_t interrupts_enabled;
+	std::int32_t read_pages;
+	std::int32_t exit_requested;
+	std::int32_t faulted;
+	std::uint64_t *realtime_clock;
+	std::uint64_t *cpu_clock;
+	const void *next_deadline;
+	const void *load8;
+	const void *load8_io;
+	const void *store8;
+	const void *store8_io;
+	const void *store16;
+	const void *decimal_adjust;
+};
+
+//Assembles x86-64 code for a run of instructions. The functions below the
+//block interface are the operations used by the emitters generated by
+//code_generator. Their operands are numbered slots, which are kept in host
+//registers while there are any free, and in stack memory otherwise. Slots
+//whose value is known while compiling are never materialized.
+//
+//Generated code is called as a native_function and returns the number of
+//instructions it completed. It stops after any instruction that leaves the
+//CPU clock at or past the next scheduled event, or that requests an exit
+//(see GameboyCpu::request_jit_exit_if_needed()), and right away if a helper
+//throws (see GameboyCpu::jit_faulted).
+class JitEmitter{
+public:
+	static const unsigned max_slots = 60;
+	typedef std::uint32_t (*native_function)(GameboyCpu *);
+private:
+	enum Reg{
+		rax = 0,
+		rcx = 1,
+		rdx = 2,
+		rbx = 3,
+		rsp = 4,
+		rbp = 5,
+		rsi = 6,
+		rdi = 7,
+		r8 = 8,
+		r9 = 9,
+		r10 = 10,
+		r11 = 11,
+		r12 = 12,
+		r13 = 13,
+		r14 = 14,
+		r15 = 15,
+	};
+	enum Condition{
+		below = 0x2,
+		above_equal = 0x3,
+		equal = 0x4,
+		not_equal = 0x5,
+		less = 0xC,
+	};
+	//Either a register or [base + index * (1 << scale) + disp].
+	struct Operand{
+		bool memory;
+		unsigned reg;
+		int index;
+		unsigned scale;
+		std::int32_t disp;
+	};
+	enum class SlotKind{
+		Unused,
+		Constant,
+		Register,
+		Stack,
+	};
+	struct Slot{
+		SlotKind kind;
+		std::uint32_t value;
+	};
+	struct Exit{
+		std::vector<size_t> jumps;
+		std::uint16_t pc;
+		std::uint16_t next_pc;
+		//Whether the PC state must still be written.
+		bool write_pc;
+		unsigned executed;
+	};
+	//The six callee-saved registers plus frame_size keep rsp 16-byte aligned
+	//for helper calls.
+	static const unsigned frame_size = max_slots * 4 + 8;
+
+	const JitLayout *layout;
+	std::vector<std::uint8_t> code;
+	std::vector<Exit> exits;
+	Slot slots[max_slots];
+	//Host registers not holding a slot.
+	unsigned free_registers;
+	unsigned executed = 0;
+	std::uint16_t pc = 0;
+	std::uint16_t next_pc = 0;
+	//Whether registers.pc(), current_pc and full_pc are up to date, and
+	//whether the instruction has written PC since.
+	bool pc_synced = false;
+	bool pc_written = false;
+	//Whether the current instruction calls into GameboyCpu, which may ask the
+	//block to exit.
+	bool instruction_calls = false;
+	bool force_exit = false;
+	std::vector<size_t> skip_jumps;
+	//Index in exits of where control goes if a helper called by the current
+	//instruction throws, or -1.
+	int fault_exit = -1;
+
+	void byte(unsigned b){
+		this->code.push_back((std::uint8_t)b);
+	}
+	void word(std::uint32_t);
+	void dword(std::uint32_t);
+	void qword(std::uint64_t);
+	static Operand reg(unsigned r){
+		return { false, r, -1, 0, 0 };
+	}
+	static Operand mem(unsigned base, std::int32_t disp, int index = -1, unsigned scale = 0){
+		return { true, base, index, scale, disp };
+	}
+	//[prefix] [rex] opcode modrm [sib] [disp]. byte_registers is set when reg
+	//or a register rm are used as 8-bit registers, so that 4 to 7 mean spl to dil.
+	void instruction(std::initializer_list<unsigned> opcode, bool w, unsigned reg, const Operand &rm, bool prefix16 = false, bool byte_registers = false);
+	//add, or, adc, sbb, and, sub, xor or cmp (by ModRM digit) rm, imm.
+	void arithmetic_imm(unsigned digit, const Operand &rm, std::uint32_t imm, bool w = false);
+	void mov_imm(unsigned r, std::uint32_t value);
+	void mov_imm64(unsigned r, std::uint64_t value);
+	void push(unsigned r);
+	void pop(unsigned r);
+	size_t jump(Condition);
+	size_t jump();
+	void patch(size_t at, size_t target);
+	void patch_here(size_t at){
+		this->patch(at, this->code.size());
+	}
+
+	static bool caller_saved(unsigned r){
+		return r == rdx || r == rsi || r == rdi || (r >= r8 && r <= r11);
+	}
+	Operand home(unsigned slot) const{
+		return mem(rsp, (std::int32_t)slot * 4);
+	}
+	Operand operand(unsigned slot) const;
+	bool is_constant(unsigned slot) const{
+		return this->slots[slot].kind == SlotKind::Constant;
+	}
+	std::uint32_t constant(unsigned slot) const{
+		return this->slots[slot].value;
+	}
+	void load(unsigned r, unsigned slot);
+	void set_constant(unsigned slot, std::uint32_t value);
+	//Assigns slot a host register to compute its value in, which is rax if
+	//none is free. commit() must be called once the value is there.
+	unsigned define(unsigned slot);
+	void commit(unsigned slot, unsigned r);
+	void alu(unsigned opcode, unsigned digit, unsigned dst, unsigned a, unsigned b);
+	void alu_imm(unsigned digit, unsigned dst, unsigned a, std::uint32_t imm);
+	void shift(unsigned digit, unsigned dst, unsigned a, unsigned imm);
+	void compare(Condition, unsigned dst, unsigned a, std::uint32_t imm);
+
+	void write_pc_state(std::uint16_t pc, std::uint16_t next_pc);
+	void sync_pc(bool mark = true);
+	void flush_clock();
+	void reload_clock();
+	//Calls a GameboyCpu helper with the GameboyCpu and up to two slots (or -1)
+	//as arguments. Caller-saved registers holding slots are restored after
+	//the call, and the result is moved to keep. Checked calls may throw, so
+	//they're preceded by writing back the PC and the clock, and followed by
+	//a check for a fault. conditional is set if the call is only made on
+	//some paths through the instruction.
+	void call(const void *function, int a, int b, bool checked, unsigned keep = rax, bool conditional = false);
+	//Reads the byte at the address in ecx into r, inline if the page is
+	//mapped directly. Clobbers rax and rcx.
+	void inline_load8(unsigned r);
+	Exit &add_exit(unsigned executed, bool write_pc);
+	//Sets edx to the number of instructions completed, for the epilogue.
+	void emit_exit(const Exit &);
+	void emit_epilogue();
+public:
+	JitEmitter(const JitLayout &layout): layout(&layout){}
+
+	//Block interface:
+	void begin_block();
+	void begin_instruction(std::uint16_t pc, std::uint16_t next_pc);
+	void end_instruction();
+	void end_block();
+	const std::vector<std::uint8_t> &get_code() const{
+		return this->code;
+	}
+
+	//Operations:
+	void release(unsigned slot);
+	void immediate(unsigned dst, std::uint32_t value){
+		this->set_constant(dst, value);
+	}
+	void load_register8(unsigned dst, Register8);
+	void load_register16(unsigned dst, Register16);
+	void store_register8(Register8, unsigned src);
+	void store_register16(Register16, unsigned src);
+	void load_flags(unsigned dst){
+		this->load_register8(dst, Register8::Flags);
+	}
+	void store_flags(unsigned src){
+		this->store_register8(Register8::Flags, src);
+	}
+	//F = (~mode_mask & value) | (mode_mask & (F ^ value))
+	void update_flags(unsigned mode_mask, unsigned value);
+	void add(unsigned dst, unsigned a, unsigned b){
+		this->alu(0x03, 0, dst, a, b);
+	}
+	void sub(unsigned dst, unsigned a, unsigned b){
+		this->alu(0x2B, 5, dst, a, b);
+	}
+	void and_(unsigned dst, unsigned a, unsigned b){
+		this->alu(0x23, 4, dst, a, b);
+	}
+	void or_(unsigned dst, unsigned a, unsigned b){
+		this->alu(0x0B, 1, dst, a, b);
+	}
+	void xor_(unsigned dst, unsigned a, unsigned b){
+		this->alu(0x33, 6, dst, a, b);
+	}
+	void add_imm(unsigned dst, unsigned a, std::uint32_t imm){
+		this->alu_imm(0, dst, a, imm);
+	}
+	void or_imm(unsigned dst, unsigned a, std::uint32_t imm){
+		this->alu_imm(1, dst, a, imm);
+	}
+	void and_imm(unsigned dst, unsigned a, std::uint32_t imm){
+		this->alu_imm(4, dst, a, imm);
+	}
+	void sub_imm(unsigned dst, unsigned a, std::uint32_t imm){
+		this->alu_imm(5, dst, a, imm);
+	}
+	void xor_imm(unsigned dst, unsigned a, std::uint32_t imm){
+		this->alu_imm(6, dst, a, imm);
+	}
+	void shl(unsigned dst, unsigned a, unsigned imm){
+		this->shift(4, dst, a, imm);
+	}
+	void shr(unsigned dst, unsigned a, unsigned imm){
+		this->shift(5, dst, a, imm);
+	}
+	void not_(unsigned dst, unsigned a);
+	void is_zero(unsigned dst, unsigned a){
+		this->compare(equal, dst, a, 0);
+	}
+	void is_not_zero(unsigned dst, unsigned a){
+		this->compare(not_equal, dst, a, 0);
+	}
+	void is_negative(unsigned dst, unsigned a){
+		this->compare(less, dst, a, 0);
+	}
+	void is_at_least(unsigned dst, unsigned a, std::uint32_t imm){
+		this->compare(above_equal, dst, a, imm);
+	}
+	void sign_extend8(unsigned dst, unsigned a);
+	void load8(unsigned dst, unsigned address);
+	void load8_io(unsigned dst, unsigned address);
+	void load16(unsigned dst, unsigned address);
+	void store8(unsigned address, unsigned value);
+	void store8_io(unsigned address, unsigned value);
+	void store16(unsigned address, unsigned value);
+	void decimal_adjust(unsigned dst, unsigned a);
+	void disable_interrupts();
+	//Also ends the block after the instruction, so that pending interrupts are
+	//handled.
+	void enable_interrupts();
+	void take_time(unsigned cycles);
+	//Ends the instruction early, after taking the given time, if the slot is
+	//non-zero (or zero, if invert is set).
+	void skip_if(unsigned condition, bool invert, unsigned cycles);
+};
+
+//Executable memory for generated code. No page is ever writable and
+//executable at once: each store maps its own pages writable for the copy,
+//and then executable. Allocations are only released when the arena is
+//destroyed.
+class JitCodeArena{
+	struct Chunk;
+	std::vector<std::unique_ptr<Chunk>> chunks;
+	size_t used = 0;
+public:
+	static const size_t chunk_size = 1 << 20;
+	JitCodeArena();
+	~JitCodeArena();
+	//Returns nullptr if executable memory isn't available on this platform.
+	JitEmitter::native_function store(const std::vector<std::uint8_t> &code);
+};
@@ -0,0 +1,29 @@
+#include "LayerCache.h"
+#include <algorithm>
+#include <cstring>
+
+LayerCache::LayerCache(const byte_t *maps, TileCache &tiles):
+		maps(maps),
+		tiles(&tiles),
+		pixels(new byte_t[layer_count * size * stride]){
+	std::fill(this->dirty, this->dirty + layer_count, 0xFFFFFFFF);
+	for (auto &users : this->tile_users)
+		std::fill(users, users + layer_count, 0);
+}
+
+void LayerCache::build_row(unsigned layer, unsigned row){
+	auto map = this->maps + layer / 2 * 0x400 + row * 32;
+	bool signed_tiles = layer & 1;
+	auto dst = &this->pixels[(layer * size + row * 8) * stride];
+	for (unsigned i = 0; i < 32; i++){
+		unsigned tile = map[i];
+		if (signed_tiles)
+			tile = 0x100 + (signed char)tile;
+		this->tile_users[tile][layer] |= bit(row);
+		for (unsigned y = 0; y < 8; y++)
+			memcpy(dst + y * stride + i * 8, this->tiles->get_row(tile, y), 8);
+	}
+	for (unsigned y = 0; y < 8; y++)
+		memcpy(dst + y * stride + size, dst + y * stride, stride - size);
+	this->dirty[layer] &= ~bit(row);
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "CommonTypes.h"
+#include "TileCache.h"
+#include "utility.h"
+#include <memory>
+
+//The two 32x32 tile maps ([0x9800; 0xA000)) drawn as 256x256 bitmaps of color
+//indices, once for each tile data addressing mode. A layer is rebuilt one map
+//row (8 lines) at a time, when the row is used after one of its map entries
+//or one of the tiles it was drawn with has changed.
+//
+//Each line is followed by a copy of its first 160 pixels (the width of the
+//LCD), so that a line of the background can be copied from any horizontal
+//scroll position in one go.
+class LayerCache{
+public:
+	static const unsigned size = 256;
+	static const unsigned stride = size + 160;
+	static const main_integer_t map_start = 0x9800;
+	static const main_integer_t map_end = 0xA000;
+private:
+	static const unsigned layer_count = 4;
+	const byte_t *maps;
+	TileCache *tiles;
+	std::unique_ptr<byte_t[]> pixels;
+	//One bit per map row.
+	std::uint32_t dirty[layer_count];
+	//For each tile, the map rows of each layer that were drawn with it.
+	std::uint32_t tile_users[TileCache::tile_count][layer_count];
+	std::uint64_t hits = 0;
+	std::uint64_t misses = 0;
+
+	void build_row(unsigned layer, unsigned row);
+public:
+	LayerCache(const byte_t *maps, TileCache &tiles);
+	//map_address is 0x9800 or 0x9C00. signed_tiles selects tile data
+	//addressing from 0x9000 (LCDC bit 4 clear).
+	static unsigned get_layer(main_integer_t map_address, bool signed_tiles){
+		return (map_address - map_start) / 0x400 * 2 + signed_tiles;
+	}
+	void invalidate_map(main_integer_t address){
+		auto layer = get_layer(address & ~0x3FF, false);
+		auto row = bit((address & 0x3FF) / 32);
+		this->dirty[layer] |= row;
+		this->dirty[layer + 1] |= row;
+	}
+	void invalidate_tile(main_integer_t address){
+		auto &users = this->tile_users[(address - TileCache::tile_data_start) >> 4];
+		for (unsigned i = 0; i < layer_count; i++){
+			this->dirty[i] |= users[i];
+			users[i] = 0;
+		}
+	}
+	const byte_t *get_line(unsigned layer, unsigned y){
+		auto row = y / 8;
+		if (this->dirty[layer] & bit(row)){
+			this->build_row(layer, row);
+			this->misses++;
+		}else
+			this->hits++;
+		return &this->pixels[(layer * size + y) * stride];
+	}
+	std::uint64_t get_hits() const{
+		return this->hits;
+	}
+	std::uint64_t get_misses() const{
+		return this->misses;
+	}
+	//Fraction of line lookups that didn't need a rebuild.
+	double get_hit_rate() const{
+		auto total = this->hits + this->misses;
+		return total ? (double)this->hits / total : 0;
+	}
+};
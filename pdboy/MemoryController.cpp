@@ -1,6 +1,7 @@
 #include "MemoryController.h"
 #include "GameboyCpu.h"
 #include "Gameboy.h"
+#include "BlockCache.h"
 #include "exceptions.h"
 #include <cstdlib>
 #include <exception>
@@ -45,6 +46,7 @@ MemoryController::MemoryController(Gameboy &system, GameboyCpu &cpu):
 		io_registers_load(new load_func_t[io_function_table_sizes]),
 		memory_map_store(new store_func_t[0x100]),
 		memory_map_load(new load_func_t[0x100]){
+	std::fill(this->read_pages, this->read_pages + 0x100, nullptr);
 #ifdef DEBUG_MEMORY_STORES
 	this->last_store_at.reset(new std::uint32_t[0x10000]);
 	this->last_store_at_clock.reset(new std::uint64_t[0x10000]);
@@ -122,6 +124,32 @@ void MemoryController::initialize_memory_map_functions(){
 	//[0xFF00; 0xFFFF]
 	this->memory_map_load[0xFF] = &MemoryController::read_io_registers_and_high_ram;
 	this->memory_map_store[0xFF] = &MemoryController::write_io_registers_and_high_ram;
+
+	this->set_ram_pages();
+	this->toggle_vram_access(this->vram_enabled);
+}
+
+void MemoryController::set_ram_pages(){
+	//Writes to work RAM must go through write_fixed_ram()/write_switchable_ram()
+	//so that the block cache sees them, so only reads are direct.
+	for (unsigned i = 0xC0; i < 0xD0; i++)
+		this->read_pages[i] = &this->fixed_ram.access(i << 8);
+	for (unsigned i = 0xD0; i < 0xE0; i++)
+		this->read_pages[i] = &this->switchable_ram.access((i << 8) + (this->selected_ram_bank << 12));
+	for (unsigned i = 0xE0; i < 0xFE; i++)
+		this->read_pages[i] = this->read_pages[i - 0x20];
+}
+
+void MemoryController::update_rom_pages(){
+	auto &cart = this->storage->get_cart();
+	auto fixed = cart.get_fixed_rom();
+	auto switchable = cart.get_switchable_rom();
+	for (unsigned i = 0; i < 0x40; i++)
+		this->read_pages[i] = fixed ? fixed + (i << 8) : nullptr;
+	for (unsigned i = 0; i < 0x40; i++)
+		this->read_pages[0x40 + i] = switchable ? switchable + (i << 8) : nullptr;
+	if (this->get_boostrap_enabled())
+		this->read_pages[0x00] = gb_bootstrap_rom;
 }
 
 void MemoryController::initialize_io_register_functions(){
@@ -264,6 +292,11 @@ byte_t MemoryController::read_storage(main_integer_t address) const{
 
 void MemoryController::write_storage(main_integer_t address, byte_t value){
 	this->storage->write8(address, value);
+	//Writes to [0x0000; 0x8000) are MBC commands, and may switch banks.
+	if (address < 0x8000){
+		this->cpu->get_block_cache().notify_mapping_change();
+		this->update_rom_pages();
+	}
 }
 
 byte_t MemoryController::read_storage_ram(main_integer_t address) const{
@@ -347,7 +380,7 @@ byte_t MemoryController::read_vram(main_integer_t address) const{
 void MemoryController::write_vram(main_integer_t address, byte_t value){
 	if (!this->vram_enabled)
 		return;
-	this->display->access_vram(address) = value;
+	this->display->write_vram(address, value);
 }
 
 byte_t MemoryController::read_fixed_ram(main_integer_t address) const{
@@ -356,6 +389,7 @@ byte_t MemoryController::read_fixed_ram(main_integer_t address) const{
 
 void MemoryController::write_fixed_ram(main_integer_t address, byte_t value){
 	this->fixed_ram.access(address) = value;
+	this->cpu->get_block_cache().notify_ram_write(address);
 }
 
 byte_t MemoryController::read_switchable_ram(main_integer_t address) const{
@@ -364,6 +398,7 @@ byte_t MemoryController::read_switchable_ram(main_integer_t address) const{
 
 void MemoryController::write_switchable_ram(main_integer_t address, byte_t value){
 	this->switchable_ram.access(address + (this->selected_ram_bank << 12)) = value;
+	this->cpu->get_block_cache().notify_ram_write(address);
 }
 
 byte_t MemoryController::read_oam(main_integer_t address) const{
@@ -381,7 +416,7 @@ void MemoryController::write_oam(main_integer_t address, byte_t value){
 	if (address >= 0xFEA0)
 		return;
 
-	this->display->access_oam(address) = value;
+	this->display->write_oam(address, value);
 }
 
 void MemoryController::write_disabled_oam(main_integer_t address, byte_t value){
@@ -420,6 +455,7 @@ byte_t MemoryController::load_bootstrap_rom_enable(main_integer_t) const{
 
 void MemoryController::store_high_ram(main_integer_t address, byte_t value){
 	this->high_ram.access(address) = value;
+	this->cpu->get_block_cache().notify_ram_write(address);
 }
 
 byte_t MemoryController::load_high_ram(main_integer_t address) const{
@@ -579,175 +615,175 @@ void MemoryController::store_TAC(main_integer_t, byte_t b){
 }
 
 byte_t MemoryController::load_NR10(main_integer_t) const{
-	return this->sound->square1.get_register0();
+	return this->sound->read_register([&](){ return this->sound->square1.get_register0(); });
 }
 
 void MemoryController::store_NR10(main_integer_t, byte_t b){
-	this->sound->square1.set_register0(b);
+	this->sound->write_register([&](){ this->sound->square1.set_register0(b); });
 }
 
 byte_t MemoryController::load_NR11(main_integer_t) const{
-	return this->sound->square1.get_register1();
+	return this->sound->read_register([&](){ return this->sound->square1.get_register1(); });
 }
 
 void MemoryController::store_NR11(main_integer_t, byte_t b){
-	this->sound->square1.set_register1(b);
+	this->sound->write_register([&](){ this->sound->square1.set_register1(b); });
 }
 
 byte_t MemoryController::load_NR12(main_integer_t) const{
-	return this->sound->square1.get_register2();
+	return this->sound->read_register([&](){ return this->sound->square1.get_register2(); });
 }
 
 void MemoryController::store_NR12(main_integer_t, byte_t b){
-	this->sound->square1.set_register2(b);
+	this->sound->write_register([&](){ this->sound->square1.set_register2(b); });
 }
 
 byte_t MemoryController::load_NR13(main_integer_t) const{
-	return this->sound->square1.get_register3();
+	return this->sound->read_register([&](){ return this->sound->square1.get_register3(); });
 }
 
 void MemoryController::store_NR13(main_integer_t, byte_t b){
-	this->sound->square1.set_register3(b);
+	this->sound->write_register([&](){ this->sound->square1.set_register3(b); });
 }
 
 byte_t MemoryController::load_NR14(main_integer_t) const{
-	return this->sound->square1.get_register4();
+	return this->sound->read_register([&](){ return this->sound->square1.get_register4(); });
 }
 
 void MemoryController::store_NR14(main_integer_t, byte_t b){
-	this->sound->square1.set_register4(b);
+	this->sound->write_register([&](){ this->sound->square1.set_register4(b); });
 }
 
 byte_t MemoryController::load_NR21(main_integer_t) const{
-	return this->sound->square2.get_register1();
+	return this->sound->read_register([&](){ return this->sound->square2.get_register1(); });
 }
 
 void MemoryController::store_NR21(main_integer_t, byte_t b){
-	this->sound->square2.set_register1(b);
+	this->sound->write_register([&](){ this->sound->square2.set_register1(b); });
 }
 
 byte_t MemoryController::load_NR22(main_integer_t) const{
-	return this->sound->square2.get_register2();
+	return this->sound->read_register([&](){ return this->sound->square2.get_register2(); });
 }
 
 void MemoryController::store_NR22(main_integer_t, byte_t b){
-	this->sound->square2.set_register2(b);
+	this->sound->write_register([&](){ this->sound->square2.set_register2(b); });
 }
 
 byte_t MemoryController::load_NR23(main_integer_t) const{
-	return this->sound->square2.get_register3();
+	return this->sound->read_register([&](){ return this->sound->square2.get_register3(); });
 }
 
 void MemoryController::store_NR23(main_integer_t, byte_t b){
-	this->sound->square2.set_register3(b);
+	this->sound->write_register([&](){ this->sound->square2.set_register3(b); });
 }
 
 byte_t MemoryController::load_NR24(main_integer_t) const{
-	return this->sound->square2.get_register4();
+	return this->sound->read_register([&](){ return this->sound->square2.get_register4(); });
 }
 
 void MemoryController::store_NR24(main_integer_t, byte_t b){
-	this->sound->square2.set_register4(b);
+	this->sound->write_register([&](){ this->sound->square2.set_register4(b); });
 }
 
 
 
 byte_t MemoryController::load_NR30(main_integer_t) const{
-	return this->sound->wave.get_register0();
+	return this->sound->read_register([&](){ return this->sound->wave.get_register0(); });
 }
 
 void MemoryController::store_NR30(main_integer_t, byte_t b){
-	this->sound->wave.set_register0(b);
+	this->sound->write_register([&](){ this->sound->wave.set_register0(b); });
 }
 
 byte_t MemoryController::load_NR31(main_integer_t) const{
-	return this->sound->wave.get_register1();
+	return this->sound->read_register([&](){ return this->sound->wave.get_register1(); });
 }
 
 void MemoryController::store_NR31(main_integer_t, byte_t b){
-	this->sound->wave.set_register1(b);
+	this->sound->write_register([&](){ this->sound->wave.set_register1(b); });
 }
 
 byte_t MemoryController::load_NR32(main_integer_t) const{
-	return this->sound->wave.get_register2();
+	return this->sound->read_register([&](){ return this->sound->wave.get_register2(); });
 }
 
 void MemoryController::store_NR32(main_integer_t, byte_t b){
-	this->sound->wave.set_register2(b);
+	this->sound->write_register([&](){ this->sound->wave.set_register2(b); });
 }
 
 byte_t MemoryController::load_NR33(main_integer_t) const{
-	return this->sound->wave.get_register3();
+	return this->sound->read_register([&](){ return this->sound->wave.get_register3(); });
 }
 
 void MemoryController::store_NR33(main_integer_t, byte_t b){
-	this->sound->wave.set_register3(b);
+	this->sound->write_register([&](){ this->sound->wave.set_register3(b); });
 }
 
 byte_t MemoryController::load_NR34(main_integer_t) const{
-	return this->sound->wave.get_register4();
+	return this->sound->read_register([&](){ return this->sound->wave.get_register4(); });
 }
 
 void MemoryController::store_NR34(main_integer_t, byte_t b){
-	this->sound->wave.set_register4(b);
+	this->sound->write_register([&](){ this->sound->wave.set_register4(b); });
 }
 
 
 
 byte_t MemoryController::load_NR41(main_integer_t) const{
-	return this->sound->noise.get_register1();
+	return this->sound->read_register([&](){ return this->sound->noise.get_register1(); });
 }
 
 void MemoryController::store_NR41(main_integer_t, byte_t b){
-	this->sound->noise.set_register1(b);
+	this->sound->write_register([&](){ this->sound->noise.set_register1(b); });
 }
 
 byte_t MemoryController::load_NR42(main_integer_t) const{
-	return this->sound->noise.get_register2();
+	return this->sound->read_register([&](){ return this->sound->noise.get_register2(); });
 }
 
 void MemoryController::store_NR42(main_integer_t, byte_t b){
-	this->sound->noise.set_register2(b);
+	this->sound->write_register([&](){ this->sound->noise.set_register2(b); });
 }
 
 byte_t MemoryController::load_NR43(main_integer_t) const{
-	return this->sound->noise.get_register3();
+	return this->sound->read_register([&](){ return this->sound->noise.get_register3(); });
 }
 
 void MemoryController::store_NR43(main_integer_t, byte_t b){
-	this->sound->noise.set_register3(b);
+	this->sound->write_register([&](){ this->sound->noise.set_register3(b); });
 }
 
 byte_t MemoryController::load_NR44(main_integer_t) const{
-	return this->sound->noise.get_register4();
+	return this->sound->read_register([&](){ return this->sound->noise.get_register4(); });
 }
 
 void MemoryController::store_NR44(main_integer_t, byte_t b){
-	this->sound->noise.set_register4(b);
+	this->sound->write_register([&](){ this->sound->noise.set_register4(b); });
 }
 
 byte_t MemoryController::load_NR50(main_integer_t) const{
-	return this->sound->get_NR50();
+	return this->sound->read_register([&](){ return this->sound->get_NR50(); });
 }
 
 void MemoryController::store_NR50(main_integer_t, byte_t b){
-	this->sound->set_NR50(b);
+	this->sound->write_register([&](){ this->sound->set_NR50(b); });
 }
 
 byte_t MemoryController::load_NR51(main_integer_t) const{
-	return this->sound->get_NR51();
+	return this->sound->read_register([&](){ return this->sound->get_NR51(); });
 }
 
 void MemoryController::store_NR51(main_integer_t, byte_t b){
-	this->sound->set_NR51(b);
+	this->sound->write_register([&](){ this->sound->set_NR51(b); });
 }
 
 byte_t MemoryController::load_NR52(main_integer_t) const{
-	return this->sound->get_NR52();
+	return this->sound->read_register([&](){ return this->sound->get_NR52(); });
 }
 
 void MemoryController::store_NR52(main_integer_t, byte_t b){
-	this->sound->set_NR52(b);
+	this->sound->write_register([&](){ this->sound->set_NR52(b); });
 }
 
 byte_t MemoryController::load_WAVE(main_integer_t) const{
@@ -755,11 +791,10 @@ byte_t MemoryController::load_WAVE(main_integer_t) const{
 }
 
 void MemoryController::store_WAVE(main_integer_t address, byte_t b){
-	this->sound->wave.set_wave_table((unsigned)address - 0xFF30, b);
+	this->sound->write_register([&](){ this->sound->wave.set_wave_table((unsigned)address - 0xFF30, b); });
 }
 
-main_integer_t MemoryController::load8(main_integer_t address) const{
-	address &= 0xFFFF;
+main_integer_t MemoryController::load8_slow(main_integer_t address) const{
 	auto fp = this->memory_map_load[address >> 8];
 	return (this->*fp)(address);
 }
@@ -818,10 +853,16 @@ void MemoryController::copy_memory_force(main_integer_t src, main_integer_t dst,
 }
 
 void MemoryController::toggle_boostrap_rom(bool on){
-	if (on)
+	if (on){
 		this->memory_map_load[0x00] = &MemoryController::read_dmg_bootstrap;
-	else
+		this->read_pages[0x00] = gb_bootstrap_rom;
+	}else{
 		this->memory_map_load[0x00] = &MemoryController::read_storage;
+		this->read_pages[0x00] = nullptr;
+		if (this->storage->has_cart())
+			this->update_rom_pages();
+	}
+	this->cpu->get_block_cache().set_bootstrap_mapped(on);
 }
 
 bool MemoryController::get_boostrap_enabled() const{
@@ -853,6 +894,10 @@ bool MemoryController::get_palette_access_enabled() const{
 
 void MemoryController::toggle_vram_access(bool enable){
 	this->vram_enabled = enable;
+	//Writes always go through write_vram(), so that the tile and layer caches
+	//see them.
+	for (unsigned i = 0x80; i < 0xA0; i++)
+		this->read_pages[i] = enable ? &this->display->access_vram(i << 8) : nullptr;
 }
 
 void MemoryController::toggle_palette_access(bool enable){
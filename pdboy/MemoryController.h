@@ -58,6 +58,11 @@ class MemoryController{
 	std::unique_ptr<load_func_t[]> io_registers_load;
 	std::unique_ptr<store_func_t[]> memory_map_store;
 	std::unique_ptr<load_func_t[]> memory_map_load;
+	//Host memory backing each 256-byte page, for pages whose reads need no
+	//special handling. nullptr means the read goes through memory_map_load.
+	//Writes always go through memory_map_store, since work RAM writes must
+	//reach the block cache and VRAM writes the tile and layer caches.
+	const byte_t *read_pages[0x100];
 
 	unsigned selected_ram_bank = 0;
 	bool vram_enabled = true;
@@ -71,6 +76,8 @@ class MemoryController{
 	void initialize_functions();
 	void initialize_memory_map_functions();
 	void initialize_io_register_functions();
+	void set_ram_pages();
+	main_integer_t load8_slow(main_integer_t address) const;
 	void store_nothing(main_integer_t, byte_t);
 	byte_t load_nothing(main_integer_t) const;
 	void store_not_implemented(main_integer_t, byte_t);
@@ -155,7 +162,17 @@ public:
 	MemoryController(Gameboy &, GameboyCpu &);
 	~MemoryController();
 	void initialize();
-	main_integer_t load8(main_integer_t address) const;
+	main_integer_t load8(main_integer_t address) const{
+		address &= 0xFFFF;
+		auto page = this->read_pages[address >> 8];
+		if (page)
+			return page[address & 0xFF];
+		return this->load8_slow(address);
+	}
+	//For compiled code, which inlines the fast path of load8().
+	const byte_t * const *get_read_pages() const{
+		return this->read_pages;
+	}
 	main_integer_t load8_io(main_integer_t address) const;
 	void store8(main_integer_t address, main_integer_t value);
 	void store8_io(main_integer_t offset, main_integer_t value);
@@ -171,6 +188,8 @@ public:
 	void toggle_oam_access(bool);
 	void toggle_vram_access(bool);
 	void toggle_palette_access(bool);
+	//Must be called whenever the cartridge or its ROM bank mapping changes.
+	void update_rom_pages();
 #ifdef IO_REGISTERS_RECORDING
 	void use_recording(const char *path, bool record);
 #endif
@@ -4,64 +4,125 @@
 #include <mutex>
 #include <atomic>
 #include <iostream>
+#include <thread>
+#include <cstdint>
 #include "queue/readerwriterqueue.h"
 
-template <typename T>
+//Hands resources from a producer thread to a consumer thread, newest first.
+//The N resources are allocated up front and passed around by index through
+//atomics, so no call allocates or locks. With the default of four, the
+//producer always has one to draw into, even while one is published and one
+//is held by the consumer. The consumer must not hold more than N - 2 at once.
+template <typename T, unsigned N = 4>
 class PublishingResource{
-	std::vector<std::unique_ptr<T>> allocated;
-	std::vector<T *> ready;
-	std::mutex ready_mutex;
+	static_assert(N >= 3 && N < 32, "PublishingResource needs between 3 and 31 resources.");
+	static const unsigned index_mask = 0xFF;
+	static const unsigned none = index_mask;
+	//Set on the public resource if the consumer returned it to be shown again.
+	static const unsigned repeated = 0x100;
+	//Set on none if the producer took back the public resource before the
+	//consumer saw it. Keeping this in the same word as the index means the
+	//consumer can never mark a newer resource as taken by mistake.
+	static const unsigned reclaimed = 0x200;
+	std::unique_ptr<T[]> resources;
 	//Invariant: private_resource is valid at all times.
-	T *private_resource;
-	std::atomic<T *> public_resource;
+	unsigned private_resource;
+	std::atomic<unsigned> public_resource;
+	//One bit per resource that nobody holds.
+	std::atomic<std::uint32_t> free_resources;
+	std::atomic<std::uint64_t> dropped;
+	std::atomic<std::uint64_t> duplicated;
 
-	T *reuse_or_allocate(){
-		{
-			std::lock_guard<std::mutex> lg(this->ready_mutex);
-			if (this->ready.size()){
-				auto ret = this->ready.back();
-				this->ready.pop_back();
-				return ret;
+	unsigned index_of(const T *r) const{
+		return (unsigned)(r - this->resources.get());
+	}
+	void release(unsigned index){
+		this->free_resources.fetch_or(1U << index);
+	}
+	bool try_acquire(unsigned &dst){
+		auto mask = this->free_resources.load();
+		while (mask){
+			unsigned index = 0;
+			while (!(mask & (1U << index)))
+				index++;
+			if (this->free_resources.compare_exchange_weak(mask, mask & ~(1U << index))){
+				dst = index;
+				return true;
 			}
 		}
-		return this->allocate();
-	}
-	T *allocate(){
-		this->allocated.push_back(std::make_unique<T>());
-		return this->allocated.back().get();
+		return false;
 	}
 public:
-	PublishingResource(){
-		this->private_resource = this->allocate();
-		this->public_resource = nullptr;
+	PublishingResource(): resources(new T[N]){
+		this->private_resource = 0;
+		this->public_resource = none;
+		this->free_resources = ((1U << N) - 1) & ~1U;
+		this->dropped = 0;
+		this->duplicated = 0;
 	}
 	void publish(){
-		this->private_resource = (T *)std::atomic_exchange(&this->public_resource, this->private_resource);
-		if (!this->private_resource)
-			this->private_resource = this->reuse_or_allocate();
+		auto old = this->public_resource.exchange(this->private_resource);
+		if ((old & index_mask) != none){
+			if (!(old & repeated))
+				this->dropped++;
+			this->release(old & ~repeated);
+		}
+		while (!this->try_acquire(this->private_resource)){
+			//The consumer is holding too many. Take back the public resource,
+			//unless the consumer has taken that too.
+			old = this->public_resource.exchange(none | reclaimed);
+			if ((old & index_mask) != none){
+				if (!(old & repeated))
+					this->dropped++;
+				this->private_resource = old & ~repeated;
+				return;
+			}
+			std::this_thread::yield();
+		}
 	}
 	T *get_private_resource(){
-		return this->private_resource;
+		return &this->resources[this->private_resource];
 	}
 	T *get_public_resource(){
-		return (T *)std::atomic_exchange(&this->public_resource, (T *)nullptr);
+		auto index = this->public_resource.load();
+		do{
+			if ((index & index_mask) == none)
+				return nullptr;
+		}while (!this->public_resource.compare_exchange_weak(index, none));
+		if (index & repeated)
+			this->duplicated++;
+		return &this->resources[index & ~repeated];
+	}
+	//Returns true if the last resource published has been taken at least once.
+	bool last_published_taken() const{
+		auto index = this->public_resource.load();
+		if ((index & index_mask) == none)
+			return !(index & reclaimed);
+		return !!(index & repeated);
 	}
 	void return_resource_as_ready(T *r){
-		std::lock_guard<std::mutex> lg(this->ready_mutex);
-		this->ready.push_back(r);
+		this->release(this->index_of(r));
 	}
+	//Publishes r again, unless something newer has been published.
 	void return_resource_as_private(T *r){
-		T *null_T = nullptr;
-		if (std::atomic_compare_exchange_strong(&this->public_resource, &null_T, r))
-			return;
+		auto expected = this->public_resource.load();
+		while ((expected & index_mask) == none)
+			if (this->public_resource.compare_exchange_weak(expected, this->index_of(r) | repeated))
+				return;
 		this->return_resource_as_ready(r);
 	}
 	void clear_public_resource(){
-		auto frame = (T *)std::atomic_exchange(&this->public_resource, (T *)nullptr);
-		if (frame){
-			std::lock_guard<std::mutex> lg(this->ready_mutex);
-			this->ready.push_back(frame);
-		}
+		auto index = this->public_resource.exchange(none);
+		if ((index & index_mask) != none)
+			this->release(index & ~repeated);
+	}
+	//Resources published and replaced before the consumer took them.
+	std::uint64_t get_dropped() const{
+		return this->dropped;
+	}
+	//Resources the consumer took again because nothing newer was published.
+	std::uint64_t get_duplicated() const{
+		return this->duplicated;
 	}
 };
 
@@ -1,5 +1,10 @@
 #pragma once
 #include "CommonTypes.h"
+//Gets only the options the CPU code was generated with (see
+//InterpreterCodeGenerator::dump_declarations()).
+#define GENERATED_CONFIGURATION
+#include "../generated_files/cpu.generated.h"
+#undef GENERATED_CONFIGURATION
 
 #define REGISTERS_IN_STRUCT
 
@@ -77,6 +82,28 @@ class RegisterStore{
 		std::uint16_t sp;
 		std::uint16_t pc;
 	} data;
+#ifdef GENERATED_LAZY_FLAGS
+	//Lazily evaluated flags (see set_lazy_flags()). While flags_unpacked is
+	//set, the value of F in data is stale, and each flag is instead set iff
+	//its entry in flag_values (ordered Z, N, H, C) is non-zero.
+	bool flags_unpacked = false;
+	main_integer_t flag_values[4];
+
+	static unsigned flag_index(Flags flag){
+		return (unsigned)Flags::Zero - (unsigned)flag;
+	}
+	byte_t packed_flags() const{
+		return (byte_t)(
+			(!!this->flag_values[0] << (unsigned)Flags::Zero) |
+			(!!this->flag_values[1] << (unsigned)Flags::Subtract) |
+			(!!this->flag_values[2] << (unsigned)Flags::HalfCarry) |
+			(!!this->flag_values[3] << (unsigned)Flags::Carry)
+		);
+	}
+	byte_t current_f() const{
+		return this->flags_unpacked ? this->packed_flags() : this->data.af.u8.f;
+	}
+#endif
 
 #ifdef DEBUG_REGISTERS
 	void set_last_set(std::uint32_t &, std::uint64_t &);
@@ -84,6 +111,10 @@ class RegisterStore{
 public:
 	RegisterStore(GameboyCpu &cpu);
 	bool get(Flags flag) const{
+#ifdef GENERATED_LAZY_FLAGS
+		if (this->flags_unpacked)
+			return !!this->flag_values[flag_index(flag)];
+#endif
 		return !!(this->f() & ((main_integer_t)1 << (main_integer_t)flag));
 	}
 	void set(Flags flag, bool value){
@@ -97,6 +128,42 @@ public:
 	void set_flags(bool zero, bool subtract, bool half_carry, bool carry);
 	void set_flags(main_integer_t mode_mask, main_integer_t value_mask);
 
+#ifdef GENERATED_LAZY_FLAGS
+	//Used by code generated with --lazy-flags. Instead of computing F, flag
+	//producing instructions store the values each flag is derived from, and F
+	//is only assembled when something reads it as a whole.
+	void set_lazy_flags(main_integer_t zero, main_integer_t subtract, main_integer_t half_carry, main_integer_t carry){
+		this->flag_values[0] = zero;
+		this->flag_values[1] = subtract;
+		this->flag_values[2] = half_carry;
+		this->flag_values[3] = carry;
+		this->flags_unpacked = true;
+	}
+	//For instructions that leave some flags unchanged, which must call
+	//unpack_flags() first.
+	void set_lazy_flag(Flags flag, main_integer_t value){
+		this->flag_values[flag_index(flag)] = value;
+	}
+	void flip_lazy_flag(Flags flag){
+		auto &value = this->flag_values[flag_index(flag)];
+		value = !value;
+	}
+	void unpack_flags(){
+		if (this->flags_unpacked)
+			return;
+		auto f = this->data.af.u8.f;
+		for (unsigned i = 0; i < 4; i++)
+			this->flag_values[i] = f & (0x80 >> i);
+		this->flags_unpacked = true;
+	}
+	void pack_flags(){
+		if (!this->flags_unpacked)
+			return;
+		this->data.af.u8.f = this->packed_flags();
+		this->flags_unpacked = false;
+	}
+#endif
+
 #define DEFINE_REG8_ACCESSORS(xy, x) \
 	DECLARE_LAST_SET(x); \
 	byte_t &x(){ \
@@ -129,7 +196,9 @@ public:
 	}
 
 	DEFINE_REG8_ACCESSORS(af, a);
+#ifndef GENERATED_LAZY_FLAGS
 	DEFINE_REG8_ACCESSORS(af, f);
+#endif
 	DEFINE_REG8_ACCESSORS(bc, b);
 	DEFINE_REG8_ACCESSORS(bc, c);
 	DEFINE_REG8_ACCESSORS(de, d);
@@ -137,11 +206,48 @@ public:
 	DEFINE_REG8_ACCESSORS(hl, h);
 	DEFINE_REG8_ACCESSORS(hl, l);
 
+#ifndef GENERATED_LAZY_FLAGS
 	DEFINE_REG16_ACCESSORS(af);
+#endif
 	DEFINE_REG16_ACCESSORS(bc);
 	DEFINE_REG16_ACCESSORS(de);
 	DEFINE_REG16_ACCESSORS(hl);
 
+#ifdef GENERATED_LAZY_FLAGS
+	//F and AF can't be handed out by reference while the flags are unpacked.
+	DECLARE_LAST_SET(f);
+	byte_t &f(){
+		this->pack_flags();
+		return this->data.af.u8.f;
+	}
+	byte_t f() const{
+		return this->current_f();
+	}
+	byte_t get_f() const{
+		return this->current_f();
+	}
+	byte_t &set_f(){
+		SET_LAST_SET(f);
+		return this->f();
+	}
+
+	DECLARE_LAST_SET(af);
+	std::uint16_t &af(){
+		this->pack_flags();
+		return this->data.af.af;
+	}
+	std::uint16_t af() const{
+		return (std::uint16_t)(this->data.af.af & 0xFF00) | this->current_f();
+	}
+	std::uint16_t get_af() const{
+		return this->af();
+	}
+	std::uint16_t &set_af(){
+		SET_LAST_SET(af);
+		return this->af();
+	}
+#endif
+
 	std::uint16_t &sp(){
 		return this->data.sp;
 	}
@@ -0,0 +1,62 @@
+#include "RenderThread.h"
+#include <cstring>
+
+RenderThread::RenderThread(const byte_t *vram, const byte_t *oam, PublishingResource<RenderedFrame> &frames):
+		frames(&frames),
+		//Enough for a batch of lines and an OAM DMA. It grows if needed.
+		queue(512){
+	memcpy(this->vram, vram, sizeof(this->vram));
+	memcpy(this->oam, oam, sizeof(this->oam));
+	this->renderer.reset(new ScanlineRenderer(this->vram, this->oam));
+	this->thread.reset(new std::thread([this](){ this->thread_function(); }));
+}
+
+RenderThread::~RenderThread(){
+	this->push(CommandType::Stop);
+	this->work_available.signal();
+	join_thread(this->thread);
+}
+
+void RenderThread::flush(){
+	Event event;
+	Command command;
+	command.type = CommandType::Flush;
+	command.event = &event;
+	this->queue.enqueue(command);
+	this->work_available.signal();
+	event.wait();
+}
+
+void RenderThread::thread_function(){
+	Command command;
+	while (true){
+		if (!this->queue.try_dequeue(command)){
+			this->work_available.wait();
+			continue;
+		}
+		switch (command.type){
+			case CommandType::WriteVram:
+				this->vram[command.address - 0x8000] = command.value;
+				this->renderer->notify_vram_write(command.address);
+				break;
+			case CommandType::WriteOam:
+				this->oam[command.address - 0xFE00] = command.value;
+				this->renderer->notify_oam_write();
+				break;
+			case CommandType::RenderLines:
+				this->renderer->render(*this->frames->get_private_resource(), command.address, command.count, command.state);
+				break;
+			case CommandType::Publish:
+				this->frames->publish();
+				break;
+			case CommandType::Clear:
+				this->frames->clear_public_resource();
+				break;
+			case CommandType::Flush:
+				command.event->signal();
+				break;
+			case CommandType::Stop:
+				return;
+		}
+	}
+}
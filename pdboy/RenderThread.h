@@ -0,0 +1,90 @@
+#pragma once
+#include "ScanlineRenderer.h"
+#include "PublishingResource.h"
+#include "threads.h"
+#include "queue/readerwriterqueue.h"
+#include <memory>
+#include <thread>
+
+//Renders lines on a thread of its own. The DisplayController queues the
+//register values of each line, along with every write to VRAM and OAM; the
+//thread applies them in order to its own copies of the memories, so a line is
+//always drawn with the memory contents it would have been drawn with inline.
+//Frames are published through the controller's PublishingResource, which the
+//controller must not touch while the thread runs.
+//
+//The queue is lock-free. To keep context switches down, the thread is only
+//woken up every few lines and when a frame is complete.
+class RenderThread{
+	enum class CommandType{
+		WriteVram,
+		WriteOam,
+		RenderLines,
+		Publish,
+		Clear,
+		Flush,
+		Stop,
+	};
+	static const unsigned lines_per_wakeup = 16;
+	struct Command{
+		CommandType type;
+		//Address for writes, first line for RenderLines.
+		main_integer_t address;
+		byte_t value;
+		unsigned count;
+		ScanlineState state;
+		Event *event;
+	};
+
+	byte_t vram[0x2000];
+	byte_t oam[0xA0];
+	std::unique_ptr<ScanlineRenderer> renderer;
+	PublishingResource<RenderedFrame> *frames;
+	moodycamel::ReaderWriterQueue<Command> queue;
+	Event work_available;
+	std::unique_ptr<std::thread> thread;
+
+	void push(CommandType type, main_integer_t address = 0, byte_t value = 0){
+		Command command;
+		command.type = type;
+		command.address = address;
+		command.value = value;
+		this->queue.enqueue(command);
+	}
+	void thread_function();
+public:
+	//vram and oam are the current contents of the memories, from 0x8000 and
+	//0xFE00.
+	RenderThread(const byte_t *vram, const byte_t *oam, PublishingResource<RenderedFrame> &frames);
+	~RenderThread();
+	void write_vram(main_integer_t address, byte_t value){
+		this->push(CommandType::WriteVram, address, value);
+	}
+	void write_oam(main_integer_t address, byte_t value){
+		this->push(CommandType::WriteOam, address, value);
+	}
+	void render(unsigned first, unsigned count, const ScanlineState &state){
+		Command command;
+		command.type = CommandType::RenderLines;
+		command.address = first;
+		command.count = count;
+		command.state = state;
+		this->queue.enqueue(command);
+		if (first % lines_per_wakeup + count >= lines_per_wakeup)
+			this->work_available.signal();
+	}
+	void publish(){
+		this->push(CommandType::Publish);
+		this->work_available.signal();
+	}
+	void clear(){
+		this->push(CommandType::Clear);
+		this->work_available.signal();
+	}
+	//Waits until every command queued so far has been carried out.
+	void flush();
+	//Only valid after flush().
+	const ScanlineRenderer &get_renderer() const{
+		return *this->renderer;
+	}
+};
@@ -0,0 +1,88 @@
+#include "ScanlineCompositor.h"
+#include <algorithm>
+
+#if defined _M_X64 || defined _M_IX86 || defined __x86_64__ || defined __i386__
+#define USE_SSSE3_COMPOSITOR
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSSE3
+#else
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
+typedef void (*compose_function)(RGB *, const byte_t *, const byte_t *, const RGB *);
+
+static void compose_scalar(RGB *dst, const byte_t *bg, const byte_t *obj, const RGB *palette){
+	for (unsigned x = 0; x != lcd_width; x++)
+		dst[x] = palette[std::max(bg[x], obj[x])];
+}
+
+#ifdef USE_SSSE3_COMPOSITOR
+
+static_assert(lcd_width % 16 == 0, "compose_ssse3() works on 16 pixels at a time.");
+
+//The palette is split into one 16-byte table per channel, so that PSHUFB can
+//look up a channel for 16 pixels at once. The four channels are then
+//interleaved back into RGB values.
+TARGET_SSSE3
+static void compose_ssse3(RGB *dst, const byte_t *bg, const byte_t *obj, const RGB *palette){
+	alignas(16) byte_t channels[4][16];
+	for (unsigned i = 0; i < 16; i++){
+		channels[0][i] = palette[i].r;
+		channels[1][i] = palette[i].g;
+		channels[2][i] = palette[i].b;
+		channels[3][i] = palette[i].a;
+	}
+	auto r = _mm_load_si128((const __m128i *)channels[0]);
+	auto g = _mm_load_si128((const __m128i *)channels[1]);
+	auto b = _mm_load_si128((const __m128i *)channels[2]);
+	auto a = _mm_load_si128((const __m128i *)channels[3]);
+
+	for (unsigned x = 0; x != lcd_width; x += 16){
+		auto slots = _mm_max_epu8(
+			_mm_loadu_si128((const __m128i *)(bg + x)),
+			_mm_loadu_si128((const __m128i *)(obj + x))
+		);
+		auto pixel_r = _mm_shuffle_epi8(r, slots);
+		auto pixel_g = _mm_shuffle_epi8(g, slots);
+		auto pixel_b = _mm_shuffle_epi8(b, slots);
+		auto pixel_a = _mm_shuffle_epi8(a, slots);
+		auto rg_low = _mm_unpacklo_epi8(pixel_r, pixel_g);
+		auto rg_high = _mm_unpackhi_epi8(pixel_r, pixel_g);
+		auto ba_low = _mm_unpacklo_epi8(pixel_b, pixel_a);
+		auto ba_high = _mm_unpackhi_epi8(pixel_b, pixel_a);
+		auto out = (__m128i *)(dst + x);
+		_mm_storeu_si128(out + 0, _mm_unpacklo_epi16(rg_low, ba_low));
+		_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(rg_low, ba_low));
+		_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(rg_high, ba_high));
+		_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(rg_high, ba_high));
+	}
+}
+
+static bool cpu_has_ssse3(){
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return !!(info[2] & (1 << 9));
+#else
+	__builtin_cpu_init();
+	return !!__builtin_cpu_supports("ssse3");
+#endif
+}
+
+#endif
+
+static compose_function select_compositor(){
+#ifdef USE_SSSE3_COMPOSITOR
+	if (cpu_has_ssse3())
+		return compose_ssse3;
+#endif
+	return compose_scalar;
+}
+
+void compose_scanline(RGB *dst, const byte_t *bg, const byte_t *obj, const RGB *palette){
+	static const compose_function function = select_compositor();
+	function(dst, bg, obj, palette);
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "DisplayController.h"
+
+//Layout of the 16-color palette passed to compose_scanline().
+const byte_t palette_slot_bg = 0;
+const byte_t palette_slot_blank = 4;
+const byte_t palette_slot_obj0 = 8;
+const byte_t palette_slot_obj1 = 12;
+
+//Writes dst[x] = palette[max(bg[x], obj[x])] for a whole line. bg holds
+//palette_slot_bg + color, or palette_slot_blank where neither the background
+//nor the window is drawn; obj holds a sprite's slot + color, or 0. Uses SSSE3
+//when the CPU supports it.
+void compose_scanline(RGB *dst, const byte_t *bg, const byte_t *obj, const RGB *palette);
@@ -0,0 +1,214 @@
+#include "ScanlineRenderer.h"
+#include "ScanlineCompositor.h"
+#include <algorithm>
+#include <cstring>
+
+struct SpriteDescription{
+	byte_t y, x, tile_no, attributes;
+	int get_y() const{
+		return (int)this->y - 16U;
+	}
+	int get_x() const{
+		return (int)this->x - 8U;
+	}
+	int palette_number() const{
+		return !!(this->attributes & bit(4));
+	}
+	bool has_priority() const{
+		return !(this->attributes & bit(7));
+	}
+	bool flipped_x() const{
+		return !!(this->attributes & bit(5));
+	}
+	bool flipped_y() const{
+		return !!(this->attributes & bit(6));
+	}
+};
+
+struct FullSprite{
+	int sprite_number;
+	SpriteDescription sprite_description;
+	bool cgb_sprite_order;
+	//Returns true if *this has less priority than other.
+	bool operator<(const FullSprite &other) const{
+		if (this->cgb_sprite_order)
+			return this->sprite_number > other.sprite_number;
+
+		if (this->sprite_description.x > other.sprite_description.x)
+			return true;
+		if (this->sprite_description.x < other.sprite_description.x)
+			return false;
+		return this->sprite_number > other.sprite_number;
+	}
+};
+
+template <bool BG>
+static void set_palette_array(RGB dst[4], byte_t palette){
+	for (unsigned i = 4; i--;){
+		auto index = (palette >> (i * 2)) & 3;
+		byte_t c = ~(byte_t)(index * 0xFF / 3);
+		dst[i] = { c, c, c, 0xFF };
+	}
+	if (!BG)
+		dst[0] = { 0, 0, 0, 0 };
+}
+
+ScanlineRenderer::ScanlineRenderer(const byte_t *vram, const byte_t *oam):
+		oam(oam),
+		tile_cache(vram + (TileCache::tile_data_start - 0x8000)),
+		layer_cache(vram + (LayerCache::map_start - 0x8000), tile_cache){
+	std::fill(this->palette_values, this->palette_values + 3, 0);
+	set_palette_array<true>(this->palette + palette_slot_bg, 0);
+	std::fill(this->palette + palette_slot_blank, this->palette + palette_slot_obj0, RGB{ 0xFF, 0xFF, 0xFF, 0xFF });
+	set_palette_array<false>(this->palette + palette_slot_obj0, 0);
+	set_palette_array<false>(this->palette + palette_slot_obj1, 0);
+}
+
+void ScanlineRenderer::update_palettes(const ScanlineState &state){
+	if (state.bg_palette != this->palette_values[0]){
+		set_palette_array<true>(this->palette + palette_slot_bg, state.bg_palette);
+		this->palette_values[0] = state.bg_palette;
+	}
+	if (state.obj0_palette != this->palette_values[1]){
+		set_palette_array<false>(this->palette + palette_slot_obj0, state.obj0_palette);
+		this->palette_values[1] = state.obj0_palette;
+	}
+	if (state.obj1_palette != this->palette_values[2]){
+		set_palette_array<false>(this->palette + palette_slot_obj1, state.obj1_palette);
+		this->palette_values[2] = state.obj1_palette;
+	}
+}
+
+void ScanlineRenderer::rebuild_sprite_bins(bool tall_sprites, bool cgb_sprite_order){
+	int sprite_height = tall_sprites ? 16 : 8;
+	const unsigned sprite_count = 40;
+	FullSprite sprites[sprite_count];
+	for (unsigned i = 0; i < sprite_count; i++){
+		sprites[i].sprite_number = i;
+		sprites[i].sprite_description = *(const SpriteDescription *)(this->oam + i * 4);
+		sprites[i].cgb_sprite_order = cgb_sprite_order;
+	}
+	std::sort(sprites, sprites + sprite_count);
+
+	for (auto &bin : this->sprite_bins)
+		bin.count = 0;
+	//Going from the highest priority down, each line keeps the first
+	//max_sprites_per_line sprites that cover it.
+	for (unsigned i = sprite_count; i--;){
+		auto spry = sprites[i].sprite_description.get_y();
+		auto first = std::max(spry, 0);
+		auto last = std::min(spry + sprite_height, (int)lcd_height);
+		for (int y = first; y < last; y++){
+			auto &bin = this->sprite_bins[y];
+			if (bin.count < max_sprites_per_line)
+				bin.sprites[bin.count++] = (byte_t)sprites[i].sprite_number;
+		}
+	}
+
+	this->sprite_bins_dirty = false;
+	this->sprite_bins_tall = tall_sprites;
+	this->sprite_bins_cgb = cgb_sprite_order;
+	this->sprite_bin_rebuilds++;
+}
+
+static_assert(LayerCache::stride - LayerCache::size >= lcd_width, "LayerCache lines must wrap around for a whole LCD line.");
+
+void ScanlineRenderer::render(RenderedFrame &frame, unsigned first, unsigned count, const ScanlineState &state){
+	if (state.sprites_enabled && (this->sprite_bins_dirty || this->sprite_bins_tall != state.tall_sprites || this->sprite_bins_cgb != state.cgb_sprite_order))
+		this->rebuild_sprite_bins(state.tall_sprites, state.cgb_sprite_order);
+	this->update_palettes(state);
+	for (unsigned y = first; y < first + count; y++)
+		this->render_line(frame, y, state);
+}
+
+void ScanlineRenderer::render_line(RenderedFrame &frame, unsigned y, const ScanlineState &state){
+	const unsigned pitch = lcd_width;
+	const int sprite_width = 8;
+	auto bg_layer = LayerCache::get_layer(state.bg_map, state.signed_tiles);
+	auto window_layer = LayerCache::get_layer(state.window_map, state.signed_tiles);
+
+	auto row = frame.pixels + pitch * y;
+	auto src_y = (y + state.scroll_y) & 0xFF;
+
+	auto wy_prime = (int)y - (int)state.window_y;
+	bool window_enabled = state.window_enabled && wy_prime >= 0 && wy_prime < (int)lcd_height;
+
+	bool sprites_enabled = state.sprites_enabled;
+	bool tall_sprites = state.tall_sprites;
+
+	//The scanline is built one layer at a time, as palette slots (see
+	//ScanlineCompositor.h). bg holds the background and the window, copied
+	//from the layer cache; the low two bits are the color index that sprite
+	//priority is checked against.
+	byte_t bg[lcd_width];
+	byte_t obj[lcd_width];
+
+	if (state.bg_enabled){
+		auto line = this->layer_cache.get_line(bg_layer, src_y);
+		memcpy(bg, line + state.scroll_x, lcd_width);
+	}else
+		memset(bg, palette_slot_blank, lcd_width);
+
+	auto wx = (int)state.window_x - 7;
+	if (window_enabled && wx < (int)lcd_width){
+		auto line = this->layer_cache.get_line(window_layer, wy_prime);
+		//Only the first lcd_width pixels of the window are drawn.
+		auto src_x = std::max(-wx, 0);
+		auto dst_x = std::max(wx, 0);
+		memcpy(bg + dst_x, line + src_x, lcd_width - std::max(src_x, dst_x));
+	}
+
+	//Sprites are drawn in bin order, so the last one drawn wins where they
+	//overlap.
+	memset(obj, 0, lcd_width);
+	auto &bin = this->sprite_bins[y];
+	for (unsigned i = 0; sprites_enabled && i < bin.count; i++){
+		auto &sprite = *(const SpriteDescription *)(this->oam + bin.sprites[i] * 4);
+		auto sprx = sprite.get_x();
+		auto tile_offset_y = ((int)y - sprite.get_y()) ^ (7 * sprite.flipped_y());
+		byte_t tile_no = sprite.tile_no;
+		if (tall_sprites)
+			tile_no &= 0xFE;
+		auto src = this->tile_cache.get_row(tile_no + tile_offset_y / 8, tile_offset_y & 7, sprite.flipped_x());
+		auto slot = sprite.palette_number() ? palette_slot_obj1 : palette_slot_obj0;
+		auto behind_bg = !sprite.has_priority();
+		for (int j = 0; j < sprite_width; j++){
+			auto x = sprx + j;
+			if (x < 0 || x >= (int)lcd_width || !src[j])
+				continue;
+			//Sprites without priority are hidden behind BG colors 1-3.
+			if (behind_bg && (bg[x] & 3))
+				continue;
+			obj[x] = slot + src[j];
+		}
+	}
+
+#ifndef INDEXED_FRAMES
+	compose_scanline(row, bg, obj, this->palette);
+#else
+	std::copy(this->palette, this->palette + 16, frame.palettes[y]);
+	for (unsigned x = 0; x != lcd_width; x++)
+		row[x] = std::max(bg[x], obj[x]);
+#endif
+
+#ifdef DEBUG_FRAMES
+	for (unsigned x = 0; x != lcd_width; x++){
+		int source;
+		if (obj[x])
+			source = 2;
+		else if (bg[x] == palette_slot_blank)
+			continue;
+		else if (window_enabled && (int)x >= wx && (int)x < wx + (int)lcd_width)
+			source = 0;
+		else
+			source = 1;
+		auto &pixel = row[x];
+		if (source != 0)
+			pixel.r = 0;
+		if (source != 1)
+			pixel.g = 0;
+		if (source != 2)
+			pixel.b = 0;
+	}
+#endif
+}
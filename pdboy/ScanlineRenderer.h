@@ -0,0 +1,75 @@
+#pragma once
+#include "DisplayController.h"
+#include "TileCache.h"
+#include "LayerCache.h"
+
+//The register values a line is drawn with, decoded.
+struct ScanlineState{
+	bool bg_enabled;
+	bool window_enabled;
+	bool sprites_enabled;
+	bool tall_sprites;
+	//Tile data addressed from 0x9000 (LCDC bit 4 clear).
+	bool signed_tiles;
+	//CGB orders sprites by OAM index only.
+	bool cgb_sprite_order;
+	main_integer_t bg_map;
+	main_integer_t window_map;
+	byte_t scroll_x, scroll_y;
+	byte_t window_x, window_y;
+	byte_t bg_palette, obj0_palette, obj1_palette;
+};
+
+//Draws lines out of VRAM and OAM. The memory isn't owned by the renderer;
+//whoever writes to it must call notify_vram_write() and notify_oam_write(), so
+//the caches stay up to date. A renderer that has missed writes must be
+//replaced.
+class ScanlineRenderer{
+	static const unsigned max_sprites_per_line = 10;
+	//The sprites drawn on each line, as OAM indices, highest priority first.
+	struct SpriteBin{
+		unsigned count;
+		byte_t sprites[max_sprites_per_line];
+	};
+
+	const byte_t *oam;
+	TileCache tile_cache;
+	LayerCache layer_cache;
+	SpriteBin sprite_bins[lcd_height];
+	bool sprite_bins_dirty = true;
+	bool sprite_bins_tall = false;
+	bool sprite_bins_cgb = false;
+	std::uint64_t sprite_bin_rebuilds = 0;
+	//The last values of BGP, OBP0 and OBP1 seen, and the colors of every
+	//palette slot (see ScanlineCompositor.h).
+	byte_t palette_values[3];
+	RGB palette[16];
+
+	void rebuild_sprite_bins(bool tall_sprites, bool cgb_sprite_order);
+	void update_palettes(const ScanlineState &);
+	void render_line(RenderedFrame &, unsigned y, const ScanlineState &);
+public:
+	//vram points to 0x8000 and oam to 0xFE00.
+	ScanlineRenderer(const byte_t *vram, const byte_t *oam);
+	void notify_vram_write(main_integer_t address){
+		if (address < TileCache::tile_data_end){
+			this->tile_cache.invalidate(address);
+			this->layer_cache.invalidate_tile(address);
+		}else
+			this->layer_cache.invalidate_map(address);
+	}
+	void notify_oam_write(){
+		this->sprite_bins_dirty = true;
+	}
+	//Draws count lines from first, all with the same state.
+	void render(RenderedFrame &, unsigned first, unsigned count, const ScanlineState &);
+	void render(RenderedFrame &frame, unsigned y, const ScanlineState &state){
+		this->render(frame, y, 1, state);
+	}
+	const LayerCache &get_layer_cache() const{
+		return this->layer_cache;
+	}
+	std::uint64_t get_sprite_bin_rebuilds() const{
+		return this->sprite_bin_rebuilds;
+	}
+};
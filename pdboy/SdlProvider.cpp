@@ -14,6 +14,10 @@ const int lcd_fade = lcd_fade_period ? 0xFF / lcd_fade_period : 0;
 
 SdlProvider::SdlProvider(){
 	SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER);
+#ifdef INDEXED_FRAMES
+	if (lcd_fade_period)
+		this->fade_buffer.reset(new RGB[RenderedFrame::size]);
+#endif
 	this->initialize_graphics();
 	this->initialize_audio();
 }
@@ -145,11 +149,20 @@ void SdlProvider::render(const RenderedFrame *current_frame){
 	auto pixels = (byte_t *)void_pixels;
 	assert(pitch == lcd_width * 4);
 	if (current_frame){
-		if (!lcd_fade_period)
-			memcpy(pixels, current_frame->pixels, sizeof(current_frame->pixels));
-		else{
+		if (!lcd_fade_period){
+#ifndef INDEXED_FRAMES
+			memcpy(pixels, current_frame->pixels, RenderedFrame::bytes_size);
+#else
+			current_frame->to_rgb((RGB *)pixels);
+#endif
+		}else{
+#ifndef INDEXED_FRAMES
 			auto src = (byte_t *)current_frame->pixels;
-			for (unsigned i = sizeof(current_frame->pixels); i--;){
+#else
+			current_frame->to_rgb(this->fade_buffer.get());
+			auto src = (byte_t *)this->fade_buffer.get();
+#endif
+			for (unsigned i = RenderedFrame::bytes_size; i--;){
 				auto mod = i % 4;
 				if (mod == 3){
 					pixels[i] = 0xFF;
@@ -171,9 +184,9 @@ void SdlProvider::render(const RenderedFrame *current_frame){
 		}
 	}else{
 		if (!lcd_fade_period)
-			memset(void_pixels, 0xFF, sizeof(current_frame->pixels));
+			memset(void_pixels, 0xFF, RenderedFrame::bytes_size);
 		else{
-			for (unsigned i = sizeof(current_frame->pixels); i--;){
+			for (unsigned i = RenderedFrame::bytes_size; i--;){
 				auto mod = i % 4;
 				if (mod == 3){
 					pixels[i] = 0xFF;
@@ -294,7 +307,11 @@ bool SdlProvider::handle_events(HandleEventsResult &result){
 void SdlProvider::write_frame_to_disk(std::string &path, const RenderedFrame &frame){
 	auto surface = SDL_CreateRGBSurface(0, lcd_width, lcd_height, 32, 0xFF, 0xFF00, 0xFF0000, 0xFF000000);
 	SDL_LockSurface(surface);
-	memcpy(surface->pixels, frame.pixels, sizeof(frame.pixels));
+#ifndef INDEXED_FRAMES
+	memcpy(surface->pixels, frame.pixels, RenderedFrame::bytes_size);
+#else
+	frame.to_rgb((RGB *)surface->pixels);
+#endif
 	SDL_UnlockSurface(surface);
 	SDL_SaveBMP(surface, path.c_str());
 	SDL_FreeSurface(surface);
@@ -4,6 +4,8 @@
 #include "UserInputController.h"
 #include <SDL.h>
 
+struct RGB;
+
 class SdlProvider : public EventProvider, public TimingProvider, public GraphicsOutputProvider, public AudioOutputProvider{
 	SDL_Window *window;
 	SDL_Renderer *renderer;
@@ -15,6 +17,8 @@ class SdlProvider : public EventProvider, public TimingProvider, public Graphics
 	InputState input_state;
 	std::mutex periodic_event_mutex;
 	std::uint64_t next_frame = 0;
+	//Indexed frames are converted here before they're faded in.
+	std::unique_ptr<RGB[]> fade_buffer;
 
 	static Uint32 SDLCALL timer_callback(Uint32 interval, void *param);
 	static void SDLCALL audio_callback(void *userdata, Uint8 *stream, int len);
@@ -4,7 +4,7 @@
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <type_traits>
-#include <SDL_stdinc.h>
+#include <algorithm>
 #include <sstream>
 
 //#define OUTPUT_AUDIO_TO_FILE
@@ -18,6 +18,9 @@
 const float tau = (float)(M_PI * 2);
 
 const unsigned sampling_frequency = 44100;
+//Everything up to now is synthesized once per video frame, even if no
+//registers are accessed.
+const unsigned update_period = lcd_refresh_period;
 const int int16_max = (1 << 15) - 1;
 const byte_t Square2Generator::duties[4] = {
 	0x80,
@@ -120,12 +123,11 @@ void ClockDivider::reset(){
 SoundController::SoundController(Gameboy &system):
 		system(&system),
 #ifdef USE_STD_FUNCTION
-		audio_sample_clock(gb_cpu_frequency_power, sampling_frequency, [this](std::uint64_t n){ this->sample_callback(n); }),
 		frame_sequencer_clock(gb_cpu_frequency_power, 512, [this](std::uint64_t n){ this->frame_sequencer_callback(n); }),
 #else
-		audio_sample_clock(gb_cpu_frequency_power, sampling_frequency, SoundController::sample_callback, this),
 		frame_sequencer_clock(gb_cpu_frequency_power, 512, SoundController::frame_sequencer_callback, this),
 #endif
+		buffer(gb_cpu_frequency_power, sampling_frequency),
 		square1(*this),
 		square2(*this),
 		noise(*this),
@@ -148,6 +150,7 @@ SoundController::SoundController(Gameboy &system):
 				break;
 			}
 			this->output_buffers_by_channel[i].reset(new AudioFrame);
+			this->channel_buffers[i].reset(new BandLimitedBuffer(gb_cpu_frequency_power, sampling_frequency));
 			i++;
 		}
 	}else
@@ -158,6 +161,8 @@ SoundController::SoundController(Gameboy &system):
 			file.reset();
 		for (auto &buffer : this->output_buffers_by_channel)
 			buffer.reset();
+		for (auto &buffer : this->channel_buffers)
+			buffer.reset();
 	}
 #endif
 }
@@ -167,69 +172,135 @@ void SoundController::update(double speed_multiplier, bool speed_changed){
 		this->speed_multiplier = (std::uint64_t)(speed_multiplier * fixed_point_unit);
 		this->publishing_frames.clear_public_resource();
 	}
+	this->catch_up();
+	this->output_samples();
+
+	//The generators and the frame sequencer run lazily, whenever a register
+	//is accessed, so this only has to keep the output flowing and the delta
+	//buffer from filling up.
+	this->system->get_scheduler().schedule(EventSource::Sound, this->current_clock + update_period);
+}
+
+void SoundController::catch_up(){
 	this->current_clock = this->system->get_system_clock().get_clock_value();
-	auto t = this->current_clock - this->audio_turned_on_at;
+	this->frame_sequencer_clock.update(this->current_clock - this->audio_turned_on_at);
+	this->run_generators(this->current_clock);
+}
+
+void SoundController::run_generators(std::uint64_t time){
+	this->for_each_generator([time](auto &generator){ generator.run(time); });
+}
+
+void SoundController::refresh_outputs(){
+	this->for_each_generator([](auto &generator){ generator.refresh_output(); });
+}
+
+void SoundController::add_delta(unsigned channel, std::uint64_t time, intermediate_audio_type delta){
+	if (!(CHANNEL_SELECTION & bit(channel)))
+		return;
+#ifdef USE_FLOAT_AUDIO
+	auto value = (std::int32_t)(delta * int16_max);
+#else
+	auto value = delta;
+#endif
+	auto offset = (std::uint32_t)(time - this->buffer_clock);
+	auto &pan = this->stereo_panning[channel];
+	//Panning and the master volume are applied here, once per change.
+	auto left = pan.left ? value * (std::int32_t)this->left_volume : 0;
+	auto right = pan.right ? value * (std::int32_t)this->right_volume : 0;
+	if (left | right)
+		this->buffer.add_delta(offset, left, right);
+#ifdef OUTPUT_AUDIO_TO_FILE
+	if (this->channel_buffers[channel])
+		this->channel_buffers[channel]->add_delta(offset, value, value);
+#endif
+}
+
+void SoundController::mix_outputs(int sign){
+	this->for_each_generator([this, sign](auto &generator){
+		auto output = generator.get_output();
+		if (output)
+			this->add_delta(generator.get_channel(), this->current_clock, output * sign);
+	});
+}
+
+void SoundController::output_samples(){
+	auto length = (std::uint32_t)(this->current_clock - this->buffer_clock);
+	this->buffer.end_frame(length);
+#ifdef OUTPUT_AUDIO_TO_FILE
+	for (auto &buffer : this->channel_buffers)
+		if (buffer)
+			buffer->end_frame(length);
+#endif
+	this->buffer_clock = this->current_clock;
+
+	//The mixing is done a block at a time, in separate passes. The scaling
+	//doesn't depend on the previous samples, so it vectorizes; only the
+	//filters have to go one sample at a time.
+	const unsigned block = 256;
+	std::int32_t levels[block * 2];
+	intermediate_audio_type mixed[block * 2];
+	while (auto count = this->buffer.read_samples(levels, block)){
+#ifdef OUTPUT_AUDIO_TO_FILE
+		std::int32_t channels[4][block * 2];
+		for (int i = 4; i--;)
+			if (this->channel_buffers[i])
+				this->channel_buffers[i]->read_samples(channels[i], count);
+#endif
+		//The buffer holds the sum of the four generators times the master
+		//volume.
+		for (unsigned i = 0; i < count * 2; i++)
+#ifdef USE_FLOAT_AUDIO
+			mixed[i] = levels[i] * (1.f / (4 * 15 * int16_max));
+#else
+			mixed[i] = levels[i] / (4 * 15);
+#endif
+		for (unsigned i = 0; i < count * 2; i += 2){
+			mixed[i] = this->filter_left.update(mixed[i]);
+			mixed[i + 1] = this->filter_right.update(mixed[i + 1]);
+		}
+		for (unsigned i = 0; i < count; i++){
+#ifdef OUTPUT_AUDIO_TO_FILE
+			for (int j = 4; j--;){
+				if (!this->output_buffers_by_channel[j])
+					continue;
+				StereoSampleIntermediate channel_sample;
+				channel_sample.left = channel_sample.right = channels[j][i * 2];
+				this->output_buffers_by_channel[j]->buffer[this->current_frame_position] = convert(channel_sample);
+			}
+#endif
+			StereoSampleIntermediate sample;
+			sample.left = mixed[i * 2];
+			sample.right = mixed[i * 2 + 1];
+			this->output_sample(convert(sample));
+		}
+	}
+}
 
-	this->noise.update_state_before_render(t);
-	this->frame_sequencer_clock.update(t);
-	this->audio_sample_clock.update(t);
+void SoundController::request_update(){
+	this->system->get_scheduler().schedule(EventSource::Sound, this->system->get_system_clock().get_clock_value());
 }
 
 void SoundController::frame_sequencer_callback(std::uint64_t clock){
 	if (!this->master_toggle)
 		return;
 
+	//Everything before the tick is synthesized with the old state.
+	auto time = this->audio_turned_on_at + (clock << gb_cpu_frequency_power) / 512;
+	this->run_generators(time);
 	if (!(clock % 2))
 		this->length_counter_event();
 	if (clock % 8 == 7)
 		this->volume_event();
 	if (clock % 4 == 2)
 		this->sweep_event();
-}
-
-void SoundController::sample_callback(void *This, std::uint64_t sample_no){
-	((SoundController *)This)->sample_callback(sample_no);
+	this->refresh_outputs();
 }
 
 void SoundController::frame_sequencer_callback(void *This, std::uint64_t clock){
 	((SoundController *)This)->frame_sequencer_callback(clock);
 }
 
-StereoSampleFinal SoundController::compute_sample(){
-	std::uint64_t sample_no = this->internal_sample_counter++;
-	if (!this->master_toggle){
-		StereoSampleFinal ret;
-		ret.left = ret.right = 0;
-		return ret;
-	}
-
-	StereoSampleIntermediate channels[4];
-	channels[0] = this->render_square1(sample_no);
-	channels[1] = this->render_square2(sample_no);
-	channels[2] = this->render_voluntary(sample_no);
-	channels[3] = this->render_noise(sample_no);
-
-	StereoSampleIntermediate sample;
-	sample.left = sample.right = 0;
-
-	for (int i = 4; i--;){
-#ifdef OUTPUT_AUDIO_TO_FILE
-		if (this->output_buffers_by_channel[i])
-			this->output_buffers_by_channel[i]->buffer[this->current_frame_position] = convert(channels[i]);
-#endif
-		sample += channels[i];
-	}
-	sample /= 4;
-	sample.left = this->filter_left.update(sample.left);
-	sample.right = this->filter_left.update(sample.right);
-
-	sample.left *= this->left_volume;
-	sample.right *= this->right_volume;
-	sample /= 15;
-
-	return convert(sample);
-}
-
 void SoundController::write_sample(StereoSampleFinal *&buffer){
 	buffer[this->current_frame_position++] = this->last_sample;
 	if (this->current_frame_position >= AudioFrame::length){
@@ -250,10 +321,10 @@ void SoundController::write_sample(StereoSampleFinal *&buffer){
 	}
 }
 
-void SoundController::sample_callback(std::uint64_t sample_no){
+void SoundController::output_sample(const StereoSampleFinal &sample){
 	StereoSampleFinal *buffer = this->publishing_frames.get_private_resource()->buffer;
 	if (this->speed_multiplier == fixed_point_unit){
-		this->last_sample = this->compute_sample();
+		this->last_sample = sample;
 		this->write_sample(buffer);
 		return;
 	}
@@ -264,12 +335,12 @@ void SoundController::sample_callback(std::uint64_t sample_no){
 			this->write_sample(buffer);
 			this->speed_counter_b += this->speed_multiplier;
 		}
-		this->last_sample = this->compute_sample();
+		this->last_sample = sample;
 		this->speed_counter_a += fixed_point_unit;
 		return;
 	}
 
-	this->last_sample = this->compute_sample();
+	this->last_sample = sample;
 	bool ret = this->speed_counter_a <= this->speed_counter_b;
 	this->speed_counter_a += fixed_point_unit;
 	if (ret)
@@ -309,65 +380,17 @@ void SoundController::return_used_frame(AudioFrame *frame){
 	this->publishing_frames.return_resource(frame);
 }
 
-template <typename T1, typename T2>
-StereoSampleIntermediate compute_channel_panning_and_silence(const T1 &generator, std::uint64_t time, const T2 &pan){
-	StereoSampleIntermediate ret;
-	if (!!pan.either){
-		auto value = generator.render(time);
-
-		ret.left = value * !!pan.left;
-		ret.right = value * !!pan.right;
-	}else
-		ret.left = ret.right = 0;
-
-	return ret;
-}
-
-StereoSampleIntermediate SoundController::render_square1(std::uint64_t time){
-	this->square1.update_state_before_render(time);
-#if CHANNEL_SELECTION & CHANNEL1
-	return compute_channel_panning_and_silence(this->square1, time, this->stereo_panning[0]);
-#else
-	StereoSampleIntermediate ret;
-	ret.left = ret.right = 0;
-	return ret;
-#endif
-}
-
-StereoSampleIntermediate SoundController::render_square2(std::uint64_t time){
-	this->square2.update_state_before_render(time);
-#if CHANNEL_SELECTION & CHANNEL2
-	return compute_channel_panning_and_silence(this->square2, time, this->stereo_panning[1]);
-#else
-	StereoSampleIntermediate ret;
-	ret.left = ret.right = 0;
-	return ret;
-#endif
-}
-
-StereoSampleIntermediate SoundController::render_voluntary(std::uint64_t time){
-	this->wave.update_state_before_render(time);
-#if CHANNEL_SELECTION & CHANNEL3
-	return compute_channel_panning_and_silence(this->wave, time, this->stereo_panning[2]);
-#else
-	StereoSampleIntermediate ret;
-	ret.left = ret.right = 0;
-	return ret;
-#endif
-}
-
-StereoSampleIntermediate SoundController::render_noise(std::uint64_t time){
-#if CHANNEL_SELECTION & CHANNEL4
-	return compute_channel_panning_and_silence(this->noise, time, this->stereo_panning[3]);
-#else
-	StereoSampleIntermediate ret;
-	ret.left = ret.right = 0;
-	return ret;
-#endif
+WaveformGenerator::WaveformGenerator(SoundController &parent, unsigned channel): parent(&parent), channel(channel){
+	std::fill(this->registers, this->registers + array_size(this->registers), 0);
 }
 
-WaveformGenerator::WaveformGenerator(SoundController &parent): parent(&parent){
-	std::fill(this->registers, this->registers + array_size(this->registers), 0);
+void WaveformGenerator::set_output(std::uint64_t time, intermediate_audio_type value){
+	if (!this->parent->get_master_toggle())
+		value = 0;
+	if (value == this->output)
+		return;
+	this->parent->add_delta(this->channel, time, value - this->output);
+	this->output = value;
 }
 
 void WaveformGenerator::trigger_event(){
@@ -383,8 +406,7 @@ void EnvelopedGenerator::trigger_event(){
 
 void Square2Generator::trigger_event(){
 	EnvelopedGenerator::trigger_event();
-	this->cycle_position = 0;
-	this->reset_references();
+	this->restart_steps(this->synthesized_until);
 }
 
 void Square1Generator::trigger_event(){
@@ -401,32 +423,53 @@ unsigned Square2Generator::get_period(){
 	return this->period;
 }
 
-template <unsigned Shift>
-void FrequenciedGenerator::advance_cycle(std::uint64_t time){
-	bool und1 = this->reference_time == this->undefined_reference_time;
-	bool und2 = this->reference_cycle_position == this->undefined_reference_cycle_position;
-	if (und1 & und2){
-		this->reference_time = time;
-		this->reference_cycle_position = this->cycle_position;
-	}else{
-		auto delta = time - this->reference_time;
-		this->cycle_position = this->reference_cycle_position;
-		const auto mult = (std::uint64_t)gb_cpu_frequency << Shift;
-		auto div = sampling_frequency * this->get_period();
-		this->cycle_position += (unsigned)(delta * mult / div) & 0xFFFF;
-		this->cycle_position &= 0xFFFF;
+void FrequenciedGenerator::skip_steps(std::uint64_t time, unsigned mask){
+	if (this->next_step > time)
+		return;
+	auto period = this->get_period();
+	auto steps = (time - this->next_step) / period + 1;
+	this->phase = (unsigned)((this->phase + steps) & mask);
+	this->next_step += steps * period;
+}
+
+void FrequenciedGenerator::restart_steps(std::uint64_t time){
+	this->phase = 0;
+	this->next_step = time + this->get_period();
+}
+
+void Square2Generator::run(std::uint64_t time){
+	//The output only changes while the generator is enabled, and then only
+	//at the steps where the duty cycle changes level, so it goes from one of
+	//those straight to the next.
+	if (this->enabled() & this->parent->get_master_toggle()){
+		auto duty = this->duties[this->selected_duty];
+		intermediate_audio_type levels[] = {
+			this->render_from_bit(false),
+			this->render_from_bit(true),
+		};
+		auto period = this->get_period();
+		while (true){
+			auto level = (duty >> this->phase) & 1;
+			unsigned steps = 1;
+			while (((duty >> ((this->phase + steps) & 7)) & 1) == level)
+				steps++;
+			auto t = this->next_step + (steps - 1) * period;
+			if (t > time)
+				break;
+			this->phase = (this->phase + steps) & 7;
+			this->next_step = t + period;
+			this->set_output(t, levels[!level]);
+		}
 	}
+	this->skip_steps(time, 7);
+	WaveformGenerator::run(time);
 }
 
-void Square2Generator::update_state_before_render(std::uint64_t time){
-	this->advance_cycle<13>(time);
-}
-
-intermediate_audio_type Square2Generator::render(std::uint64_t time) const{
+intermediate_audio_type Square2Generator::render() const{
 	if (!this->enabled())
 		return 0;
 
-	bool bit = !!(this->duties[this->selected_duty] & ::bit(this->cycle_position >> 13));
+	bool bit = !!(this->duties[this->selected_duty] & ::bit(this->phase));
 	return this->render_from_bit(bit);
 }
 
@@ -554,13 +597,8 @@ byte_t Square1Generator::get_register0() const{
 void FrequenciedGenerator::frequency_change(unsigned old_frequency){
 	if (this->frequency == old_frequency)
 		return;
+	//The new period takes effect at the next step.
 	this->period = 0;
-	this->reset_references();
-}
-
-void FrequenciedGenerator::reset_references(){
-	this->reference_time = this->undefined_reference_time;
-	this->reference_cycle_position = this->undefined_reference_cycle_position;
 }
 
 void Square1Generator::sweep_event(bool force){
@@ -607,12 +645,17 @@ void WaveformGenerator::length_counter_event(){
 void SoundController::set_NR50(byte_t value){
 	this->NR50 = value;
 
+	//The volume is applied to the deltas, so the outputs so far are taken
+	//out of the mix and put back in with the new volume.
+	this->mix_outputs(-1);
 	this->left_volume = (value >> 4) & 0x07;
 	this->right_volume = value & 0x07;
+	this->mix_outputs(1);
 }
 
 void SoundController::set_NR51(byte_t value){
 	this->NR51 = value;
+	this->mix_outputs(-1);
 
 	for (int channel = 0; channel < 4; channel++){
 		auto &pan = this->stereo_panning[channel];
@@ -620,6 +663,7 @@ void SoundController::set_NR51(byte_t value){
 		pan.left = !!(value & bit(channel + 4));
 		pan.either = pan.right | pan.left;
 	}
+	this->mix_outputs(1);
 }
 
 void SoundController::set_NR52(byte_t value){
@@ -628,11 +672,10 @@ void SoundController::set_NR52(byte_t value){
 	if (this->master_toggle & !mt){
 		this->audio_turned_on_at = this->system->get_system_clock().get_clock_value();
 		this->frame_sequencer_clock.reset();
-		this->audio_sample_clock.reset();
-		this->internal_sample_counter = 0;
 		this->speed_counter_a = 0;
 		this->speed_counter_b = 0;
 		this->last_sample *= 0;
+		this->request_update();
 	}
 }
 
@@ -659,48 +702,65 @@ void NoiseGenerator::set_register3(byte_t value){
 		frequency = (1 << 19) / divisor_code;
 	frequency >>= clock_shift + 1;
 
-	this->noise_scheduler.configure(
-		gb_cpu_frequency_power,
-		frequency,
-#ifdef USE_STD_FUNCTION
-		[this](std::uint64_t)
-		{
-			this->noise_update_event();
-		}
-#else
-		NoiseGenerator::noise_update_event,
-		this
-#endif
-	);
+	this->noise_frequency = frequency;
+	//The steps up to now were done at the old frequency.
+	this->noise_clock = (this->synthesized_until * frequency) >> gb_cpu_frequency_power;
 }
 
-intermediate_audio_type NoiseGenerator::render(std::uint64_t time) const{
+intermediate_audio_type NoiseGenerator::render() const{
 	if (!this->enabled())
 		return 0;
 
-	return this->render_from_bit(this->output);
+	return this->render_from_bit(this->noise_output);
 }
 
-void NoiseGenerator::update_state_before_render(std::uint64_t time){
-	this->noise_scheduler.update(time);
+void NoiseGenerator::run(std::uint64_t time){
+	WaveformGenerator::run(time);
+	if (!this->noise_frequency)
+		return;
+	auto target = (time * this->noise_frequency) >> gb_cpu_frequency_power;
+	if (!(this->enabled() & this->parent->get_master_toggle())){
+		this->skip_noise(target);
+		return;
+	}
+	//Only the steps that flip the output cost anything.
+	while (this->noise_clock < target){
+		auto steps = (unsigned)std::min<std::uint64_t>(target - this->noise_clock, this->width_mode);
+		auto flips = this->shift_noise(steps);
+		for (unsigned i = 0; flips; i++, flips >>= 1){
+			if (!(flips & 1))
+				continue;
+			auto n = this->noise_clock + i + 1;
+			this->noise_output = !this->noise_output;
+			this->set_output(((n << gb_cpu_frequency_power) + this->noise_frequency - 1) / this->noise_frequency, this->render());
+		}
+		this->noise_clock += steps;
+	}
 }
 
-void NoiseGenerator::noise_update_event(void *This, std::uint64_t){
-	((NoiseGenerator *)This)->noise_update_event();
+void NoiseGenerator::skip_noise(std::uint64_t target){
+	while (this->noise_clock < target){
+		auto steps = (unsigned)std::min<std::uint64_t>(target - this->noise_clock, this->width_mode);
+		for (auto flips = this->shift_noise(steps); flips; flips &= flips - 1)
+			this->noise_output = !this->noise_output;
+		this->noise_clock += steps;
+	}
 }
 
-void NoiseGenerator::noise_update_event(){
-	auto output = this->noise_register;
-	this->noise_register >>= 1;
-	output ^= this->noise_register;
-	output &= 1;
-	this->noise_register &= ~bit(this->width_mode);
-	this->noise_register |= output << this->width_mode;
-	this->noise_register &= 0x7FFF;
-	this->output ^= !!output;
+unsigned NoiseGenerator::shift_noise(unsigned steps){
+	//Each step shifts in bit 0 xor bit 1 at the top of the LFSR, so the next
+	//width - 1 inputs are already in the register.
+	auto width = this->width_mode + 1;
+	auto mask = bit(width) - 1;
+	auto lfsr = this->noise_register & mask;
+	auto ret = (lfsr ^ (lfsr >> 1)) & (bit(steps) - 1);
+	//In 7-bit mode, the bits above the LFSR just shift out.
+	auto high = (this->noise_register >> steps) & ~mask & 0x7FFF;
+	this->noise_register = high | (lfsr >> steps) | (ret << (width - steps));
+	return ret;
 }
 
-VoluntaryWaveGenerator::VoluntaryWaveGenerator(SoundController &parent): WaveformGenerator(parent){
+VoluntaryWaveGenerator::VoluntaryWaveGenerator(SoundController &parent): WaveformGenerator(parent, 2){
 	std::fill(this->wave_buffer, this->wave_buffer + array_size(this->wave_buffer), 0);
 }
 
@@ -754,19 +814,30 @@ byte_t VoluntaryWaveGenerator::get_register3() const{
 	return 0xFF;
 }
 
-void VoluntaryWaveGenerator::update_state_before_render(std::uint64_t time){
-	this->advance_cycle<11>(time);
-	this->sample_register = this->wave_buffer[this->cycle_position >> 11];
+void VoluntaryWaveGenerator::run(std::uint64_t time){
+	if (this->enabled() & this->parent->get_master_toggle()){
+		this->advance_steps(time, 31, [this](std::uint64_t t){
+			this->sample_register = this->wave_buffer[this->phase];
+			this->set_output(t, this->render_sample(this->sample_register));
+		});
+	}else{
+		this->skip_steps(time, 31);
+		this->sample_register = this->wave_buffer[this->phase];
+	}
+	WaveformGenerator::run(time);
 }
 
-intermediate_audio_type VoluntaryWaveGenerator::render(std::uint64_t time) const{
+intermediate_audio_type VoluntaryWaveGenerator::render() const{
 	if (!this->enabled())
 		return 0;
+	return this->render_sample(this->sample_register);
+}
 
+intermediate_audio_type VoluntaryWaveGenerator::render_sample(byte_t sample) const{
 #ifdef USE_FLOAT_AUDIO
-	return (this->sample_register >> this->volume_shift) * (2.f / 15.f) - 1;
+	return (sample >> this->volume_shift) * (2.f / 15.f) - 1;
 #else
-	auto ret = this->sample_register >> this->volume_shift;
+	int ret = sample >> this->volume_shift;
 	ret *= 2 * int16_max;
 	ret /= 15;
 	ret -= int16_max;
@@ -786,13 +857,13 @@ bool VoluntaryWaveGenerator::enabled() const{
 
 void NoiseGenerator::trigger_event(){
 	EnvelopedGenerator::trigger_event();
-	this->noise_register |= ~this->noise_register;
+	this->noise_register = 0x7FFF;
 }
 
 void VoluntaryWaveGenerator::trigger_event(){
 	WaveformGenerator::trigger_event();
-	this->cycle_position = 0;
-	this->reset_references();
+	this->restart_steps(this->synthesized_until);
+	this->sample_register = this->wave_buffer[0];
 	if (!this->sound_length)
 		this->sound_length = 256;
 	this->dac_power = true;
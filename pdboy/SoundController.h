@@ -2,6 +2,7 @@
 
 #include "CommonTypes.h"
 #include "PublishingResource.h"
+#include "BandLimitedBuffer.h"
 #include <fstream>
 
 class Gameboy;
@@ -107,9 +108,17 @@ public:
 	void reset();
 };
 
+//Generators are synthesized in CPU time. run() brings a generator up to a
+//point in time, and every change in its output on the way is sent to the
+//SoundController as a delta, at the exact cycle at which it happens.
 class WaveformGenerator{
 protected:
 	SoundController *parent;
+	unsigned channel;
+	//The output last sent to the parent, and the time up to which the
+	//generator has been synthesized.
+	intermediate_audio_type output = 0;
+	std::uint64_t synthesized_until = 0;
 
 	byte_t registers[5];
 
@@ -120,11 +129,25 @@ protected:
 
 	virtual void trigger_event();
 	virtual bool enabled() const;
+	void set_output(std::uint64_t time, intermediate_audio_type value);
 public:
-	WaveformGenerator(SoundController &parent);
+	WaveformGenerator(SoundController &parent, unsigned channel);
 	virtual ~WaveformGenerator(){}
-	virtual void update_state_before_render(std::uint64_t time){}
-	virtual intermediate_audio_type render(std::uint64_t time) const = 0;
+	virtual void run(std::uint64_t time){
+		this->synthesized_until = time;
+	}
+	//Sends the output for the current state. Must be called after anything
+	//that can change it, other than run().
+	void refresh_output(){
+		this->set_output(this->synthesized_until, this->render());
+	}
+	intermediate_audio_type get_output() const{
+		return this->output;
+	}
+	unsigned get_channel() const{
+		return this->channel;
+	}
+	virtual intermediate_audio_type render() const = 0;
 	virtual void set_register1(byte_t);
 	virtual void set_register2(byte_t){}
 	virtual void set_register3(byte_t){}
@@ -156,31 +179,42 @@ protected:
 	intermediate_audio_type render_from_bit(bool signal) const;
 	void load_volume_from_register();
 public:
-	EnvelopedGenerator(SoundController &parent):
-		WaveformGenerator(parent){}
+	EnvelopedGenerator(SoundController &parent, unsigned channel):
+		WaveformGenerator(parent, channel){}
 	virtual ~EnvelopedGenerator(){}
 	void volume_event();
 	virtual void set_register2(byte_t value) override;
 	virtual byte_t get_register2() const override;
 };
 
+//A generator that steps through a waveform. The period is in CPU cycles per
+//step.
 class FrequenciedGenerator{
 protected:
 	unsigned frequency = 0;
 	unsigned period = 0;
-	std::uint64_t reference_time = 0;
-	unsigned cycle_position = 0;
-	unsigned reference_cycle_position = 0;
-	const decltype(reference_time) undefined_reference_time = std::numeric_limits<decltype(reference_time)>::max();
-	const decltype(reference_cycle_position) undefined_reference_cycle_position = std::numeric_limits<decltype(reference_cycle_position)>::max();
-
-	template <unsigned Shift>
-	void advance_cycle(std::uint64_t time);
+	//The current step of the waveform and the time of the next one.
+	unsigned phase = 0;
+	std::uint64_t next_step = 0;
+
+	//Advances to time, calling step(t) after each step, where t is the time
+	//of the step. Mask is the number of steps in the waveform, minus one.
+	template <typename F>
+	void advance_steps(std::uint64_t time, unsigned mask, F &&step){
+		auto period = this->get_period();
+		while (this->next_step <= time){
+			this->phase = (this->phase + 1) & mask;
+			step(this->next_step);
+			this->next_step += period;
+		}
+	}
+	//Like advance_steps(), for when nothing needs to be done at each step.
+	void skip_steps(std::uint64_t time, unsigned mask);
+	void restart_steps(std::uint64_t time);
 	void frequency_change(unsigned old_frequency);
 	virtual unsigned get_period() = 0;
 	void write_register3_frequency(byte_t value);
 	void write_register4_frequency(byte_t value);
-	void reset_references();
 public:
 	virtual ~FrequenciedGenerator(){}
 };
@@ -194,11 +228,11 @@ protected:
 	virtual bool enabled() const override;
 	void trigger_event() override;
 public:
-	Square2Generator(SoundController &parent) :
-		EnvelopedGenerator(parent){}
+	Square2Generator(SoundController &parent, unsigned channel = 1) :
+		EnvelopedGenerator(parent, channel){}
 	virtual ~Square2Generator(){}
-	void update_state_before_render(std::uint64_t time) override;
-	intermediate_audio_type render(std::uint64_t time) const override;
+	void run(std::uint64_t time) override final;
+	intermediate_audio_type render() const override final;
 
 	virtual void set_register1(byte_t value) override;
 	virtual void set_register3(byte_t value) override;
@@ -207,7 +241,7 @@ public:
 	virtual byte_t get_register3() const override;
 };
 
-class Square1Generator : public Square2Generator{
+class Square1Generator final : public Square2Generator{
 	unsigned sweep_period = 0;
 	unsigned sweep_time = 0;
 	int sweep_sign = 0;
@@ -220,42 +254,48 @@ class Square1Generator : public Square2Generator{
 	void trigger_event() override;
 public:
 	Square1Generator(SoundController &parent) :
-		Square2Generator(parent){}
+		Square2Generator(parent, 0){}
 	void set_register0(byte_t value);
 	byte_t get_register0() const;
 	void sweep_event(bool force = false);
 };
 
-class NoiseGenerator : public EnvelopedGenerator{
+class NoiseGenerator final : public EnvelopedGenerator{
 	unsigned width_mode = 0;
 	unsigned noise_register = 1;
-	bool output = true;
-
-	ClockDivider noise_scheduler;
-
-	static void noise_update_event(void *, std::uint64_t);
-	void noise_update_event();
+	bool noise_output = true;
+	unsigned noise_frequency = 0;
+	//The last step of the noise clock done so far. Step n happens at the
+	//first CPU cycle at or past n / noise_frequency seconds.
+	std::uint64_t noise_clock = 0;
+
+	//Does up to width_mode steps of the LFSR at once and returns the bits
+	//shifted in, with the first step in bit 0.
+	unsigned shift_noise(unsigned steps);
+	void skip_noise(std::uint64_t target);
 	void trigger_event() override;
 public:
 	NoiseGenerator(SoundController &parent) :
-		EnvelopedGenerator(parent){}
+		EnvelopedGenerator(parent, 3){}
 	void set_register3(byte_t value) override;
-	intermediate_audio_type render(std::uint64_t time) const override;
-	void update_state_before_render(std::uint64_t time) override;
+	intermediate_audio_type render() const override;
+	void run(std::uint64_t time) override;
 };
 
-class VoluntaryWaveGenerator : public WaveformGenerator, public FrequenciedGenerator{
+class VoluntaryWaveGenerator final : public WaveformGenerator, public FrequenciedGenerator{
 	bool dac_power = false;
 	unsigned volume_shift = 0;
 	byte_t wave_buffer[32];
 	byte_t sample_register = 0;
 
+	intermediate_audio_type render_sample(byte_t sample) const;
+
 	bool enabled() const override;
 	void trigger_event() override;
 public:
 	VoluntaryWaveGenerator(SoundController &parent);
-	void update_state_before_render(std::uint64_t time) override;
-	intermediate_audio_type render(std::uint64_t time) const override;
+	void run(std::uint64_t time) override;
+	intermediate_audio_type render() const override;
 	unsigned get_period() override;
 
 	void set_register0(byte_t);
@@ -283,9 +323,12 @@ class SoundController{
 	QueuedPublishingResource<AudioFrame> publishing_frames;
 	std::uint64_t frame_no = 0;
 	std::uint64_t audio_turned_on_at = 0;
-	std::uint64_t current_clock;
-	ClockDivider frame_sequencer_clock,
-		audio_sample_clock;
+	std::uint64_t current_clock = 0;
+	ClockDivider frame_sequencer_clock;
+	//The generators' outputs, mixed with the panning and the master volume
+	//applied. The current frame of the buffer starts at buffer_clock.
+	BandLimitedBuffer buffer;
+	std::uint64_t buffer_clock = 0;
 	CapacitorFilter filter_left,
 		filter_right;
 
@@ -308,22 +351,33 @@ class SoundController{
 	std::unique_ptr<std::ofstream> output_file;
 	std::unique_ptr<std::ofstream> output_files_by_channel[4];
 	std::unique_ptr<AudioFrame> output_buffers_by_channel[4];
+	std::unique_ptr<BandLimitedBuffer> channel_buffers[4];
 	std::uint64_t speed_multiplier = 0x10000;
 	std::uint64_t speed_counter_a = 0;
 	std::uint64_t speed_counter_b = 0;
-	std::uint64_t internal_sample_counter = 0;
 	StereoSampleFinal last_sample;
 
-	StereoSampleIntermediate render_square1(std::uint64_t time);
-	StereoSampleIntermediate render_square2(std::uint64_t time);
-	StereoSampleIntermediate render_voluntary(std::uint64_t time);
-	StereoSampleIntermediate render_noise(std::uint64_t time);
+	//Calls f with each generator in channel order, as its own type, so that
+	//the calls aren't virtual.
+	template <typename F>
+	void for_each_generator(F &&f){
+		f(this->square1);
+		f(this->square2);
+		f(this->wave);
+		f(this->noise);
+	}
 	void initialize_new_frame();
-	static void sample_callback(void *, std::uint64_t);
 	static void frame_sequencer_callback(void *, std::uint64_t);
-	StereoSampleFinal compute_sample();
+	//Brings the generators up to the current time.
+	void catch_up();
+	void run_generators(std::uint64_t time);
+	void refresh_outputs();
+	//Adds the outputs of all generators to the buffers, times sign.
+	void mix_outputs(int sign);
+	//Reads the samples synthesized so far into the audio frames.
+	void output_samples();
+	void output_sample(const StereoSampleFinal &);
 	void write_sample(StereoSampleFinal *&buffer);
-	void sample_callback(std::uint64_t);
 	void frame_sequencer_callback(std::uint64_t);
 	void length_counter_event();
 	void volume_event();
@@ -336,6 +390,28 @@ public:
 
 	SoundController(Gameboy &);
 	void update(double speed_multiplier, bool speed_changed);
+	//Register writes must go through here, so that everything up to now is
+	//synthesized with the old values.
+	template <typename F>
+	void write_register(F &&write){
+		this->catch_up();
+		write();
+		this->refresh_outputs();
+	}
+	//Register reads go through here, so that they see the frame sequencer
+	//ticks up to now, like length counters running out.
+	template <typename F>
+	byte_t read_register(F &&read){
+		this->catch_up();
+		return read();
+	}
+	//Called by the generators. time is in CPU cycles.
+	void add_delta(unsigned channel, std::uint64_t time, intermediate_audio_type delta);
+	bool get_master_toggle() const{
+		return this->master_toggle;
+	}
+	//Requests a call to update() as soon as the current instruction finishes.
+	void request_update();
 	AudioFrame *get_current_frame();
 	void return_used_frame(AudioFrame *);
 	std::uint64_t get_current_clock() const{
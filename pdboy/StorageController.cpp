@@ -5,12 +5,17 @@
 
 bool StorageController::load_cartridge(const path_t &path){
 	auto buffer = this->host->get_storage_provider()->load_file(path, 16 << 20);
+	return this->load_cartridge(path, std::move(buffer));
+}
+
+bool StorageController::load_cartridge(const path_t &path, std::unique_ptr<std::vector<byte_t>> &&buffer){
 	if (!buffer || !buffer->size())
 		return false;
 	auto new_cart = Cartridge::construct_from_buffer(*this->host, path, std::move(buffer));
 	if (!new_cart)
 		return false;
 	this->cartridge = std::move(new_cart);
+	this->system->get_cpu().get_memory_controller().update_rom_pages();
 	return true;
 }
 
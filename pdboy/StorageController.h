@@ -15,6 +15,8 @@ class StorageController{
 public:
 	StorageController(Gameboy &system, HostSystem &host): system(&system), host(&host){}
 	bool load_cartridge(const path_t &path);
+	//path is only used to decide where saves go.
+	bool load_cartridge(const path_t &path, std::unique_ptr<std::vector<byte_t>> &&buffer);
 	void write8(main_integer_t address, byte_t value){
 		this->cartridge->write8(address, value);
 	}
@@ -22,6 +24,9 @@ public:
 		return this->cartridge->read8(address);
 	}
 	int get_current_rom_bank();
+	bool has_cart() const{
+		return !!this->cartridge;
+	}
 	Cartridge &get_cart(){
 		return *this->cartridge;
 	}
@@ -15,18 +15,98 @@ double SystemClock::get_realtime_clock_value_seconds() const{
 	return (double)this->get_realtime_clock_value() * (1.0 / (double)gb_cpu_frequency);
 }
 
-void SystemClock::advance_clock(std::uint32_t clocks){
-	assert(!(clocks % 4));
-	clocks >>= 2;
-	while (clocks--){
-		this->realtime_clock += 4;
-		this->cpu_clock += 4;
-		this->DIV_register += 4;
-		if (this->tima_overflow)
-			this->handle_tima_overflow_part2();
-		else
-			this->cascade_timer_behavior_no_check();
+void SystemClock::step_timer(){
+	this->timer_clock += 4;
+	this->DIV_register += 4;
+	if (this->tima_overflow)
+		this->handle_tima_overflow_part2();
+	else
+		this->cascade_timer_behavior_no_check();
+}
+
+//Returns the number of times TIMA is incremented while DIV counts from the
+//start of a period of the selected bit up to div.
+std::uint64_t SystemClock::count_timer_increments(std::uint64_t div) const{
+	//TIMA is incremented on every step after which the selected bit is set, if
+	//it was also set before the step. In other words, the selected bit is set
+	//for tac_mask/4 steps per period, and only the first of those doesn't
+	//increment TIMA.
+	std::uint64_t half = this->tac_mask;
+	std::uint64_t period = half * 2;
+	std::uint64_t per_period = half / 4 - 1;
+	auto position = div % period;
+	auto ret = div / period * per_period;
+	if (position > half)
+		ret += (position - half) / 4;
+	return ret;
+}
+
+//Returns the number of steps needed, starting from the current state, for
+//TIMA to be incremented the given number of times. Assumes that the timer is
+//enabled and last_preincrement_value is consistent with DIV_register.
+std::uint64_t SystemClock::get_steps_until_increments(std::uint64_t increments) const{
+	std::uint64_t half = this->tac_mask;
+	std::uint64_t period = half * 2;
+	std::uint64_t per_period = half / 4 - 1;
+	std::uint64_t start = this->DIV_register % period;
+	auto target = this->count_timer_increments(start) + increments;
+	auto periods = (target - 1) / per_period;
+	auto rest = target - periods * per_period;
+	auto div = periods * period + half + rest * 4;
+	return (div - start) / 4;
+}
+
+void SystemClock::sync_timer(){
+	if (this->timer_clock == this->cpu_clock)
+		return;
+	while (this->timer_clock < this->cpu_clock){
+		bool preincrement_value = !!(this->DIV_register & this->tac_mask);
+		if (this->tima_overflow || preincrement_value != this->last_preincrement_value){
+			//Irregular step. Do it the slow way.
+			this->step_timer();
+			continue;
+		}
+		auto steps = (this->cpu_clock - this->timer_clock) / 4;
+		std::uint64_t increments = 0;
+		if (this->timer_enable_mask){
+			std::uint64_t period = this->tac_mask * 2;
+			std::uint64_t start = this->DIV_register % period;
+			increments = this->count_timer_increments(start + steps * 4) - this->count_timer_increments(start);
+			auto until_overflow = 0x100 - this->TIMA_register;
+			if (increments >= until_overflow){
+				increments = until_overflow;
+				steps = this->get_steps_until_increments(increments);
+			}
+		}
+		this->timer_clock += steps * 4;
+		this->DIV_register += (std::uint32_t)(steps * 4);
+		this->TIMA_register += (std::uint32_t)increments;
+		this->last_preincrement_value = !!(this->DIV_register & this->tac_mask);
+		this->handle_tima_overflow_part1();
+	}
+	this->schedule_timer_event();
+}
+
+//Asks to be called back when the timer interrupt is triggered next, or
+//earlier if the timer can't predict it.
+void SystemClock::schedule_timer_event(){
+	auto &scheduler = this->system->get_scheduler();
+	std::uint64_t deadline;
+	if (this->trigger_interrupt)
+		deadline = this->timer_clock;
+	else if (this->tima_overflow)
+		deadline = this->timer_clock + 4;
+	else if (!this->timer_enable_mask)
+		deadline = EventScheduler::never;
+	else if (!!(this->DIV_register & this->tac_mask) != this->last_preincrement_value)
+		deadline = this->timer_clock + 4;
+	else{
+		//TIMA overflows at the end of these steps, and TMA is loaded and the
+		//interrupt is triggered on the following step.
+		auto steps = this->get_steps_until_increments(0x100 - this->TIMA_register);
+		deadline = this->timer_clock + steps * 4 + 4;
 	}
+	scheduler.schedule(EventSource::Timer, deadline);
 }
 
 void SystemClock::cascade_timer_behavior(std::uint32_t old_tac, std::uint32_t new_tac){
@@ -56,6 +136,7 @@ void SystemClock::handle_tima_overflow_part2(){
 }
 
 void SystemClock::set_TAC_register(byte_t val){
+	this->sync_timer();
 	auto old = this->TAC_register;
 	this->TAC_register = val;
 	this->tac_mask = this->tac_selector[val & 3][0];
@@ -66,4 +147,5 @@ void SystemClock::set_TAC_register(byte_t val){
 		this->TIMA_register = this->TMA_register;
 		this->tima_overflow = 0;
 	}
+	this->schedule_timer_event();
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "CommonTypes.h"
+#include <cassert>
 
 class Gameboy;
 
@@ -15,6 +16,11 @@ class SystemClock{
 	//Ticks at the same rate as realtime_clock, unless the CPU is in the
 	//stopped state (caused by a STOP instruction).
 	std::uint64_t cpu_clock = 0;
+	//The timer registers are not updated as the clock advances. Instead, they
+	//are brought up to date (up to cpu_clock) whenever they're accessed, or
+	//when the next TIMA overflow is due. timer_clock holds the value of
+	//cpu_clock the timer registers correspond to.
+	std::uint64_t timer_clock = 0;
 	std::uint32_t DIV_register = 0;
 	std::uint32_t TIMA_register = 0;
 	std::uint8_t TMA_register = 0;
@@ -31,6 +37,11 @@ class SystemClock{
 	void cascade_timer_behavior_no_check();
 	void handle_tima_overflow_part1();
 	void handle_tima_overflow_part2();
+	void step_timer();
+	void sync_timer();
+	std::uint64_t count_timer_increments(std::uint64_t div) const;
+	std::uint64_t get_steps_until_increments(std::uint64_t increments) const;
+	void schedule_timer_event();
 public:
 	SystemClock(Gameboy &system): system(&system){}
 
@@ -38,40 +49,72 @@ public:
 		return this->realtime_clock;
 	}
 	double get_realtime_clock_value_seconds() const;
+	//For the threaded interpreter, which checks the clock after every
+	//instruction.
+	const std::uint64_t *get_cpu_clock_pointer() const{
+		return &this->cpu_clock;
+	}
+	//For compiled code, which keeps the clock in a register and writes it back
+	//itself.
+	std::uint64_t *get_cpu_clock_pointer(){
+		return &this->cpu_clock;
+	}
+	std::uint64_t *get_realtime_clock_pointer(){
+		return &this->realtime_clock;
+	}
 	std::uint64_t get_clock_value() const{
 		return this->cpu_clock;
 	}
-	void advance_clock(std::uint32_t clocks);
-	byte_t get_DIV_register() const{
+	void advance_clock(std::uint32_t clocks){
+		assert(!(clocks % 4));
+		this->realtime_clock += clocks;
+		this->cpu_clock += clocks;
+	}
+	//Returns the clock value at which DIV will next be incremented.
+	std::uint64_t get_next_DIV_change(){
+		this->sync_timer();
+		return this->cpu_clock + (0x100 - (this->DIV_register & 0xFF));
+	}
+	byte_t get_DIV_register(){
+		this->sync_timer();
 		auto ret = this->DIV_register;
 		ret >>= 8;
 		ret &= 0xFF;
 		return (byte_t)ret;
 	}
 	void reset_DIV_register(){
+		this->sync_timer();
 		this->DIV_register = 0;
 		this->cascade_timer_behavior();
+		this->schedule_timer_event();
 	}
 	bool get_trigger_interrupt(){
+		this->sync_timer();
 		auto ret = this->trigger_interrupt;
 		this->trigger_interrupt = false;
+		this->schedule_timer_event();
 		return ret;
 	}
 	void set_TIMA_register(byte_t val){
+		this->sync_timer();
 		this->TIMA_register = val;
 		this->tima_overflow = 0;
+		this->schedule_timer_event();
 	}
-	byte_t get_TIMA_register() const{
+	byte_t get_TIMA_register(){
+		this->sync_timer();
 		auto ret = this->TIMA_register;
 		ret &= 0xFF;
 		return (byte_t)ret;
 	}
 	void set_TMA_register(byte_t val){
+		this->sync_timer();
 		this->TMA_register = val;
 		if (this->tima_overflow){
 			this->TIMA_register = this->TMA_register;
 			this->tima_overflow = 0;
 		}
+		this->schedule_timer_event();
 	}
 	byte_t get_TMA_register() const{
 		auto ret = this->TMA_register;
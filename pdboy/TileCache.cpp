@@ -0,0 +1,22 @@
+#include "TileCache.h"
+#include <algorithm>
+
+TileCache::TileCache(const byte_t *tile_data): tile_data(tile_data){
+	std::fill(this->dirty, this->dirty + tile_count, true);
+}
+
+void TileCache::decode(unsigned tile){
+	auto src = this->tile_data + tile * 16;
+	for (unsigned y = 0; y < 8; y++){
+		auto low = src[y * 2 + 0];
+		auto high = src[y * 2 + 1];
+		auto row = this->pixels[tile][y];
+		auto flipped_row = this->flipped_pixels[tile][y];
+		for (unsigned x = 0; x < 8; x++){
+			auto shift = 7 - x;
+			row[x] = ((low >> shift) & 1) | (((high >> shift) & 1) << 1);
+			flipped_row[7 - x] = row[x];
+		}
+	}
+	this->dirty[tile] = false;
+}
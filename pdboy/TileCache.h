@@ -0,0 +1,34 @@
+#pragma once
+#include "CommonTypes.h"
+
+//The 384 tiles of VRAM tile data ([0x8000; 0x9800)) expanded to one color
+//index per byte, leftmost pixel first, plus horizontally flipped copies for
+//sprites. A tile is decoded the first time it's used after being written.
+class TileCache{
+public:
+	static const unsigned tile_count = 384;
+	static const main_integer_t tile_data_start = 0x8000;
+	static const main_integer_t tile_data_end = tile_data_start + tile_count * 16;
+private:
+	const byte_t *tile_data;
+	byte_t pixels[tile_count][8][8];
+	byte_t flipped_pixels[tile_count][8][8];
+	bool dirty[tile_count];
+
+	void decode(unsigned tile);
+public:
+	TileCache(const byte_t *tile_data);
+	void invalidate(main_integer_t address){
+		this->dirty[(address - tile_data_start) >> 4] = true;
+	}
+	const byte_t *get_row(unsigned tile, unsigned y){
+		if (this->dirty[tile])
+			this->decode(tile);
+		return this->pixels[tile][y];
+	}
+	const byte_t *get_row(unsigned tile, unsigned y, bool flipped){
+		if (this->dirty[tile])
+			this->decode(tile);
+		return flipped ? this->flipped_pixels[tile][y] : this->pixels[tile][y];
+	}
+};
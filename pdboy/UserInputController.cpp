@@ -13,8 +13,10 @@ UserInputController::~UserInputController(){
 
 void UserInputController::set_input_state(InputState *state, bool button_down, bool button_up){
 	delete std::atomic_exchange(&this->input_state, state);
-	if (button_down)
+	if (button_down){
 		this->button_down = true;
+		this->system->get_scheduler().wake();
+	}
 }
 
 void UserInputController::request_input_state(byte_t select){
@@ -0,0 +1,281 @@
+#include "ZipArchive.h"
+#include "exceptions.h"
+#include <algorithm>
+
+static std::uint32_t read16(const std::vector<byte_t> &buffer, size_t offset){
+	if (offset + 2 > buffer.size())
+		throw GenericException("Truncated ZIP archive.");
+	return buffer[offset] | (buffer[offset + 1] << 8);
+}
+
+static std::uint32_t read32(const std::vector<byte_t> &buffer, size_t offset){
+	return read16(buffer, offset) | (read16(buffer, offset + 2) << 16);
+}
+
+namespace{
+
+class BitReader{
+	const byte_t *data;
+	size_t size;
+	size_t position = 0;
+	std::uint32_t bit_buffer = 0;
+	unsigned bit_count = 0;
+public:
+	BitReader(const byte_t *data, size_t size): data(data), size(size){}
+	unsigned bits(unsigned count){
+		while (this->bit_count < count){
+			if (this->position >= this->size)
+				throw GenericException("Truncated deflate stream.");
+			this->bit_buffer |= (std::uint32_t)this->data[this->position++] << this->bit_count;
+			this->bit_count += 8;
+		}
+		auto ret = this->bit_buffer & ((1U << count) - 1);
+		this->bit_buffer >>= count;
+		this->bit_count -= count;
+		return ret;
+	}
+	//Discards the bits left in the current byte.
+	void align(){
+		this->bit_buffer = 0;
+		this->bit_count = 0;
+	}
+	const byte_t *take_bytes(size_t count){
+		if (this->size - this->position < count)
+			throw GenericException("Truncated deflate stream.");
+		auto ret = this->data + this->position;
+		this->position += count;
+		return ret;
+	}
+};
+
+//Canonical Huffman code, decoded one bit at a time.
+class Huffman{
+	static const unsigned max_bits = 15;
+	std::uint16_t count[max_bits + 1];
+	std::uint16_t symbols[288];
+public:
+	Huffman(const std::uint8_t *lengths, unsigned n){
+		std::fill(this->count, this->count + max_bits + 1, 0);
+		for (unsigned i = 0; i < n; i++)
+			this->count[lengths[i]]++;
+		std::uint16_t offsets[max_bits + 1];
+		offsets[1] = 0;
+		for (unsigned i = 1; i < max_bits; i++)
+			offsets[i + 1] = offsets[i] + this->count[i];
+		for (unsigned i = 0; i < n; i++)
+			if (lengths[i])
+				this->symbols[offsets[lengths[i]]++] = i;
+	}
+	unsigned decode(BitReader &reader) const{
+		int code = 0,
+			first = 0,
+			index = 0;
+		for (unsigned length = 1; length <= max_bits; length++){
+			code |= reader.bits(1);
+			int count = this->count[length];
+			if (code - first < count)
+				return this->symbols[index + code - first];
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+		throw GenericException("Invalid Huffman code in deflate stream.");
+	}
+};
+
+}
+
+static const std::uint16_t length_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const std::uint8_t length_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const std::uint16_t distance_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const std::uint8_t distance_extra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static void inflate_block(BitReader &reader, std::vector<byte_t> &dst, const Huffman &lengths, const Huffman &distances){
+	while (true){
+		auto symbol = lengths.decode(reader);
+		if (symbol < 256){
+			dst.push_back((byte_t)symbol);
+			continue;
+		}
+		if (symbol == 256)
+			return;
+		symbol -= 257;
+		if (symbol >= sizeof(length_base) / sizeof(*length_base))
+			throw GenericException("Invalid length in deflate stream.");
+		size_t length = length_base[symbol] + reader.bits(length_extra[symbol]);
+		symbol = distances.decode(reader);
+		if (symbol >= sizeof(distance_base) / sizeof(*distance_base))
+			throw GenericException("Invalid distance in deflate stream.");
+		size_t distance = distance_base[symbol] + reader.bits(distance_extra[symbol]);
+		if (distance > dst.size())
+			throw GenericException("Invalid distance in deflate stream.");
+		//The source and destination may overlap, so copy byte by byte.
+		auto start = dst.size() - distance;
+		for (size_t i = 0; i < length; i++)
+			dst.push_back(dst[start + i]);
+	}
+}
+
+static void inflate_dynamic_block(BitReader &reader, std::vector<byte_t> &dst){
+	static const std::uint8_t order[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+	unsigned literal_count = reader.bits(5) + 257;
+	unsigned distance_count = reader.bits(5) + 1;
+	unsigned code_length_count = reader.bits(4) + 4;
+	if (literal_count > 286 || distance_count > 30)
+		throw GenericException("Invalid dynamic block in deflate stream.");
+
+	std::uint8_t lengths[286 + 30] = {};
+	for (unsigned i = 0; i < code_length_count; i++)
+		lengths[order[i]] = (std::uint8_t)reader.bits(3);
+	Huffman code_lengths(lengths, 19);
+
+	unsigned total = literal_count + distance_count;
+	for (unsigned i = 0; i < total;){
+		auto symbol = code_lengths.decode(reader);
+		if (symbol < 16){
+			lengths[i++] = (std::uint8_t)symbol;
+			continue;
+		}
+		std::uint8_t value = 0;
+		unsigned repeat;
+		if (symbol == 16){
+			if (!i)
+				throw GenericException("Invalid dynamic block in deflate stream.");
+			value = lengths[i - 1];
+			repeat = 3 + reader.bits(2);
+		}else if (symbol == 17)
+			repeat = 3 + reader.bits(3);
+		else
+			repeat = 11 + reader.bits(7);
+		if (i + repeat > total)
+			throw GenericException("Invalid dynamic block in deflate stream.");
+		while (repeat--)
+			lengths[i++] = value;
+	}
+	Huffman literals(lengths, literal_count);
+	Huffman distances(lengths + literal_count, distance_count);
+	inflate_block(reader, dst, literals, distances);
+}
+
+static void inflate(const byte_t *src, size_t size, std::vector<byte_t> &dst){
+	BitReader reader(src, size);
+	bool last;
+	do{
+		last = !!reader.bits(1);
+		switch (reader.bits(2)){
+			case 0:
+				{
+					reader.align();
+					auto header = reader.take_bytes(4);
+					unsigned length = header[0] | (header[1] << 8);
+					unsigned complement = header[2] | (header[3] << 8);
+					if (length != (~complement & 0xFFFF))
+						throw GenericException("Invalid stored block in deflate stream.");
+					auto data = reader.take_bytes(length);
+					dst.insert(dst.end(), data, data + length);
+				}
+				break;
+			case 1:
+				{
+					std::uint8_t lengths[288];
+					std::fill(lengths, lengths + 144, 8);
+					std::fill(lengths + 144, lengths + 256, 9);
+					std::fill(lengths + 256, lengths + 280, 7);
+					std::fill(lengths + 280, lengths + 288, 8);
+					Huffman literals(lengths, 288);
+					std::fill(lengths, lengths + 30, 5);
+					Huffman distances(lengths, 30);
+					inflate_block(reader, dst, literals, distances);
+				}
+				break;
+			case 2:
+				inflate_dynamic_block(reader, dst);
+				break;
+			default:
+				throw GenericException("Invalid block type in deflate stream.");
+		}
+	}while (!last);
+}
+
+ZipArchive::ZipArchive(std::unique_ptr<std::vector<byte_t>> &&buffer): buffer(std::move(buffer)){
+	this->read_central_directory();
+}
+
+void ZipArchive::read_central_directory(){
+	const std::uint32_t end_signature = 0x06054B50;
+	const std::uint32_t entry_signature = 0x02014B50;
+	const size_t end_size = 22;
+	auto &buffer = *this->buffer;
+
+	//The end of central directory record is followed by a comment of up to
+	//64 KiB.
+	if (buffer.size() < end_size)
+		throw GenericException("Not a ZIP archive.");
+	size_t end = buffer.size() - end_size;
+	size_t lowest = end > 0xFFFF ? end - 0xFFFF : 0;
+	while (read32(buffer, end) != end_signature){
+		if (end == lowest)
+			throw GenericException("Not a ZIP archive.");
+		end--;
+	}
+
+	auto count = read16(buffer, end + 10);
+	size_t offset = read32(buffer, end + 16);
+	for (unsigned i = 0; i < count; i++){
+		if (read32(buffer, offset) != entry_signature)
+			throw GenericException("Invalid ZIP central directory.");
+		Entry entry;
+		entry.method = read16(buffer, offset + 10);
+		entry.compressed_size = read32(buffer, offset + 20);
+		entry.size = read32(buffer, offset + 24);
+		auto name_length = read16(buffer, offset + 28);
+		auto extra_length = read16(buffer, offset + 30);
+		auto comment_length = read16(buffer, offset + 32);
+		entry.local_header_offset = read32(buffer, offset + 42);
+		offset += 46;
+		if (offset + name_length > buffer.size())
+			throw GenericException("Truncated ZIP archive.");
+		entry.name.assign((const char *)&buffer[offset], name_length);
+		offset += name_length + extra_length + comment_length;
+		this->entries.push_back(entry);
+	}
+}
+
+std::vector<std::string> ZipArchive::get_names() const{
+	std::vector<std::string> ret;
+	for (auto &entry : this->entries)
+		ret.push_back(entry.name);
+	return ret;
+}
+
+std::unique_ptr<std::vector<byte_t>> ZipArchive::extract(const std::string &name) const{
+	const std::uint32_t local_signature = 0x04034B50;
+	std::unique_ptr<std::vector<byte_t>> ret;
+	auto it = std::find_if(this->entries.begin(), this->entries.end(), [&name](const Entry &entry){ return entry.name == name; });
+	if (it == this->entries.end())
+		return ret;
+
+	auto &buffer = *this->buffer;
+	auto offset = it->local_header_offset;
+	if (read32(buffer, offset) != local_signature)
+		throw GenericException("Invalid ZIP local header.");
+	offset += 30 + read16(buffer, offset + 26) + read16(buffer, offset + 28);
+	if (offset > buffer.size() || buffer.size() - offset < it->compressed_size)
+		throw GenericException("Truncated ZIP archive.");
+
+	ret.reset(new std::vector<byte_t>);
+	ret->reserve(it->size);
+	switch (it->method){
+		case 0:
+			ret->assign(buffer.begin() + offset, buffer.begin() + offset + it->compressed_size);
+			break;
+		case 8:
+			inflate(&buffer[0] + offset, it->compressed_size, *ret);
+			break;
+		default:
+			throw GenericException("Unsupported ZIP compression method.");
+	}
+	if (ret->size() != it->size)
+		throw GenericException("ZIP entry has the wrong size.");
+	return ret;
+}
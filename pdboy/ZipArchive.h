@@ -0,0 +1,27 @@
+#pragma once
+#include "CommonTypes.h"
+#include <memory>
+#include <vector>
+#include <string>
+
+//Minimal ZIP reader, enough to load ROMs straight out of the archives in
+//testing/. Only stored and deflated entries are supported. Malformed archives
+//throw GenericException.
+class ZipArchive{
+	struct Entry{
+		std::string name;
+		unsigned method;
+		size_t compressed_size;
+		size_t size;
+		size_t local_header_offset;
+	};
+	std::unique_ptr<std::vector<byte_t>> buffer;
+	std::vector<Entry> entries;
+
+	void read_central_directory();
+public:
+	ZipArchive(std::unique_ptr<std::vector<byte_t>> &&buffer);
+	std::vector<std::string> get_names() const;
+	//Returns nullptr if the archive has no entry with that name.
+	std::unique_ptr<std::vector<byte_t>> extract(const std::string &name) const;
+};
@@ -0,0 +1,305 @@
+#include "HostSystem.h"
+#include "ZipArchive.h"
+#include "LayerCache.h"
+#include "timer.h"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <cstdlib>
+
+//Headless benchmark. Runs every ROM given on the command line for a fixed
+//number of emulated frames, as fast as possible, and prints one JSON object
+//per ROM to stdout.
+//
+//Usage: pdboy_bench [-frames N] [-scanlines N] [-channel-frames N] [-frameskip N|auto] [-render-thread] ROM...
+//Each ROM can be a ROM file, a ZIP archive (the ROM nearest the root of the
+//archive is used), or a path inside an archive, as in
+//testing/cpu_instrs.zip/cpu_instrs/individual/01-special.gb
+//
+//After the run, the scanline renderer is timed on its own by redrawing the
+//final VRAM state -scanlines times. This is always done inline, even with
+//-render-thread. Then each sound channel is played alone for -channel-frames
+//more frames, to time the sound events per output sample.
+
+static const unsigned default_frames = 3600;
+static const unsigned default_scanlines = lcd_height * 600;
+static const unsigned default_channel_frames = 600;
+static const size_t maximum_archive_size = 64 << 20;
+
+static bool ends_with(const std::string &s, const char *suffix){
+	auto n = strlen(suffix);
+	return s.size() >= n && !s.compare(s.size() - n, n, suffix);
+}
+
+static std::unique_ptr<std::vector<byte_t>> load_file(StorageProvider &storage, const std::string &path){
+	return storage.load_file(path_t(new StdBasicString<char>(path)), maximum_archive_size);
+}
+
+static std::string pick_rom(const ZipArchive &archive){
+	std::string ret;
+	size_t best_depth = std::numeric_limits<size_t>::max();
+	for (auto &name : archive.get_names()){
+		if (!ends_with(name, ".gb") && !ends_with(name, ".gbc"))
+			continue;
+		auto depth = (size_t)std::count(name.begin(), name.end(), '/');
+		if (depth < best_depth){
+			ret = name;
+			best_depth = depth;
+		}
+	}
+	return ret;
+}
+
+//Sets name to the full name of the ROM loaded.
+static std::unique_ptr<std::vector<byte_t>> load_rom(StorageProvider &storage, const std::string &argument, std::string &name){
+	name = argument;
+	auto zip = argument.find(".zip/");
+	if (zip == argument.npos && !ends_with(argument, ".zip"))
+		return load_file(storage, argument);
+
+	std::unique_ptr<std::vector<byte_t>> ret;
+	auto archive_path = zip == argument.npos ? argument : argument.substr(0, zip + 4);
+	auto buffer = load_file(storage, archive_path);
+	if (!buffer)
+		return ret;
+	ZipArchive archive(std::move(buffer));
+	std::string entry;
+	if (zip == argument.npos){
+		entry = pick_rom(archive);
+		name = archive_path + "/" + entry;
+	}else
+		entry = argument.substr(zip + 5);
+	return archive.extract(entry);
+}
+
+static std::string json_string(const std::string &s){
+	std::stringstream stream;
+	stream << '"';
+	for (unsigned char c : s){
+		if (c == '"' || c == '\\')
+			stream << '\\' << c;
+		else if (c < 0x20)
+			stream << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (unsigned)c << std::dec;
+		else
+			stream << c;
+	}
+	stream << '"';
+	return stream.str();
+}
+
+//Returns the average time in nanoseconds to render one scanline.
+static double time_scanlines(DisplayController &display, unsigned scanlines){
+	if (!scanlines)
+		return 0;
+	auto start = get_timer_count();
+	for (unsigned i = 0; i < scanlines; i++)
+		display.render_current_scanline(i % lcd_height);
+	auto elapsed = get_timer_count() - start;
+	return elapsed * 1e9 / get_timer_resolution() / scanlines;
+}
+
+static unsigned run_frames(Gameboy &gameboy, unsigned frames){
+	auto &sound = gameboy.get_sound_controller();
+	unsigned ret = 0;
+	for (unsigned i = 0; i < frames; i++){
+		gameboy.run_until_next_frame(true);
+		//Nothing consumes the output, so it's handed straight back.
+		auto frame = gameboy.get_current_frame();
+		if (frame)
+			gameboy.return_used_frame(frame);
+		while (auto audio_frame = sound.get_current_frame()){
+			sound.return_used_frame(audio_frame);
+			ret += AudioFrame::length;
+		}
+	}
+	return ret;
+}
+
+//Returns the average time in nanoseconds spent in sound events per output
+//sample, with only the given channel playing a 2 kHz tone (noise at the
+//highest frequency). Channel 4 means none.
+static double time_channel(Gameboy &gameboy, unsigned channel, unsigned frames){
+	if (!frames)
+		return 0;
+	auto &sound = gameboy.get_sound_controller();
+	sound.write_register([&](){
+		sound.set_NR52(0);
+		sound.set_NR52(0x80);
+		sound.set_NR50(0x77);
+		sound.set_NR51(0xFF);
+		sound.square1.set_register0(0);
+		sound.square1.set_register2(channel == 0 ? 0xF0 : 0);
+		sound.square2.set_register2(channel == 1 ? 0xF0 : 0);
+		sound.wave.set_register0(channel == 2 ? 0x80 : 0);
+		sound.noise.set_register2(channel == 3 ? 0xF0 : 0);
+		sound.noise.set_register3(0xF7);
+		for (unsigned i = 0; i < 16; i++)
+			sound.wave.set_wave_table(i, (byte_t)(i * 0x22 + 0x01));
+	});
+	sound.write_register([&](){
+		switch (channel){
+			case 0:
+			case 1:
+				{
+					auto &square = channel ? sound.square2 : sound.square1;
+					square.set_register1(0x80);
+					square.set_register3(0xC0);
+					square.set_register4(0x87);
+				}
+				break;
+			case 2:
+				sound.wave.set_register2(0x20);
+				sound.wave.set_register3(0xE0);
+				sound.wave.set_register4(0x87);
+				break;
+			case 3:
+				sound.noise.set_register3(0x00);
+				sound.noise.set_register4(0x80);
+				break;
+		}
+	});
+	auto start = gameboy.get_event_time(EventSource::Sound);
+	auto samples = run_frames(gameboy, frames);
+	auto elapsed = gameboy.get_event_time(EventSource::Sound) - start;
+	return samples ? elapsed * 1e9 / get_timer_resolution() / samples : 0;
+}
+
+static bool run_benchmark(std::ostream &results, const std::string &argument, unsigned frames, unsigned scanlines, unsigned channel_frames, int frameskip, bool render_thread){
+	std::string name;
+	StdStorageProvider storage;
+	auto rom = load_rom(storage, argument, name);
+	if (!rom){
+		std::cerr << "Can't load " << argument << std::endl;
+		return false;
+	}
+
+	NullProvider null;
+	StdDateTimeProvider datetime;
+	HostSystem system(&storage, &null, &null, &null, &null, &datetime);
+	auto &gameboy = system.get_guest();
+	if (!gameboy.get_storage_controller().load_cartridge(path_t(new StdBasicString<char>(name)), std::move(rom))){
+		std::cerr << "Not a supported ROM: " << name << std::endl;
+		return false;
+	}
+	gameboy.set_profiling(true);
+	gameboy.get_display_controller().set_frameskip(frameskip);
+	gameboy.get_display_controller().set_render_thread(render_thread);
+
+	auto start = get_timer_count();
+	run_frames(gameboy, frames);
+	auto elapsed = get_timer_count() - start;
+
+	double resolution = (double)get_timer_resolution();
+	double seconds = elapsed / resolution;
+	auto cycles = gameboy.get_system_clock().get_clock_value();
+	auto &cpu = gameboy.get_cpu();
+	auto instructions = cpu.get_total_instructions();
+	auto idle_cycles_skipped = cpu.get_idle_cycles_skipped();
+	auto &display = gameboy.get_display_controller();
+	display.flush_rendering();
+	auto frames_skipped = display.get_frames_skipped();
+	auto frames_dropped = display.get_frames_dropped();
+	auto frames_duplicated = display.get_frames_duplicated();
+	auto batched_frame_rate = display.get_batched_frame_rate();
+	auto sprite_bin_rebuilds = display.get_sprite_bin_rebuilds();
+	auto layer_cache_hit_rate = display.get_layer_cache().get_hit_rate();
+	display.set_render_thread(false);
+	auto scanline_time = time_scanlines(display, scanlines);
+
+	static const std::pair<EventSource, const char *> sources[] = {
+		{ EventSource::Timer, "timer" },
+		{ EventSource::Dma, "dma" },
+		{ EventSource::Input, "input" },
+		{ EventSource::Sound, "sound" },
+		{ EventSource::Display, "display" },
+	};
+	const size_t source_count = sizeof(sources) / sizeof(*sources);
+	std::uint64_t event_time = 0;
+	std::uint64_t event_times[source_count];
+	for (size_t i = 0; i < source_count; i++)
+		event_time += event_times[i] = gameboy.get_event_time(sources[i].first);
+
+	static const char * const channels[] = { "square1", "square2", "wave", "noise", "none" };
+	const unsigned channel_count = sizeof(channels) / sizeof(*channels);
+	double channel_time[channel_count];
+	for (unsigned i = 0; i < channel_count; i++)
+		channel_time[i] = time_channel(gameboy, i, channel_frames);
+
+	results
+		<< "{\"rom\": " << json_string(name)
+		<< ", \"frames\": " << frames
+		<< ", \"emulated_cycles\": " << cycles
+		<< ", \"instructions\": " << instructions
+		<< ", \"idle_cycles_skipped\": " << idle_cycles_skipped
+		<< ", \"wall_time\": " << seconds
+		<< ", \"emulated_mhz\": " << cycles / seconds / 1e6
+		<< ", \"speed\": " << cycles / (double)gb_cpu_frequency / seconds
+		<< ", \"frames_per_second\": " << frames / seconds
+		<< ", \"instructions_per_second\": " << instructions / seconds
+		<< ", \"render_thread\": " << (render_thread ? "true" : "false")
+		<< ", \"frames_skipped\": " << frames_skipped
+		<< ", \"frames_dropped\": " << frames_dropped
+		<< ", \"frames_duplicated\": " << frames_duplicated
+		<< ", \"batched_frame_rate\": " << batched_frame_rate
+		<< ", \"sprite_bin_rebuilds\": " << sprite_bin_rebuilds
+		<< ", \"layer_cache_hit_rate\": " << layer_cache_hit_rate
+		<< ", \"scanline_render_ns\": " << scanline_time
+		//CPU time includes everything that isn't an event.
+		<< ", \"subsystem_time\": {\"cpu\": " << (elapsed - event_time) / resolution;
+	for (size_t i = 0; i < source_count; i++)
+		results << ", \"" << sources[i].second << "\": " << event_times[i] / resolution;
+	results << "}, \"channel_sample_ns\": {";
+	for (unsigned i = 0; i < channel_count; i++)
+		results << (i ? ", \"" : "\"") << channels[i] << "\": " << channel_time[i];
+	results << "}}" << std::endl;
+	return true;
+}
+
+int main(int argc, char **argv){
+	unsigned frames = default_frames;
+	unsigned scanlines = default_scanlines;
+	unsigned channel_frames = default_channel_frames;
+	int frameskip = 0;
+	bool render_thread = false;
+	std::vector<std::string> roms;
+	for (int i = 1; i < argc; i++){
+		if (!strcmp(argv[i], "-frames") && i + 1 < argc)
+			frames = (unsigned)atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-scanlines") && i + 1 < argc)
+			scanlines = (unsigned)atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-channel-frames") && i + 1 < argc)
+			channel_frames = (unsigned)atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-frameskip") && i + 1 < argc){
+			i++;
+			frameskip = !strcmp(argv[i], "auto") ? DisplayController::auto_frameskip : atoi(argv[i]);
+		}else if (!strcmp(argv[i], "-render-thread"))
+			render_thread = true;
+		else
+			roms.push_back(argv[i]);
+	}
+	if (!roms.size()){
+		std::cerr << "Usage: " << argv[0] << " [-frames N] [-scanlines N] [-channel-frames N] [-frameskip N|auto] [-render-thread] ROM...\n";
+		return 1;
+	}
+
+	//The emulator reports various things through std::cout, so stdout is kept
+	//for the results only.
+	std::ostream results(std::cout.rdbuf());
+	std::cout.rdbuf(std::cerr.rdbuf());
+
+	int ret = 0;
+	for (auto &rom : roms){
+		try{
+			if (!run_benchmark(results, rom, frames, scanlines, channel_frames, frameskip, render_thread))
+				ret = 1;
+		}catch (std::exception &e){
+			std::cerr << rom << ": " << e.what() << std::endl;
+			ret = 1;
+		}
+	}
+	std::cout.rdbuf(results.rdbuf());
+	return ret;
+}
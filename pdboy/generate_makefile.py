@@ -30,16 +30,24 @@ def main():
 
 	cxx = 'c++'
 	cxxflags = '-O3 -std=c++14 ' + os.environ['INCLUDES']
-	libs = os.environ['LIBS']
-	output_file = 'pdboy'
-
-	objects = concat([x[1] for x in files])
+	#(output file, objects only it links, libraries)
+	targets = [
+		('pdboy', ['main.o', 'SdlProvider.o'], os.environ['LIBS']),
+		#Headless; doesn't need SDL.
+		('pdboy_bench', ['bench_main.o', 'ZipArchive.o'], ''),
+	]
+	exclusive = [y for x in targets for y in x[1]]
+	common = [x[1] for x in files if x[1] not in exclusive]
 
-	print('%s: %s'%(output_file, objects))
-	print('\t%s %s -s -o %s %s -pthread'%(cxx, objects, output_file, libs))
+	print('all: %s'%(concat([x[0] for x in targets])))
+	for (output_file, own_objects, libs) in targets:
+		objects = concat(common + own_objects)
+		print('')
+		print('%s: %s'%(output_file, objects))
+		print('\t%s %s -s -o %s %s -pthread'%(cxx, objects, output_file, libs))
 	print('')
 	print('clean:')
-	print('\trm %s %s'%(output_file, objects))
+	print('\trm %s %s'%(concat([x[0] for x in targets]), concat([x[1] for x in files])))
 	
 	for x in files:
 		print('')